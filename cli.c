@@ -0,0 +1,945 @@
+#include "cli.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+void *XRealloc(void *p, size_t size) {
+  p = realloc(p, size);
+  if (p == NULL) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+  return p;
+}
+
+const char *const reg_names[16] = {
+#define REG(name) name,
+#include "isa.def"
+};
+
+const char *flag_names[16] = {
+  ".nop", "",    ".c", ".nc",
+  ".v",   ".nv", ".z", ".nz",
+  ".s",   ".ns", ".b",  ".nb",
+  ".?",   ".?",  ".?",  ".?",
+};
+
+uint64_t NowNs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+// words から命令の各フィールドを取り出す
+void UnpackInstruction(struct Instruction *ins, const uint16_t *w, int len) {
+  ins->op = w[0] >> 8;
+  ins->out = w[0] & 0xffu;
+  ins->in = len >= 2 ? w[1] >> 8 : 0;
+  ins->imm8 = len >= 2 ? w[1] & 0xffu : 0;
+  ins->imm16 = len >= 3 ? w[2] : 0;
+}
+
+#define READER_CHUNK 65536
+
+// 戻り値: 成功なら 0、ファイルを開けなければ -1（errno を保持）
+int OpenReader(struct Reader *r, const char *path) {
+  memset(r, 0, sizeof(*r));
+  if (path == NULL) {
+    r->fp = stdin;
+    return 0;
+  }
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return -1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+    if (st.st_size == 0) {
+      close(fd);
+      r->buf = "";
+      return 0;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map != MAP_FAILED) {
+      close(fd);
+      r->map = map;
+      r->buf = map;
+      r->len = st.st_size;
+      return 0;
+    }
+  }
+  r->fp = fdopen(fd, "r");
+  return 0;
+}
+
+void CloseReader(struct Reader *r) {
+  if (r->map) {
+    munmap(r->map, r->len);
+  }
+  if (r->fp && r->fp != stdin) {
+    fclose(r->fp);
+  }
+  free(r->stream_buf);
+}
+
+// 次の 1 行を [*line, *line + *len) として返す（改行は含まない）。
+// 戻り値: 入力の終わりなら 0
+int ReadLine(struct Reader *r, const char **line, int *len) {
+  for (;;) {
+    const char *nl = r->pos < r->len ? memchr(r->buf + r->pos, '\n', r->len - r->pos) : NULL;
+    if (nl || r->fp == NULL || feof(r->fp) || ferror(r->fp)) {
+      if (r->pos == r->len) {
+        return 0;
+      }
+      *line = r->buf + r->pos;
+      *len = (nl ? nl : r->buf + r->len) - *line;
+      r->pos += *len + (nl != NULL);
+      return 1;
+    }
+
+    // 読み残しを先頭に寄せ、足りなければバッファを伸ばしてから追加で読む
+    size_t rest = r->len - r->pos;
+    if (r->cap - rest < READER_CHUNK) {
+      r->cap = r->cap ? r->cap * 2 : READER_CHUNK * 2;
+      char *b = XRealloc(NULL, r->cap);
+      memcpy(b, r->buf + r->pos, rest);
+      free(r->stream_buf);
+      r->stream_buf = b;
+    } else {
+      memmove(r->stream_buf, r->buf + r->pos, rest);
+    }
+    r->buf = r->stream_buf;
+    r->pos = 0;
+    r->len = rest + fread(r->stream_buf + rest, 1, r->cap - rest, r->fp);
+  }
+}
+
+void OpenWriter(struct Writer *w, int fd) {
+  w->fd = fd;
+  w->len = 0;
+  w->buf = XRealloc(NULL, WRITER_BUF_SIZE);
+  w->error = 0;
+}
+
+// 書けなくても終了はしない（--serve のサーバーは依頼をまたいで動き続ける）。
+// 最初の失敗だけ表示し、以降の出力は捨てる。
+void FlushWriter(struct Writer *w) {
+  size_t done = 0;
+  while (done < w->len && !w->error) {
+    ssize_t n = write(w->fd, w->buf + done, w->len - done);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("failed to write output");
+      w->error = 1;
+      break;
+    }
+    done += n;
+  }
+  w->len = 0;
+}
+
+int CloseWriter(struct Writer *w) {
+  FlushWriter(w);
+  free(w->buf);
+  if (w->fd != STDOUT_FILENO && close(w->fd) < 0 && !w->error) {
+    perror("failed to write output");
+    w->error = 1;
+  }
+  return w->error ? -1 : 0;
+}
+
+// n バイト書き込める領域を返す。書いた分は呼び出し側で w->len に足す。
+char *WriterReserve(struct Writer *w, size_t n) {
+  if (WRITER_BUF_SIZE - w->len < n) {
+    FlushWriter(w);
+  }
+  return w->buf + w->len;
+}
+
+void WriterPut(struct Writer *w, const char *s, size_t n) {
+  while (n > 0) { // バッファより大きくてもよいよう、空いている分ずつ書く
+    if (w->len == WRITER_BUF_SIZE) {
+      FlushWriter(w);
+    }
+    size_t k = WRITER_BUF_SIZE - w->len < n ? WRITER_BUF_SIZE - w->len : n;
+    memcpy(w->buf + w->len, s, k);
+    w->len += k;
+    s += k;
+    n -= k;
+  }
+}
+
+void WriterPutc(struct Writer *w, char c) {
+  *WriterReserve(w, 1) = c;
+  w->len++;
+}
+
+const char hex_upper[] = "0123456789ABCDEF";
+const char hex_lower[] = "0123456789abcdef";
+
+// v の下位 digits 桁を 16 進数で書く
+void WriterHex(struct Writer *w, uint32_t v, int digits, const char *table) {
+  char *p = WriterReserve(w, digits);
+  for (int i = digits - 1; i >= 0; i--) {
+    p[i] = table[v & 0xfu];
+    v >>= 4;
+  }
+  w->len += digits;
+}
+
+// 短い出力はバッファに直接書き、収まらなければ別に書いてから WriterPut で移す
+int WriterPrintf(struct Writer *w, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  char *p = WriterReserve(w, 256);
+  int n = vsnprintf(p, 256, fmt, ap);
+  va_end(ap);
+  if (n < 256) {
+    w->len += n > 0 ? n : 0;
+    return n;
+  }
+  char *buf = XRealloc(NULL, n + 1);
+  va_start(ap, fmt);
+  vsnprintf(buf, n + 1, fmt, ap);
+  va_end(ap);
+  WriterPut(w, buf, n);
+  free(buf);
+  return n;
+}
+
+void DumpWord(struct Writer *out, uint16_t word, int byte, int little_endian, int delim) {
+  if (!byte) {
+    WriterHex(out, word, 4, hex_upper);
+  } else {
+    uint8_t first = word >> 8;
+    uint8_t second = word & 0xffu;
+    if (little_endian) {
+      uint8_t tmp = first;
+      first = second;
+      second = tmp;
+    }
+    WriterHex(out, first, 2, hex_upper);
+    WriterPutc(out, ' ');
+    WriterHex(out, second, 2, hex_upper);
+  }
+  if (delim) {
+    WriterPutc(out, delim);
+  }
+}
+
+void PutSpace(struct Writer *out, int n) {
+  memset(WriterReserve(out, n), ' ', n);
+  out->len += n;
+}
+
+void DumpWordToBytes(uint8_t *buf, uint16_t word, int little) {
+  if (little) {
+    buf[0] = word & 0xffu;
+    buf[1] = word >> 8;
+  } else {
+    buf[0] = word >> 8;
+    buf[1] = word & 0xffu;
+  }
+}
+static const struct {
+  const char *name, *ext;
+} formats[] = {
+  [kFmtText] = {"text", ".txt"},
+  [kFmtBin] = {"bin", ".bin"},
+  [kFmtIHex] = {"ihex", ".hex"},
+  [kFmtReadmemh] = {"readmemh", ".mem"},
+  [kFmtHi] = {"hi", ".hi"},
+  [kFmtLo] = {"lo", ".lo"},
+};
+
+const char *FormatName(enum OutputFormat fmt) {
+  return formats[fmt].name;
+}
+
+const char *FormatExtension(enum OutputFormat fmt) {
+  return formats[fmt].ext;
+}
+
+// 形式名を [name, name + len) から引く。知らない名前ならメッセージを書いて -1 を返す。
+static int ParseFormat(const char *name, size_t len) {
+  for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+    if (strlen(formats[i].name) == len && strncmp(formats[i].name, name, len) == 0) {
+      return i;
+    }
+  }
+  fprintf(stderr, "unknown output format: '%.*s'\n", (int)len, name);
+  return -1;
+}
+
+int ParseOutputOption(struct Options *opt, int argc, char **argv, int *i) {
+  const char *arg = argv[*i];
+  if (strcmp(arg, "-d") == 0) {
+    opt->debug = 1;
+  } else if (strcmp(arg, "-b") == 0) {
+    opt->byte = 1;
+  } else if (strcmp(arg, "-l") == 0) {
+    opt->little = 1;
+  } else if (strcmp(arg, "-f") == 0 && *i + 1 < argc) {
+    const char *name = argv[++*i];
+    int fmt = ParseFormat(name, strlen(name));
+    if (fmt < 0) {
+      return -1;
+    }
+    opt->outfmt = fmt;
+  } else if (strcmp(arg, "--fill") == 0 && *i + 1 < argc) {
+    opt->fill = strtoul(argv[++*i], NULL, 0);
+  } else if (strcmp(arg, "--emit") == 0 && *i + 1 < argc) {
+    const char *spec = argv[++*i];
+    const char *eq = strchr(spec, '=');
+    if (eq == NULL || eq[1] == '\0') {
+      fprintf(stderr, "--emit takes format=path: '%s'\n", spec);
+      return -1;
+    }
+    int fmt = ParseFormat(spec, eq - spec);
+    if (fmt < 0) {
+      return -1;
+    }
+    opt->emits = XRealloc(opt->emits, sizeof(struct Emit) * (opt->num_emits + 1));
+    opt->emits[opt->num_emits].fmt = fmt;
+    opt->emits[opt->num_emits].path = eq + 1;
+    opt->num_emits++;
+  } else {
+    return 0;
+  }
+  return 1;
+}
+
+// 出力ファイルを開く。path が NULL なら標準出力。
+// 平坦なイメージをメモリマップして書けるよう、読み書き両用で開く。
+int OpenOutput(const char *path) {
+  if (path == NULL) {
+    return STDOUT_FILENO;
+  }
+  return open(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+}
+
+// アドレスを意識したイメージの書き出し
+//
+// .origin で飛んだアドレスはセグメントの隙間として扱い、平坦な形式では --fill の値で
+// 埋め、Intel HEX と $readmemh ではアドレスを指定し直して飛ばす。
+
+// 平坦な形式での 1 ワードのバイト数
+static int FlatWordBytes(enum OutputFormat fmt) {
+  return fmt == kFmtBin ? 2 : 1;
+}
+
+// 平坦な形式での 1 ワードのバイト列
+static void FlatWord(uint8_t *buf, uint16_t word, enum OutputFormat fmt, int little) {
+  if (fmt == kFmtBin) {
+    DumpWordToBytes(buf, word, little);
+  } else {
+    buf[0] = fmt == kFmtHi ? word >> 8 : word & 0xffu;
+  }
+}
+
+// n ワード分を fill で埋める
+static void FillFlat(uint8_t *dest, size_t n, const uint8_t *fill, int bpw) {
+  if (bpw == 1 || fill[0] == fill[1]) {
+    memset(dest, fill[0], n * bpw);
+    return;
+  }
+  for (size_t i = 0; i < n; i++) {
+    memcpy(dest + i * 2, fill, 2);
+  }
+}
+
+// 通常ファイル fd をイメージの大きさに伸ばしてメモリマップし、直接書く。
+// 隙間のうち fill が 0 の部分は書かないので、ファイルシステムが対応していれば穴になる。
+// 先頭から書く空のファイルに限る。>> や既に中身のある標準出力は壊さないよう順に書く。
+// 戻り値: 書けたら 0、fd が空の通常ファイルでないなどでマップできなければ -1
+static int WriteFlatMapped(int fd, const struct nlpasm_segment *segs, size_t num_segs,
+                           const uint16_t *words, enum OutputFormat fmt, const uint8_t *fill,
+                           int little) {
+  struct stat st;
+  if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size != 0) {
+    return -1;
+  }
+  int flags = fcntl(fd, F_GETFL);
+  if (flags < 0 || (flags & O_APPEND) || lseek(fd, 0, SEEK_CUR) != 0) {
+    return -1;
+  }
+  int bpw = FlatWordBytes(fmt);
+  size_t size = num_segs ? (segs[num_segs - 1].addr + segs[num_segs - 1].len) * bpw : 0;
+  if (size == 0) {
+    return 0;
+  }
+  if (ftruncate(fd, size) < 0) {
+    return -1;
+  }
+  uint8_t *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    return -1;
+  }
+  int fill_zero = fill[0] == 0 && (bpw == 1 || fill[1] == 0);
+  size_t addr = 0;
+  for (size_t s = 0; s < num_segs; s++) {
+    if (!fill_zero && segs[s].addr > addr) {
+      FillFlat(map + addr * bpw, segs[s].addr - addr, fill, bpw);
+    }
+    uint8_t *p = map + (size_t)segs[s].addr * bpw;
+    const uint16_t *w = words + segs[s].pos;
+    for (size_t i = 0; i < segs[s].len; i++) {
+      FlatWord(p + i * bpw, w[i], fmt, little);
+    }
+    addr = segs[s].addr + segs[s].len;
+  }
+  munmap(map, size);
+  return 0;
+}
+
+// パイプなどマップできない出力には、隙間を埋めながら順に書く
+static void WriteFlatStream(struct Writer *out, const struct nlpasm_segment *segs,
+                            size_t num_segs, const uint16_t *words, enum OutputFormat fmt,
+                            const uint8_t *fill, int little) {
+  int bpw = FlatWordBytes(fmt);
+  size_t addr = 0;
+  for (size_t s = 0; s < num_segs; s++) {
+    while (addr < segs[s].addr) {
+      size_t n = segs[s].addr - addr;
+      if (n > WRITER_BUF_SIZE / 2) {
+        n = WRITER_BUF_SIZE / 2;
+      }
+      FillFlat((uint8_t *)WriterReserve(out, n * bpw), n, fill, bpw);
+      out->len += n * bpw;
+      addr += n;
+    }
+    const uint16_t *w = words + segs[s].pos;
+    for (size_t i = 0; i < segs[s].len; i++) {
+      FlatWord((uint8_t *)WriterReserve(out, 2), w[i], fmt, little);
+      out->len += bpw;
+    }
+    addr = segs[s].addr + segs[s].len;
+  }
+}
+
+// Intel HEX の 1 レコード
+static void IHexRecord(struct Writer *out, int type, uint16_t addr, const uint8_t *data,
+                       int n) {
+  uint8_t sum = n + (addr >> 8) + (addr & 0xffu) + type;
+  WriterPutc(out, ':');
+  WriterHex(out, n, 2, hex_upper);
+  WriterHex(out, addr, 4, hex_upper);
+  WriterHex(out, type, 2, hex_upper);
+  for (int i = 0; i < n; i++) {
+    WriterHex(out, data[i], 2, hex_upper);
+    sum += data[i];
+  }
+  WriterHex(out, (uint8_t)-sum, 2, hex_upper);
+  WriterPutc(out, '\n');
+}
+
+#define IHEX_RECORD_BYTES 16
+
+// Intel HEX。アドレスはバイト単位（ワードアドレスの 2 倍）で、バイト順は -l に従う。
+// 64K バイトを越えるアドレスは拡張リニアアドレス（タイプ 04）で指定する。
+static void WriteIHex(struct Writer *out, const struct nlpasm_segment *segs, size_t num_segs,
+                      const uint16_t *words, int little) {
+  uint32_t upper = 0;
+  for (size_t s = 0; s < num_segs; s++) {
+    uint32_t addr = segs[s].addr * 2;
+    const uint16_t *w = words + segs[s].pos;
+    size_t num_bytes = segs[s].len * 2;
+    for (size_t done = 0; done < num_bytes; ) {
+      if (addr >> 16 != upper) {
+        upper = addr >> 16;
+        uint8_t ext[2] = {upper >> 8, upper & 0xffu};
+        IHexRecord(out, 4, 0, ext, 2);
+      }
+      // 64K バイトの境界をまたがないように区切る
+      size_t n = num_bytes - done;
+      if (n > IHEX_RECORD_BYTES) {
+        n = IHEX_RECORD_BYTES;
+      }
+      if (n > 0x10000 - (addr & 0xffffu)) {
+        n = 0x10000 - (addr & 0xffffu);
+      }
+      uint8_t data[IHEX_RECORD_BYTES + 1];
+      for (size_t i = 0; i < n; i += 2) {
+        DumpWordToBytes(data + i, w[(done + i) / 2], little);
+      }
+      IHexRecord(out, 0, addr & 0xffffu, data, n);
+      done += n;
+      addr += n;
+    }
+  }
+  IHexRecord(out, 1, 0, NULL, 0);
+}
+
+// $readmemh: セグメントごとに @アドレス（ワード単位）を書き、1 行 1 ワードで並べる
+static void WriteReadmemh(struct Writer *out, const struct nlpasm_segment *segs,
+                          size_t num_segs, const uint16_t *words) {
+  for (size_t s = 0; s < num_segs; s++) {
+    WriterPrintf(out, "@%X\n", (unsigned)segs[s].addr);
+    const uint16_t *w = words + segs[s].pos;
+    for (size_t i = 0; i < segs[s].len; i++) {
+      WriterHex(out, w[i], 4, hex_upper);
+      WriterPutc(out, '\n');
+    }
+  }
+}
+
+static int WriteImageAs(struct Writer *out, struct nlpasm_ctx *ctx, const struct Options *opt,
+                        enum OutputFormat fmt) {
+  int debug = opt->debug, byte = opt->byte, little = opt->little;
+  size_t num_words, num_insns;
+  const uint16_t *words = nlpasm_get_image(ctx, &num_words);
+  const struct nlpasm_insn *insns = nlpasm_get_insns(ctx, &num_insns);
+
+  if (fmt != kFmtText) {
+    size_t num_segs;
+    const struct nlpasm_segment *segs = nlpasm_get_segments(ctx, &num_segs);
+    for (size_t s = 1; s < num_segs; s++) {
+      if (segs[s].addr < segs[s - 1].addr + segs[s - 1].len) {
+        fprintf(stderr, "segments overlap at 0x%X (.origin moved backwards)\n",
+                (unsigned)segs[s].addr);
+        return -1;
+      }
+    }
+    uint8_t fill[2] = {0, 0};
+    FlatWord(fill, opt->fill, fmt, little);
+    switch (fmt) {
+    case kFmtBin:
+    case kFmtHi:
+    case kFmtLo:
+      FlushWriter(out);
+      if (WriteFlatMapped(out->fd, segs, num_segs, words, fmt, fill, little) < 0) {
+        WriteFlatStream(out, segs, num_segs, words, fmt, fill, little);
+      }
+      break;
+    case kFmtIHex:
+      WriteIHex(out, segs, num_segs, words, little);
+      break;
+    case kFmtReadmemh:
+      WriteReadmemh(out, segs, num_segs, words);
+      break;
+    case kFmtText:
+      break;
+    }
+    return 0;
+  }
+
+  for (size_t i = 0; i < num_insns; i++) {
+    // .origin は len が 0 なので何も書かない。長いデータは 3 ワードずつの行に分ける
+    for (int k = 0; k < insns[i].len; k += 3) {
+      const uint16_t *w = words + insns[i].pos + k;
+      int len = insns[i].len - k < 3 ? insns[i].len - k : 3;
+      if (debug) {
+        WriterHex(out, insns[i].ip + k, 8, hex_lower);
+        WriterPut(out, ": ", 2);
+      }
+      for (int j = 0; j < 3; j++) {
+        if (j < len) {
+          DumpWord(out, w[j], byte, little, debug ? ' ' : '\n');
+        } else if (debug) {
+          PutSpace(out, 5 + byte);
+        }
+      }
+      if (debug) {
+        char text[DIS_TEXT_MAX];
+        int n = insns[i].data ? FormatData(text, w, len) : FormatInsn(text, w, len);
+        WriterPut(out, "; ", 2);
+        WriterPut(out, text, n);
+        WriterPutc(out, '\n');
+      }
+    }
+  }
+  return 0;
+}
+
+int WriteImage(struct Writer *out, struct nlpasm_ctx *ctx, const struct Options *opt) {
+  return WriteImageAs(out, ctx, opt, opt->outfmt);
+}
+
+int WriteEmits(struct nlpasm_ctx *ctx, const struct Options *opt) {
+  for (int i = 0; i < opt->num_emits; i++) {
+    const struct Emit *e = opt->emits + i;
+    int fd = OpenOutput(e->path);
+    if (fd < 0) {
+      perror(e->path);
+      return -1;
+    }
+    struct Writer w;
+    OpenWriter(&w, fd);
+    int err = WriteImageAs(&w, ctx, opt, e->fmt);
+    if (CloseWriter(&w) < 0) {
+      err = -1;
+    }
+    if (err) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// 逆アセンブラ
+//
+// オペコードごとに、その命令を作りうるニーモニックと形式を isa.def から表にしておき、
+// 1 命令ずつ表を引いて書く。出力は再びアセンブルすると同じワード列になるソースで、
+// アセンブラが作らない形（使わない即値欄が 0 でない、同じ即値欄を 2 回指すなど）は
+// .dw で書く。
+
+enum DisForm {
+  kDisEncALU3, kDisEncALU2, kDisEncMov, kDisEncJump, kDisEncLoad, kDisEncStore,
+  kDisEncOut, kDisEncCmp, kDisEncRet,
+  kDisEncDW, kDisEncFill, kDisEncString, kDisEncIncbin, kDisEncOrigin, kDisEncGlobal,
+  kDisEncEqu, kDisEncLowData, kDisEncInclude, kDisEncMacro, kDisEncRept, kDisEncEnd, // 疑似命令
+};
+
+static const struct {
+  const char *name;
+  uint8_t op, op_rel, form;
+} dis_isa[] = {
+#define MNEMONIC(name, op, op_rel, enc) {name, op, op_rel, kDis##enc},
+#include "isa.def"
+};
+
+// 1 つのオペコードを作りうる命令（isa.def の順）。jmp と mov、cmp と sub、
+// ret と pop のように同じオペコードを共有する命令があるので、後に定義された
+// （より限定的な）ものから順に試す。
+#define DIS_MAX_CAND 3
+struct DisOp {
+  int num_cand;
+  struct {
+    const char *name;
+    uint8_t form;
+    uint8_t dir; // 0: 絶対アドレス形式、1: in1 - in2、2: in1 + in2
+  } cand[DIS_MAX_CAND];
+};
+
+static struct DisOp dis_ops[256];
+enum { kRegIP = 13, kRegZR = 15 }; // isa.def の REG の順
+static pthread_once_t dis_once = PTHREAD_ONCE_INIT;
+
+static void AddDisCand(uint8_t op, const char *name, uint8_t form, uint8_t dir) {
+  struct DisOp *d = dis_ops + op;
+  for (int i = 0; i < d->num_cand; i++) {
+    if (d->cand[i].form == form) { // sar と slr のような完全な別名は最初の名前で書く
+      return;
+    }
+  }
+  if (d->num_cand < DIS_MAX_CAND) {
+    d->cand[d->num_cand].name = name;
+    d->cand[d->num_cand].form = form;
+    d->cand[d->num_cand].dir = dir;
+    d->num_cand++;
+  }
+}
+
+static void InitDisTable(void) {
+  for (size_t i = 0; i < sizeof(dis_isa) / sizeof(dis_isa[0]); i++) {
+    uint8_t form = dis_isa[i].form;
+    if (form >= kDisEncDW) {
+      continue;
+    }
+    AddDisCand(dis_isa[i].op, dis_isa[i].name, form, 0);
+    for (int dir = 1; dis_isa[i].op_rel && dir <= 2; dir++) {
+      AddDisCand(dis_isa[i].op_rel | dir, dis_isa[i].name, form, dir);
+    }
+  }
+}
+
+static char *DisStr(char *p, const char *s) {
+  size_t n = strlen(s);
+  memcpy(p, s, n);
+  return p + n;
+}
+
+static char *DisHex(char *p, unsigned v, int digits) {
+  p[0] = '0';
+  p[1] = 'x';
+  for (int i = digits - 1; i >= 0; i--) {
+    p[2 + i] = hex_upper[v & 0xfu];
+    v >>= 4;
+  }
+  return p + 2 + digits;
+}
+
+// 入力ニブル nib が指すオペランドを書く。
+// imm16 の値が 0〜255 なら、imm8 にならないよう word を付ける。
+static char *DisInput(char *p, int nib, const uint16_t *w) {
+  if (nib == 1) {
+    return DisHex(p, w[1] & 0xffu, 2);
+  } else if (nib == 2) {
+    if (w[2] < 256) {
+      p = DisStr(p, "word ");
+    }
+    return DisHex(p, w[2], 4);
+  }
+  return DisStr(p, reg_names[nib]);
+}
+
+// 絶対アドレス形式の番地。ここに byte/word を付けると IP 相対の意味になるので、
+// 値の大きさで即値欄が決まる場合しか書けない。戻り値: 書けなければ NULL
+static char *DisAbsAddr(char *p, int in1, int in2, const uint16_t *w) {
+  if (in2 != 0 || (in1 != 1 && in1 != 2) || (in1 == 2 && w[2] < 256)) {
+    return NULL;
+  }
+  return DisInput(p, in1, w);
+}
+
+// レジスタ相対形式の番地（in1 +/- in2）
+// アセンブラは負になる imm16（0x8000 以上）を符号と方向を反転して符号化するので、
+// そのままの形では書けない。
+static char *DisRelAddr(char *p, int dir, int in1, int in2, const uint16_t *w) {
+  if (in1 == 1 || in1 == 2 || (in2 == 2 && w[2] >= 0x8000)) {
+    return NULL;
+  }
+  p = DisStr(p, reg_names[in1]);
+  *p++ = dir == 1 ? '-' : '+';
+  return DisInput(p, in2, w);
+}
+
+static char *DisAddr(char *p, int dir, int in1, int in2, const uint16_t *w) {
+  return dir ? DisRelAddr(p, dir, in1, in2, w) : DisAbsAddr(p, in1, in2, w);
+}
+
+// op の候補 c の形式で書く。戻り値: 書いた後の位置、その形式に合わなければ NULL
+static char *DisFormat(char *p, const struct DisOp *d, int c, const uint16_t *w, int len) {
+  int cond = (w[0] >> 4) & 0xfu, out = w[0] & 0xfu;
+  int in1 = len >= 2 ? w[1] >> 12 : 0, in2 = len >= 2 ? (w[1] >> 8) & 0xfu : 0;
+  int dir = d->cand[c].dir;
+  int form = d->cand[c].form;
+  int one_word = form == kDisEncOut || form == kDisEncRet;
+  if (one_word != (len == 1)) {
+    return NULL;
+  }
+  p = DisStr(DisStr(p, d->cand[c].name), flag_names[cond]);
+
+  switch (form) {
+  case kDisEncALU3:
+    p = DisStr(DisStr(p, " "), reg_names[out]);
+    p = DisInput(DisStr(p, ", "), in1, w);
+    return DisInput(DisStr(p, ", "), in2, w);
+  case kDisEncALU2:
+  case kDisEncMov:
+    if (in2 != 0) {
+      return NULL;
+    }
+    p = DisStr(DisStr(p, " "), reg_names[out]);
+    return DisInput(DisStr(p, ", "), in1, w);
+  case kDisEncCmp:
+    if (out != kRegZR) {
+      return NULL;
+    }
+    p = DisInput(DisStr(p, " "), in1, w);
+    return DisInput(DisStr(p, ", "), in2, w);
+  case kDisEncJump:
+    if (out != kRegIP) {
+      return NULL;
+    }
+    return DisAddr(DisStr(p, " "), dir, in1, in2, w);
+  case kDisEncLoad:
+    p = DisStr(DisStr(p, " "), reg_names[out]);
+    return DisAddr(DisStr(p, ", "), dir, in1, in2, w);
+  case kDisEncStore:
+    p = DisAddr(DisStr(p, " "), dir, in1, in2, w);
+    return p ? DisStr(DisStr(p, ", "), reg_names[out]) : NULL;
+  case kDisEncOut:
+    return DisStr(DisStr(p, " "), reg_names[out]);
+  case kDisEncRet:
+    return out == kRegIP ? p : NULL;
+  }
+  return NULL;
+}
+
+int FormatData(char *buf, const uint16_t *w, int len) {
+  char *p = DisStr(buf, ".dw ");
+  for (int i = 0; i < len; i++) {
+    p = DisHex(i ? DisStr(p, ", ") : p, w[i], 4);
+  }
+  return p - buf;
+}
+
+int FormatInsn(char *buf, const uint16_t *w, int len) {
+  pthread_once(&dis_once, InitDisTable);
+  const struct DisOp *d = dis_ops + (w[0] >> 8);
+  int cond = (w[0] >> 4) & 0xfu;
+  int in1 = len >= 2 ? w[1] >> 12 : 0, in2 = len >= 2 ? (w[1] >> 8) & 0xfu : 0;
+  // 条件が定義されていない、同じ即値欄を 2 回指す、使わない imm8 が 0 でない
+  int valid = flag_names[cond][1] != '?' &&
+              !(len >= 2 && in1 == in2 && (in1 == 1 || in1 == 2)) &&
+              !(len >= 2 && in1 != 1 && in2 != 1 && (w[1] & 0xffu) != 0);
+  for (int c = d->num_cand - 1; valid && c >= 0; c--) {
+    char *p = DisFormat(buf, d, c, w, len);
+    if (p) {
+      return p - buf;
+    }
+  }
+  return FormatData(buf, w, len);
+}
+
+// 逆アセンブルの 1 行: 命令、番地と元のワード、IP 相対ジャンプなら飛び先
+#define DIS_COMMENT_COLUMN 32
+
+void WriteDisassembly(struct Writer *out, const uint16_t *words, size_t num_words) {
+  for (size_t pos = 0; pos < num_words; ) {
+    const uint16_t *w = words + pos;
+    int len = nlpasm_insn_len(w);
+    if (pos + len > num_words) { // 末尾で途切れた命令
+      len = num_words - pos;
+    }
+    char text[DIS_TEXT_MAX];
+    int n = FormatInsn(text, w, len);
+    WriterPut(out, "    ", 4);
+    WriterPut(out, text, n);
+    PutSpace(out, n < DIS_COMMENT_COLUMN ? DIS_COMMENT_COLUMN - n : 1);
+    WriterPut(out, "; ", 2);
+    WriterHex(out, pos, pos > 0xffff ? 8 : 4, hex_upper);
+    WriterPutc(out, ':');
+    for (int i = 0; i < len; i++) {
+      WriterPutc(out, ' ');
+      WriterHex(out, w[i], 4, hex_upper);
+    }
+    // out が ip の加減算（IP 相対ジャンプ）は飛び先を添える
+    uint8_t op = w[0] >> 8;
+    if (len >= 2 && (w[0] & 0xfu) == kRegIP && (w[1] >> 12) == kRegIP &&
+        (op == 0x11 || op == 0x12)) {
+      int in2 = (w[1] >> 8) & 0xfu;
+      unsigned d = in2 == 1 ? (w[1] & 0xffu) : in2 == 2 ? w[2] : 0;
+      if (in2 == 1 || in2 == 2) {
+        uint16_t target = op == 0x12 ? pos + len + d : pos + len - d;
+        WriterPut(out, " -> ", 4);
+        WriterHex(out, target, 4, hex_upper);
+      }
+    }
+    WriterPutc(out, '\n');
+    pos += len;
+  }
+}
+
+void PrintRewrites(FILE *fp, struct nlpasm_ctx *ctx, const char *src_name) {
+  size_t n;
+  const char *note;
+  const struct nlpasm_rewrite *rw = nlpasm_get_rewrites(ctx, &n, &note);
+  int total = 0;
+  for (size_t i = 0; i < n; i++) {
+    const struct nlpasm_rewrite *r = rw + i;
+    if (r->line > 0) {
+      fprintf(fp, "%s:%d: ", src_name, r->line);
+    } else {
+      fprintf(fp, "%s: ", src_name);
+    }
+    switch (r->kind) {
+    case NLPASM_REWRITE_SHORT_IMM:
+      fprintf(fp, "'word' literal %d fits in imm8", r->value);
+      break;
+    case NLPASM_REWRITE_NEGATE:
+      fprintf(fp, "negative literal -> add/sub swapped with imm8 %d", r->value);
+      break;
+    case NLPASM_REWRITE_INC:
+      fprintf(fp, "add of 1 -> inc");
+      break;
+    case NLPASM_REWRITE_DEC:
+      fprintf(fp, "sub of 1 -> dec");
+      break;
+    case NLPASM_REWRITE_TAIL_CALL:
+      fprintf(fp, "call followed by ret -> jmp");
+      break;
+    case NLPASM_REWRITE_MOV_SELF:
+      fprintf(fp, "mov to the same register removed");
+      break;
+    }
+    fprintf(fp, " (saves %d word%s)\n", r->words_saved, r->words_saved == 1 ? "" : "s");
+    total += r->words_saved;
+  }
+  if (note) {
+    fprintf(fp, "%s: %s\n", src_name, note);
+  }
+  fprintf(fp, "%s: %zu rewrite%s, %d word%s saved\n", src_name, n, n == 1 ? "" : "s",
+          total, total == 1 ? "" : "s");
+}
+
+void PrintLowData(FILE *fp, struct nlpasm_ctx *ctx, const char *src_name) {
+  size_t n;
+  const struct nlpasm_lowdata *ld = nlpasm_get_lowdata(ctx, &n);
+  if (n == 0) {
+    return;
+  }
+  int placed = 0, total = 0;
+  for (size_t i = 0; i < n; i++) {
+    const struct nlpasm_lowdata *d = ld + i;
+    if (d->line > 0) {
+      fprintf(fp, "%s:%d: ", src_name, d->line);
+    } else {
+      fprintf(fp, "%s: ", src_name);
+    }
+    fprintf(fp, "'%s' (%d word%s, %d ref%s) %s 0x%04x", d->symbol ? d->symbol : "",
+            d->len, d->len == 1 ? "" : "s", d->refs, d->refs == 1 ? "" : "s",
+            d->placed ? "placed at" : "left at", d->addr);
+    if (d->words_saved) {
+      fprintf(fp, " (saves %d word%s)", d->words_saved, d->words_saved == 1 ? "" : "s");
+    }
+    fputc('\n', fp);
+    placed += d->placed;
+    total += d->words_saved;
+  }
+  fprintf(fp, "%s: %d of %zu .lowdata block%s placed below 0x100, %d word%s saved\n", src_name,
+          placed, n, n == 1 ? "" : "s", total, total == 1 ? "" : "s");
+}
+
+// JSON の文字列として s を書く
+static void PutJsonString(FILE *fp, const char *s) {
+  fputc('"', fp);
+  for (; *s; s++) {
+    unsigned char c = *s;
+    if (c == '"' || c == '\\') {
+      fprintf(fp, "\\%c", c);
+    } else if (c < 0x20) {
+      fprintf(fp, "\\u%04x", c);
+    } else {
+      fputc(c, fp);
+    }
+  }
+  fputc('"', fp);
+}
+
+void PrintDiagnostics(FILE *fp, struct nlpasm_ctx *ctx, const char *src_name, int json) {
+  size_t n;
+  const struct nlpasm_diag *d = nlpasm_get_diags(ctx, &n);
+  if (json) {
+    fputs("{\"file\": ", fp);
+    PutJsonString(fp, src_name);
+    fprintf(fp, ", \"errors\": %zu, \"stopped\": %s, \"diagnostics\": [", n,
+            nlpasm_stopped(ctx) ? "true" : "false");
+    for (size_t i = 0; i < n; i++) {
+      fputs(i ? ", {\"file\": " : "{\"file\": ", fp);
+      PutJsonString(fp, d[i].file ? d[i].file : src_name);
+      fprintf(fp, ", \"line\": %d, \"column\": %d, \"message\": ", d[i].line, d[i].column);
+      PutJsonString(fp, d[i].message);
+      fputc('}', fp);
+    }
+    fputs("]}\n", fp);
+    return;
+  }
+
+  for (size_t i = 0; i < n; i++) {
+    fputs(d[i].file ? d[i].file : src_name, fp);
+    if (d[i].line > 0) {
+      fprintf(fp, ":%d", d[i].line);
+    }
+    if (d[i].column > 0) {
+      fprintf(fp, ":%d", d[i].column);
+    }
+    fprintf(fp, ": error: %s\n", d[i].message);
+  }
+  if (nlpasm_stopped(ctx) && n > 1) {
+    fprintf(fp, "%s: too many errors, stopped after %zu\n", src_name, n);
+  }
+}
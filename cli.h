@@ -0,0 +1,137 @@
+#pragma once
+
+// nlpasm・nlplink など、コマンドラインツールが共有する入出力まわり
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "nlpasm.h"
+
+void *XRealloc(void *p, size_t size);
+
+// 経過時間の計測用（単調増加する時計、ナノ秒）
+uint64_t NowNs(void);
+
+extern const char *const reg_names[16];
+extern const char *flag_names[16];
+
+struct Instruction {
+  uint8_t op, out;
+  uint8_t in, imm8;
+  uint16_t imm16;
+};
+
+void UnpackInstruction(struct Instruction *ins, const uint16_t *w, int len);
+
+// 入力ソース
+// ファイルはメモリマップして直接読み、標準入力などマップできないものは
+// バッファに少しずつ読み込む。ReadLine が返す行はバッファを直接指し、
+// 次に ReadLine を呼ぶまで有効。
+struct Reader {
+  const char *buf;
+  size_t len, pos;
+  FILE *fp;         // ストリーム入力のときだけ使う
+  char *stream_buf;
+  size_t cap;
+  void *map;        // メモリマップした領域
+};
+
+int OpenReader(struct Reader *r, const char *path);
+void CloseReader(struct Reader *r);
+int ReadLine(struct Reader *r, const char **line, int *len);
+
+// 出力バッファ
+// すべての出力形式はここに書き込み、大きな単位でまとめて write する。
+#define WRITER_BUF_SIZE (1 << 18)
+struct Writer {
+  int fd;
+  size_t len;
+  char *buf;
+  int error; // 書けなかったら 1。以降の出力は捨てて、CloseWriter が -1 を返す
+};
+
+extern const char hex_upper[];
+extern const char hex_lower[];
+
+void OpenWriter(struct Writer *w, int fd);
+void FlushWriter(struct Writer *w);
+// 戻り値: すべて書けたら 0、途中で書けなかったら -1（メッセージは表示済み）
+int CloseWriter(struct Writer *w);
+char *WriterReserve(struct Writer *w, size_t n);
+void WriterPut(struct Writer *w, const char *s, size_t n);
+void WriterPutc(struct Writer *w, char c);
+void WriterHex(struct Writer *w, uint32_t v, int digits, const char *table);
+int WriterPrintf(struct Writer *w, const char *fmt, ...)
+  __attribute__((format(printf, 2, 3)));
+void DumpWord(struct Writer *out, uint16_t word, int byte, int little_endian, int delim);
+void PutSpace(struct Writer *out, int n);
+
+enum OutputFormat {
+  kFmtText,
+  kFmtBin,      // アドレス 0 からの平坦なバイナリ。隙間は --fill の値で埋める
+  kFmtIHex,     // Intel HEX（バイトアドレス）
+  kFmtReadmemh, // Verilog の $readmemh 形式（ワードアドレス）
+  kFmtHi,       // 各ワードの上位バイトだけを並べた 8 ビット ROM 用イメージ
+  kFmtLo,       // 同じく下位バイト
+};
+
+// 形式名（-f や --emit で指定するもの）と --batch で使う拡張子
+const char *FormatName(enum OutputFormat fmt);
+const char *FormatExtension(enum OutputFormat fmt);
+
+// --emit で追加する出力
+struct Emit {
+  enum OutputFormat fmt;
+  const char *path;
+};
+
+void DumpWordToBytes(uint8_t *buf, uint16_t word, int little);
+
+struct Options {
+  int debug, byte, little;
+  enum OutputFormat outfmt;
+  int incremental; // 出力ファイルの隣に行キャッシュを置く
+  int object;      // 最終イメージの代わりにオブジェクトファイルを出力する（-c）
+  int optimize;    // のぞき穴最適化をする（-O）
+  uint16_t fill;   // 平坦なイメージの隙間を埋めるワード（--fill）
+  struct Emit *emits;
+  int num_emits;
+  const char **include_dirs; // .include を探すディレクトリ（-I）
+  int num_include_dirs;
+  int make_deps;             // Make 形式の依存ファイルを書く（-MD）
+  const char *dep_file;      // 依存ファイルの名前（-MF）。NULL なら出力ファイルから決める
+  int max_errors;            // この数のエラーで打ち切る（--max-errors）。0 なら打ち切らない
+  int diag_json;             // エラーを JSON で書く（--diagnostics=json）
+};
+
+// argv[*i] が出力形式のオプション（-d, -b, -l, -f, --fill, --emit）なら opt に反映し、
+// 引数を取るものは *i を進める。
+// 戻り値: 出力形式のオプションなら 1、そうでなければ 0、誤りがあれば -1（メッセージを stderr に書く）
+int ParseOutputOption(struct Options *opt, int argc, char **argv, int *i);
+
+int OpenOutput(const char *path);
+// アセンブル結果を opt->outfmt の形式で out に書く。
+// 平坦な形式（bin, hi, lo）は、out が通常ファイルならメモリマップして直接書く。
+// 戻り値: 成功なら 0、セグメントが重なっていれば -1（メッセージを stderr に書く）
+int WriteImage(struct Writer *out, struct nlpasm_ctx *ctx, const struct Options *opt);
+// --emit で指定された出力をすべて書く。戻り値: 成功なら 0、失敗があれば -1
+int WriteEmits(struct nlpasm_ctx *ctx, const struct Options *opt);
+
+// 逆アセンブラ
+// w[0..len) の 1 命令を、再びアセンブルすると同じワード列になるソースとして buf に書く。
+// アセンブラが作らない形なら .dw で書く。戻り値: 書いた長さ（NUL は付けない）
+#define DIS_TEXT_MAX 64
+int FormatInsn(char *buf, const uint16_t *w, int len);
+// w[0..len) を .dw として書く
+int FormatData(char *buf, const uint16_t *w, int len);
+// イメージ全体を先頭から 1 命令ずつ逆アセンブルする（-D）
+void WriteDisassembly(struct Writer *out, const uint16_t *words, size_t num_words);
+
+// -O で行った書き換えを 1 行ずつ fp に書く。src_name は行番号の前に付ける名前。
+void PrintRewrites(FILE *fp, struct nlpasm_ctx *ctx, const char *src_name);
+// .lowdata のかたまりの配置を 1 行ずつ fp に書く。かたまりが無ければ何も書かない。
+void PrintLowData(FILE *fp, struct nlpasm_ctx *ctx, const char *src_name);
+// エラーを 1 行 1 件（file:line:col: error: ...）で fp に書く。
+// json なら src_name のエラーをまとめた 1 行の JSON を、エラーが無くても書く。
+void PrintDiagnostics(FILE *fp, struct nlpasm_ctx *ctx, const char *src_name, int json);
@@ -0,0 +1,80 @@
+// isa.def の名前表から完全ハッシュ表を生成し、isa_hash.h として標準出力に書く
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "isa.h"
+
+const char *mnemonics[] = {
+#define MNEMONIC(name, op, op_rel, enc) name,
+#include "isa.def"
+};
+
+const char *regs[] = {
+#define REG(name) name,
+#include "isa.def"
+};
+
+const char *flags[] = {
+#define FLAG(name, bits) name,
+#include "isa.def"
+};
+
+#define NUM(a) ((int)(sizeof(a) / sizeof((a)[0])))
+
+// names を衝突なく size 個のスロットに割り当てる seed を探す
+// 見つからなければ 0 を返す
+uint32_t FindSeed(const char **names, int n, int size, int *slots) {
+  for (uint32_t seed = 1; seed < 1000000; seed++) {
+    for (int i = 0; i < size; i++) {
+      slots[i] = -1;
+    }
+    int i;
+    for (i = 0; i < n; i++) {
+      int s = IsaHash(names[i], strlen(names[i]), seed) & (size - 1);
+      if (slots[s] >= 0) {
+        break;
+      }
+      slots[s] = i;
+    }
+    if (i == n) {
+      return seed;
+    }
+  }
+  return 0;
+}
+
+void GenTable(const char *macro, const char *var, const char **names, int n) {
+  int size = 1;
+  while (size < n) {
+    size *= 2;
+  }
+
+  for (;; size *= 2) {
+    int *slots = malloc(size * sizeof(int));
+    uint32_t seed = FindSeed(names, n, size, slots);
+    if (seed == 0) {
+      free(slots);
+      continue;
+    }
+
+    printf("#define %s_HASH_SEED %uu\n", macro, seed);
+    printf("#define %s_HASH_SIZE %d\n", macro, size);
+    printf("static const int8_t %s_hash_slots[%d] = {", var, size);
+    for (int i = 0; i < size; i++) {
+      printf("%s%d,", i % 16 ? " " : "\n  ", slots[i]);
+    }
+    printf("\n};\n\n");
+    free(slots);
+    return;
+  }
+}
+
+int main(void) {
+  printf("// genhash が生成したファイル。編集しないこと。\n\n");
+  printf("#include <stdint.h>\n\n");
+  GenTable("MNEMONIC", "mnemonic", mnemonics, NUM(mnemonics));
+  GenTable("REG", "reg", regs, NUM(regs));
+  GenTable("FLAG", "flag", flags, NUM(flags));
+  return 0;
+}
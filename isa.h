@@ -0,0 +1,14 @@
+#pragma once
+
+#include <ctype.h>
+#include <stdint.h>
+
+// 命令セットの名前を引くためのハッシュ関数
+// 大文字小文字を区別しない。genhash はこの関数で衝突しない seed を探す。
+static inline uint32_t IsaHash(const char *s, int len, uint32_t seed) {
+  uint32_t h = seed;
+  for (int i = 0; i < len; i++) {
+    h = (h ^ (uint8_t)tolower(s[i])) * 16777619u;
+  }
+  return h ^ (h >> 16);
+}
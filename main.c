@@ -1,963 +1,819 @@
-#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cli.h"
+#include "nlpasm.h"
+#include "serve.h"
+
+// 出力ファイル名に対応する行キャッシュのファイル名
+char *CachePath(const char *outfile) {
+  size_t n = strlen(outfile) + sizeof(".cache");
+  char *path = XRealloc(NULL, n);
+  snprintf(path, n, "%s.cache", outfile);
+  return path;
+}
 
-#define MAX_OPERAND 4
-#define ORIGIN 0
-#define MAX_TOKEN 8
+// 行キャッシュを読み込んで有効にする。無いか壊れていれば空のキャッシュで始める。
+void LoadCache(struct nlpasm_ctx *ctx, const char *path) {
+  struct Reader r;
+  if (OpenReader(&r, path) < 0) {
+    nlpasm_cache_load(ctx, NULL, 0);
+    return;
+  }
+  // キャッシュは通常ファイルなのでメモリマップされている
+  nlpasm_cache_load(ctx, r.map ? r.buf : NULL, r.map ? r.len : 0);
+  CloseReader(&r);
+}
 
-// 文字列をすべて小文字にする
-void ToLower(char *s) {
-  while (s && *s) {
-    *s = tolower(*s);
-    s++;
+// 行キャッシュを書き出す。途中で失敗しても古いキャッシュを壊さないよう、
+// 一時ファイルに書いてから置き換える。
+void SaveCache(struct nlpasm_ctx *ctx, const char *path) {
+  size_t len;
+  const char *data = nlpasm_cache_data(ctx, &len);
+  size_t n = strlen(path) + sizeof(".tmp");
+  char *tmp = XRealloc(NULL, n);
+  snprintf(tmp, n, "%s.tmp", path);
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd >= 0) {
+    struct Writer w;
+    OpenWriter(&w, fd);
+    WriterPut(&w, data, len);
+    if (CloseWriter(&w) == 0) {
+      rename(tmp, path);
+    } else {
+      unlink(tmp);
+    }
   }
+  free(tmp);
 }
 
-enum TokenKind {
-  kTokenInt = 128,
-  kTokenRelInt,
-  kTokenLabel,
-  kTokenRelLabel,
-  kTokenByte,
-  kTokenWord,
-};
+// opt の設定でコンテキストを作る。cache が NULL でなければインクルードファイルの
+// キャッシュとして共有する。
+struct nlpasm_ctx *NewContext(const struct Options *opt, struct nlpasm_include_cache *cache) {
+  struct nlpasm_ctx *ctx = nlpasm_ctx_new();
+  if (opt->optimize) {
+    nlpasm_enable_optimize(ctx);
+  }
+  nlpasm_set_little_endian(ctx, opt->little);
+  nlpasm_set_max_errors(ctx, opt->max_errors);
+  for (int i = 0; i < opt->num_include_dirs; i++) {
+    nlpasm_add_include_dir(ctx, opt->include_dirs[i]);
+  }
+  if (cache) {
+    nlpasm_set_include_cache(ctx, cache);
+  }
+  return ctx;
+}
 
-struct Token {
-  //   0 - 15  : レジスタ名（kRegIR1 - kRegZR）
-  //  32 - 127 : 一文字演算子
-  // 128 - last: TokenKind
-  int kind;
-  char *raw;
-  int len;
-  int val;
-};
+// Make のルールに書くためにファイル名の空白などをエスケープして書く
+void PutMakePath(FILE *fp, const char *path) {
+  for (const char *p = path; *p; p++) {
+    if (*p == ' ' || *p == '#') {
+      fputc('\\', fp);
+    } else if (*p == '$') {
+      fputc('$', fp);
+    }
+    fputc(*p, fp);
+  }
+}
 
-void InitToken(struct Token *token, enum TokenKind kind, char *raw, int len, int val) {
-  token->kind = kind;
-  token->raw = raw;
-  token->len = len;
-  token->val = val;
+// Make 形式の依存ファイルを書く（-MD）。target は出力ファイル、src は入力ファイル
+// （NULL なら標準入力）。取り込んだファイルにはそれぞれ空のルールを書き、ファイルを
+// 消したり名前を変えたりしても make がエラーで止まらないようにする。
+// 戻り値: 成功なら 0、書けなければ -1
+int WriteDepFile(const char *path, const char *target, const char *src,
+                 struct nlpasm_ctx *ctx) {
+  FILE *fp = fopen(path, "w");
+  if (fp == NULL) {
+    return -1;
+  }
+  size_t n;
+  const char *const *includes = nlpasm_get_includes(ctx, &n);
+  PutMakePath(fp, target);
+  fputc(':', fp);
+  if (src) {
+    fputc(' ', fp);
+    PutMakePath(fp, src);
+  }
+  for (size_t i = 0; i < n; i++) {
+    fputs(" \\\n  ", fp);
+    PutMakePath(fp, includes[i]);
+  }
+  fputc('\n', fp);
+  for (size_t i = 0; i < n; i++) {
+    fputc('\n', fp);
+    PutMakePath(fp, includes[i]);
+    fputs(":\n", fp);
+  }
+  return fclose(fp) == 0 ? 0 : -1;
 }
 
-const char* const reg_names[16] = {
-  "ir1",  "ir2", "ir3", "flag",
-  "iv",   "a",   "b",   "c",
-  "d",    "e",   "mem", "bank",
-  "addr", "ip",  "sp",  "zr"
-};
-enum RegNames {
-  kRegIR1,  kRegIR2, kRegIR3, kRegFLAG,
-  kRegIV,   kRegA,   kRegB,   kRegC,
-  kRegD,    kRegE,   kRegMEM, kRegBANK,
-  kRegADDR, kRegIP,  kRegSP,  kRegZR
-};
+// 出力ファイル名の拡張子を .d に変えた名前
+char *DepPath(const char *outfile) {
+  const char *base = strrchr(outfile, '/');
+  base = base ? base + 1 : outfile;
+  const char *dot = strrchr(base, '.');
+  int len = dot && dot != base ? dot - outfile : (int)strlen(outfile);
+  char *path = XRealloc(NULL, len + 3);
+  snprintf(path, len + 3, "%.*s.d", len, outfile);
+  return path;
+}
 
-int RegNameToIndex(const char *name, int n) {
-  for (int i = 0; i < 16; i++) {
-    int j;
-    for (j = 0; j < n; j++) {
-      if (reg_names[i][j] != tolower(name[j])) {
+// path（NULL なら標準入力）を読んで ctx でアセンブルする。
+// cache_path が NULL でなければ行キャッシュを読み込み、成功したら書き戻す。
+// --serve のサーバーの中では、cache_path が無くても前の依頼の行キャッシュを使う。
+// finish が 0 なら（オブジェクトファイルを出力するとき）ラベルを解決しない。
+// read_ns が NULL でなければ、行の読み込みにかかった時間を書く。
+// エラーがあっても、エラーの上限に達するまでは最後の行まで（finish ならラベルの解決まで）続ける。
+// 戻り値: 成功なら 0、アセンブルエラーなら -1、ファイルを開けなければ -2
+int AssembleFile(struct nlpasm_ctx *ctx, const char *path, const char *cache_path,
+                 int finish, uint64_t *read_ns) {
+  struct Reader reader;
+  if (OpenReader(&reader, path) < 0) {
+    return -2;
+  }
+  nlpasm_set_source_name(ctx, path);
+  if (cache_path) {
+    LoadCache(ctx, cache_path);
+  } else if (path) {
+    ServeLoadCache(ctx, path);
+  }
+  const char *line;
+  int line_len;
+  int err = 0;
+  uint64_t t0 = read_ns ? NowNs() : 0;
+  while (ReadLine(&reader, &line, &line_len)) {
+    if (nlpasm_assemble_line(ctx, line, line_len) < 0) {
+      err = -1;
+      if (nlpasm_stopped(ctx)) {
         break;
       }
     }
-    if (j == n && reg_names[i][j] == '\0') {
-      return i;
-    }
   }
-  return -1;
+  CloseReader(&reader);
+  if (read_ns) { // ループ全体からライブラリ内の時間を引いた残りが読み込みの時間
+    const struct nlpasm_stats *st = nlpasm_get_stats(ctx);
+    *read_ns = NowNs() - t0 - st->ns_tokenize - st->ns_encode;
+  }
+  if (finish && !nlpasm_stopped(ctx) && nlpasm_finish(ctx) < 0) {
+    err = -1;
+  }
+  if (err) {
+    return -1;
+  }
+  if (cache_path) {
+    SaveCache(ctx, cache_path);
+  } else if (path) {
+    ServeSaveCache(ctx, path);
+  }
+  return 0;
 }
 
-struct Operand {
-  int len;
-  struct Token tokens[MAX_TOKEN];
-};
-
-void TokenizeOperand(char *opr_str, struct Operand *dest) {
-  char *p = opr_str;
 
-  for (int i = 0; i < MAX_TOKEN; i++) {
-    p += strspn(p, " \t");
-    if (*p == '\0') {
-      dest->len = i;
-      return;
-    }
+// --stats の出力
+// 時間は秒、各段階の後に行数などの集計を出す。
+void PrintStats(FILE *fp, struct nlpasm_ctx *ctx, uint64_t read_ns, uint64_t output_ns,
+                uint64_t total_ns, int json) {
+  const struct nlpasm_stats *st = nlpasm_get_stats(ctx);
+  const struct {
+    const char *name;
+    uint64_t ns;
+  } phases[] = {
+    {"read", read_ns}, {"tokenize", st->ns_tokenize}, {"encode", st->ns_encode},
+    {"relax", st->ns_relax}, {"resolve", st->ns_resolve}, {"output", output_ns},
+    {"total", total_ns},
+  };
+  const struct {
+    const char *name;
+    long val;
+  } counts[] = {
+    {"lines", st->lines}, {"cache_hits", st->cache_hits},
+    {"includes", st->includes}, {"include_hits", st->include_hits},
+    {"lowdata_saved", st->lowdata_saved},
+    {"insns_1word", st->insns_by_len[1]}, {"insns_2word", st->insns_by_len[2]},
+    {"insns_3word", st->insns_by_len[3]}, {"data_words", st->data_words},
+    {"imm8", st->imm8}, {"imm16", st->imm16},
+    {"bp_abs8", st->backpatches_by_type[1]}, {"bp_abs16", st->backpatches_by_type[2]},
+    {"bp_ip_rel8", st->backpatches_by_type[4]}, {"bp_ip_rel16", st->backpatches_by_type[5]},
+    {"relax_passes", st->relax_passes}, {"symbols", st->symbols},
+    {"label_lookups", st->label_lookups}, {"label_probes", st->label_probes},
+    {"label_max_probe", st->label_max_probe}, {"words", st->words},
+    {"bytes", st->words * 2},
+  };
+  int np = sizeof(phases) / sizeof(phases[0]);
+  int nc = sizeof(counts) / sizeof(counts[0]);
+
+  if (json) {
+    fprintf(fp, "{\"phases\": {");
+    for (int i = 0; i < np; i++) {
+      fprintf(fp, "%s\"%s\": %.6f", i ? ", " : "", phases[i].name, phases[i].ns * 1e-9);
+    }
+    fprintf(fp, "}, \"counts\": {");
+    for (int i = 0; i < nc; i++) {
+      fprintf(fp, "%s\"%s\": %ld", i ? ", " : "", counts[i].name, counts[i].val);
+    }
+    fprintf(fp, "}}\n");
+    return;
+  }
+
+  for (int i = 0; i < np; i++) {
+    fprintf(fp, "%-16s %10.6f s", phases[i].name, phases[i].ns * 1e-9);
+    if (total_ns && i + 1 < np) {
+      fprintf(fp, " %5.1f%%", phases[i].ns * 100.0 / total_ns);
+    }
+    fputc('\n', fp);
+  }
+  for (int i = 0; i < nc; i++) {
+    fprintf(fp, "%-16s %10ld\n", counts[i].name, counts[i].val);
+  }
+  if (st->label_lookups) {
+    fprintf(fp, "%-16s %10.2f\n", "avg_probe", (double)st->label_probes / st->label_lookups);
+  }
+}
 
-    if (isdigit(*p)) {
-      char *endptr;
-      int v = strtol(p, &endptr, 0);
-      InitToken(dest->tokens + i, kTokenInt, p, endptr - p, v);
-      p = endptr;
-    } else if (strchr("+-", *p) != NULL) {
-      InitToken(dest->tokens + i, *p, p, 1, 0);
-      p++;
-    } else if (p[0] == '@') {
-      char *endptr;
-      if (isdigit(p[1])) {
-        int v = strtol(p + 1, &endptr, 0);
-        InitToken(dest->tokens + i, kTokenRelInt, p + 1, endptr - p - 1, v);
-      } else if (isalpha(p[1])) {
-        endptr = p + 2;
-        while (isalnum(*endptr)) {
-          endptr++;
-        }
-        InitToken(dest->tokens + i, kTokenRelLabel, p + 1, endptr - p - 1, 0);
-      } else {
-        fprintf(stderr, "unexpectec character for relative-int/label: '%c'\n", p[1]);
-        exit(1);
-      }
-      p = endptr;
-    } else if (isalpha(*p)) {
-      char *endptr = p + 1;
-      while (isalnum(*endptr)) {
-        endptr++;
-      }
-      int len = endptr - p;
-      if (len == 4 && strncmp(p, "byte", 4) == 0) {
-        InitToken(dest->tokens + i, kTokenByte, p, 4, 0);
-      } else if (len == 4 && strncmp(p, "word", 4) == 0) {
-        InitToken(dest->tokens + i, kTokenWord, p, 4, 0);
-      } else {
-        int reg_idx = RegNameToIndex(p, len);
-        if (reg_idx < 0) {
-          InitToken(dest->tokens + i, kTokenLabel, p, len, 0);
-        } else {
-          InitToken(dest->tokens + i, reg_idx, p, len, 0);
-        }
-      }
-      p = endptr;
-    } else {
-      fprintf(stderr, "unexpected character:: '%c'\n", *p);
-      exit(1);
+// --advise の出力
+// 3 ワード命令を、減らせるワード数の多い順に理由とともに並べる。
+void WriteAdvice(struct Writer *out, struct nlpasm_ctx *ctx, const char *src_name) {
+  size_t num_advice, num_insns;
+  const struct nlpasm_advice *adv = nlpasm_get_advice(ctx, &num_advice);
+  const struct nlpasm_insn *insns = nlpasm_get_insns(ctx, &num_insns);
+  size_t num_words;
+  const uint16_t *words = nlpasm_get_image(ctx, &num_words);
+  (void)num_words;
+  long total_words = 0, total_cycles = 0;
+  for (size_t i = 0; i < num_advice; i++) {
+    const struct nlpasm_advice *a = adv + i;
+    const struct nlpasm_insn *ins = insns + a->insn;
+    const uint16_t *w = words + ins->pos;
+    WriterPrintf(out, "%s:%d: %04X: %04X %04X %04X  ", src_name, ins->line, ins->ip,
+                 w[0], w[1], w[2]);
+    const char *sym = a->symbol ? a->symbol : "";
+    switch (a->reason) {
+    case NLPASM_ADVICE_LITERAL:
+      WriterPrintf(out, "literal %d (0x%X) is outside 0-255", a->value, a->value & 0xffff);
+      break;
+    case NLPASM_ADVICE_NEGATIVE:
+      WriterPrintf(out, "negative literal %d fits in 8 bits if add/sub is swapped", a->value);
+      break;
+    case NLPASM_ADVICE_WORD_PREFIX:
+      WriterPrintf(out, "'word' prefix on a value that fits in 8 bits (%s%s0x%X)",
+                   sym, *sym ? " = " : "", a->value);
+      break;
+    case NLPASM_ADVICE_LABEL:
+      WriterPrintf(out, "label '%s' is at 0x%X, beyond 255", sym, a->value);
+      break;
+    case NLPASM_ADVICE_DISTANCE:
+      WriterPrintf(out, "ip-relative distance to '%s' is %d; fits if the target moves %d "
+                   "words closer", *sym ? sym : "@", a->value, a->value - 255);
+      break;
+    case NLPASM_ADVICE_TWO_IMM:
+      WriterPrintf(out, "both inputs are immediates but there is only one imm8 field");
+      break;
     }
+    WriterPrintf(out, " (saves %d word%s, %d cycle%s)\n", a->words_saved,
+                 a->words_saved == 1 ? "" : "s", a->cycles_saved, a->cycles_saved == 1 ? "" : "s");
+    total_words += a->words_saved;
+    total_cycles += a->cycles_saved;
   }
-
-  dest->len = MAX_TOKEN;
+  WriterPrintf(out, "%zu 3-word instructions; %ld words and %ld cycles per pass avoidable\n",
+               num_advice, total_words, total_cycles);
 }
 
-// line をニーモニックとオペランドに分割する
-// 戻り値: オペランドの数
-int SplitOpcode(char *line, char **label, char **mnemonic, struct Operand *operands, int n) {
-  //char *comment = strchr(line, '#');
-  char *comment = strchr(line, ';');
-  if (comment) {
-    *comment = '\0';
-    comment++;
-  }
-
-  char *colon = strchr(line, ':');
-  if (colon) {
-    *label = line;
-    *colon = '\0';
-    line = colon + 1;
-  } else {
-    *label = NULL;
+// --cycles の出力
+// 基本ブロックごとのサイクル数と、ルーチンごとの最悪経路のサイクル数を並べる。
+void WriteCycles(struct Writer *out, struct nlpasm_ctx *ctx) {
+  size_t num_blocks, num_routines, num_insns;
+  const struct nlpasm_block *blocks = nlpasm_get_blocks(ctx, &num_blocks);
+  const struct nlpasm_routine *routines = nlpasm_get_routines(ctx, &num_routines);
+  const struct nlpasm_insn *insns = nlpasm_get_insns(ctx, &num_insns);
+  static const char *const status[] = {
+    "", "unbounded: loop at", "unknown: indirect jump at", "unknown: leaves the code at",
+  };
+
+  WriterPrintf(out, "# blocks: address, line, label, instructions, cycles\n");
+  for (size_t i = 0; i < num_blocks; i++) {
+    const struct nlpasm_block *b = blocks + i;
+    WriterPrintf(out, "%04X %6d  %-20s %5d %7d\n", b->ip, insns[b->insn].line,
+                 b->label ? b->label : "", b->num_insns, b->cycles);
+  }
+  WriterPrintf(out, "# routines: address, label, worst-case cycles to ret (iret for isr)\n");
+  for (size_t i = 0; i < num_routines; i++) {
+    const struct nlpasm_routine *r = routines + i;
+    WriterPrintf(out, "%04X %-20s %7d%s", r->ip, r->name ? r->name : "",
+                 r->cycles, r->isr ? "  isr" : "");
+    if (r->status != NLPASM_PATH_OK) {
+      WriterPrintf(out, "  %s 0x%04X", status[r->status], r->status_ip);
+    }
+    WriterPutc(out, '\n');
   }
+}
 
-  if ((*mnemonic = strtok(line, " \t\n")) == NULL) {
+// -D: バイナリイメージ path（NULL なら標準入力）を逆アセンブルして out に書く。
+// ワードのバイト順は -l に従う。戻り値: 成功なら 0、読めなければ -1（errno を保持）
+int Disassemble(struct Writer *out, const char *path, const struct Options *opt) {
+  struct Reader r;
+  if (OpenReader(&r, path) < 0) {
     return -1;
   }
-  for (int i = 0; i < n; ++i) {
-    char *opr = strtok(NULL, ",\n");
-    if (opr == NULL) {
-      return i;
+  const uint8_t *bytes = (const uint8_t *)r.buf;
+  size_t len = r.len;
+  if (r.fp) { // メモリマップできない入力は全部読み込む
+    size_t cap = 0;
+    char *buf = NULL;
+    len = 0;
+    for (;;) {
+      if (cap - len < 65536) {
+        cap = cap ? cap * 2 : 65536 * 2;
+        buf = XRealloc(buf, cap);
+      }
+      size_t n = fread(buf + len, 1, cap - len, r.fp);
+      if (n == 0) {
+        break;
+      }
+      len += n;
     }
-    TokenizeOperand(opr, operands + i);
+    r.stream_buf = buf; // CloseReader で解放する
+    bytes = (const uint8_t *)buf;
   }
-  return n;
-}
-
-enum RegImmKind {
-  kReg = 0, kImm8 = 1, kImm16 = 2
-};
-
-struct RegImm {
-  enum RegImmKind kind;
-  int16_t val;
-  const char *label; // 即値がラベルの場合
-};
-
-const char *flag_names[16] = {
-  ".nop", "",    ".c", ".nc",
-  ".v",   ".nv", ".z", ".nz",
-  ".s",   ".ns", ".?",  ".?",
-  ".?",   ".?",  ".?",  ".?",
-};
-uint8_t FlagNameToBits(const char* flag_name) {
-  char flag = flag_name[0];
-  uint8_t mask = 0;
 
-  if (flag_name[0] == 'n') {
-    if (strcmp(flag_name + 1, "op") == 0) { // NOP
-      return 0;
-    }
-    flag = flag_name[1];
-    mask = 1;
+  size_t num_words = len / 2;
+  uint16_t *words = XRealloc(NULL, sizeof(uint16_t) * (num_words ? num_words : 1));
+  for (size_t i = 0; i < num_words; i++) {
+    const uint8_t *b = bytes + 2 * i;
+    words[i] = opt->little ? b[0] | b[1] << 8 : b[0] << 8 | b[1];
   }
-
-  switch (flag) {
-  case 'c': return 2u | mask;
-  case 'v': return 4u | mask;
-  case 'z': return 6u | mask;
-  case 's': return 8u | mask;
-  case 'b': return 10u | mask;
-  default:
-    fprintf(stderr, "unknown flag: '%c'\n", flag);
-    exit(1);
+  if (len % 2) {
+    fprintf(stderr, "warning: ignoring the odd byte at the end of the image\n");
   }
+  WriteDisassembly(out, words, num_words);
+  free(words);
+  CloseReader(&r);
+  return 0;
 }
 
-struct Instruction {
-  int ip, len;
-  uint8_t op, out;
-  uint8_t in, imm8;
-  uint16_t imm16;
-};
-
-enum DataWidth {
-  kByte,
-  kWord,
-};
-
-struct LabelAddr {
-  const char *label;
-  int ip;
-};
+// アセンブル結果を書く。-c ならオブジェクトファイル、それ以外は最終イメージ。
+// 戻り値: 成功なら 0、イメージを書けなければ -1
+int WriteOutput(struct Writer *out, struct nlpasm_ctx *ctx, const struct Options *opt) {
+  if (opt->object) {
+    size_t len;
+    const void *obj = nlpasm_get_object(ctx, &len);
+    WriterPut(out, obj, len);
+    return 0;
+  }
+  return WriteImage(out, ctx, opt);
+}
 
-// Back patch type
-enum BPType {
-  BP_ABS,
-  BP_ABS8,
-  BP_ABS16,
-  BP_IP_REL,
-  BP_IP_REL8,
-  BP_IP_REL16,
+// バッチモード
+// 入力ファイルごとに独立したコンテキストでアセンブルし、ワーカースレッドが
+// 次のファイルを順に取っていく。診断メッセージはファイルごとに溜めておき、
+// 全部終わってから入力の順に表示する。
+struct BatchJob {
+  const char *infile;
+  char *outfile;
+  int failed;
+  char *diag;   // エラーメッセージ（--diagnostics=json なら成功しても書く）。無ければ NULL
+  char *report; // -O の書き換えの報告。無ければ NULL
 };
 
-struct Backpatch {
-  int insn_idx;
-  const char *label;
-  enum BPType type;
+struct Batch {
+  struct BatchJob *jobs;
+  int num_jobs;
+  int next;     // 次に処理するジョブ番号（スレッド間で共有）
+  const struct Options *opt;
+  struct nlpasm_include_cache *include_cache; // ジョブ間で共有する
 };
 
-void InitBackpatch(struct Backpatch *bp, int insn_idx,
-                   const char *label, enum BPType type) {
-  bp->insn_idx = insn_idx;
-  bp->label = label;
-  bp->type = type;
+// outdir/（infile のファイル名から拡張子を除いたもの）ext を返す
+char *BatchOutputPath(const char *outdir, const char *infile, const char *ext) {
+  const char *base = strrchr(infile, '/');
+  base = base ? base + 1 : infile;
+  const char *dot = strrchr(base, '.');
+  int base_len = dot && dot != base ? dot - base : (int)strlen(base);
+  size_t n = strlen(outdir) + base_len + strlen(ext) + 2;
+  char *path = XRealloc(NULL, n);
+  snprintf(path, n, "%s/%.*s%s", outdir, base_len, base, ext);
+  return path;
 }
 
-struct Instruction insn[1024];
-int insn_idx = 0;
-int ip = ORIGIN;
-
-struct Backpatch backpatches[128];
-int num_backpatches = 0;
-
-struct LabelAddr labels[128];
-int num_labels = 0;
-
-// i 番目のオペランドを文字列として取得
-struct Operand *GetOperand(char *mnemonic, struct Operand *operands, int n, int i) {
-  if (n <= i) {
-    fprintf(stderr, "too few operands for '%s': %d\n", mnemonic, n);
-    exit(1);
-  }
-  return operands + i;
-}
-
-// i 番目のオペランドをレジスタ番号として取得
-int GetOperandReg(struct Operand *operand) {
-  if (operand->len == 1 && operand->tokens[0].kind < 16) {
-    return operand->tokens[0].kind;
-  }
-  return -1;
+// アセンブル以外の失敗（ファイルを開けないなど）を job に記録する
+void BatchJobFail(struct BatchJob *job, const char *msg) {
+  size_t n = strlen(job->infile) + strlen(msg) + 4;
+  free(job->diag);
+  job->diag = XRealloc(NULL, n);
+  snprintf(job->diag, n, "%s: %s\n", job->infile, msg);
+  job->failed = 1;
 }
 
-// i 番目のオペランドを RegImm として取得
-struct RegImm GetOperandRegImm(struct Operand *operand, int start_token, uint8_t imm_slot) {
-  int token_idx = start_token;
-  struct Token *value = operand->tokens + token_idx;
-  struct Token *prefix = NULL;
-  if (value->kind == kTokenByte || value->kind == kTokenWord) {
-    prefix = value;
-    token_idx++;
-    value = operand->tokens + token_idx;
-  }
-
-  if (operand->len <= token_idx) {
-    fprintf(stderr, "value must be specified\n");
-    exit(1);
-  } else if (operand->len > token_idx + 1) {
-    struct Token *tk = operand->tokens + token_idx + 1;
-    fprintf(stderr, "too many tokens: '%.*s'\n", tk->len, tk->raw);
-    exit(1);
-  }
-
-  struct RegImm ri = {kReg, 0, NULL};
-  if (prefix == NULL && value->kind < 16) {
-    ri.val = value->kind;
-    return ri;
-  }
-
-  if (prefix) {
-    if (prefix->kind == kTokenWord) {
-      ri.kind = kImm16;
-    } else if (prefix->kind == kTokenByte) {
-      ri.kind = kImm8;
+void RunBatchJob(struct BatchJob *job, const struct Options *opt,
+                 struct nlpasm_include_cache *include_cache) {
+  struct nlpasm_ctx *ctx = NewContext(opt, include_cache);
+  char *cache_path = opt->incremental ? CachePath(job->outfile) : NULL;
+  int err = AssembleFile(ctx, job->infile, cache_path, !opt->object, NULL);
+  free(cache_path);
+  if (err != -2 && (err < 0 || opt->diag_json)) {
+    size_t len;
+    FILE *fp = open_memstream(&job->diag, &len);
+    PrintDiagnostics(fp, ctx, job->infile, opt->diag_json);
+    fclose(fp);
+    job->failed = err < 0;
+  }
+  if (err == -2) {
+    BatchJobFail(job, strerror(errno));
+  } else if (err == 0) {
+    int fd = OpenOutput(job->outfile);
+    if (fd < 0) {
+      BatchJobFail(job, strerror(errno));
     } else {
-      fprintf(stderr, "unknown prefix: '%.*s'\n", prefix->len, prefix->raw);
-      exit(1);
-    }
-  }
-
-  if (value->kind == kTokenLabel) {
-    if (prefix == NULL) {
-      ri.kind = kImm8;
-    }
-    ri.label = strndup(value->raw, value->len);
-    InitBackpatch(backpatches + num_backpatches, insn_idx, ri.label, BP_ABS + ri.kind);
-    num_backpatches++;
-  } else if (value->kind == kTokenRelLabel) {
-    if (prefix == NULL) {
-      ri.kind = kImm8;
+      struct Writer w;
+      OpenWriter(&w, fd);
+      int werr = WriteOutput(&w, ctx, opt);
+      if (CloseWriter(&w) < 0 || werr < 0) {
+        BatchJobFail(job, "failed to write the image");
+      }
     }
-    ri.label = strndup(value->raw, value->len);
-    InitBackpatch(backpatches + num_backpatches, insn_idx, ri.label, BP_IP_REL + ri.kind);
-    num_backpatches++;
-  } else if (value->kind == kTokenInt) {
-    ri.val = value->val;
-    if (0 <= ri.val && ri.val < 256) {
-      if (prefix == NULL) {
-        ri.kind = kImm8;
+    if (opt->make_deps && !job->failed) {
+      char *dep_path = DepPath(job->outfile);
+      if (WriteDepFile(dep_path, job->outfile, job->infile, ctx) < 0) {
+        BatchJobFail(job, strerror(errno));
       }
-    } else {
-      ri.kind = kImm16;
+      free(dep_path);
     }
-  } else if (value->kind == kTokenRelInt) {
-    if (imm_slot & kImm8) { // imm8 が使用されているので imm16 を使うしかなく、必ず 3 ワードになる
-      ri.val = value->val - ip - 3;
-      ri.kind = kImm16;
-    } else if (imm_slot & kImm16) { // imm16 が使用されているので必ず 3 ワードになる
-      ri.val = value->val - ip - 3;
-      ri.kind = kImm8;
-    } else if (prefix && prefix->kind == kImm16) { // imm16 が指定されているので必ず 3 ワードになる
-      ri.val = value->val - ip - 3;
-    } else { // imm8 も imm16 も未使用なので、どちらを使うか選択権がある
-      ri.val = value->val - ip - 2;
-      if (0 <= ri.val && ri.val < 256) {
-        if (prefix == NULL) {
-          ri.kind = kImm8;
-        }
-      } else { // imm8 では表せないので imm16 を使う
-        ri.val = value->val - ip - 3;
-        ri.kind = kImm16;
+    if (!opt->object) {
+      size_t len;
+      FILE *fp = open_memstream(&job->report, &len);
+      if (opt->optimize) {
+        PrintRewrites(fp, ctx, job->infile);
       }
+      PrintLowData(fp, ctx, job->infile);
+      fclose(fp);
     }
-  } else {
-    fprintf(stderr, "unexpected token: '%.*s'\n", value->len, value->raw);
-    exit(1);
   }
+  nlpasm_ctx_free(ctx);
+}
 
-  if (prefix) {
-    if ((prefix->kind == kTokenByte && ri.kind != kImm8) ||
-        (prefix->kind == kTokenWord && ri.kind != kImm16)) {
-      fprintf(stderr, "prefix conflicts with immediate size: '%.*s'\n", prefix->len, prefix->raw);
-      exit(1);
+void *BatchWorker(void *arg) {
+  struct Batch *b = arg;
+  for (;;) {
+    int i = __atomic_fetch_add(&b->next, 1, __ATOMIC_RELAXED);
+    if (i >= b->num_jobs) {
+      return NULL;
     }
+    RunBatchJob(&b->jobs[i], b->opt, b->include_cache);
   }
-
-  return ri;
 }
 
-#define GET_OPR(i) GetOperand((mnemonic), (operands), (num_opr), (i))
-#define GET_REG(i) GetOperandReg(GET_OPR(i))
-#define GET_REGIMM(i, imm_slot) GetOperandRegImm(GET_OPR(i), 0, (imm_slot))
+int CompareJobOutput(const void *a, const void *b) {
+  const struct BatchJob *x = *(const struct BatchJob *const *)a;
+  const struct BatchJob *y = *(const struct BatchJob *const *)b;
+  return strcmp(x->outfile, y->outfile);
+}
 
-void SetImm(struct Instruction *insn, enum RegImmKind imm_kind, uint16_t v) {
-  if (imm_kind == kImm8) {
-    insn->imm8 = v;
-  } else if (imm_kind == kImm16) {
-    insn->imm16 = v;
-  }
+// 出力ファイル名は入力ファイル名の最後の部分だけで決まるので、別のディレクトリの同じ
+// 名前の入力があると同じファイルに書いてしまう。始める前に調べる。
+// 戻り値: 重なりが無ければ 0、あれば -1（メッセージは表示済み）
+int CheckBatchOutputs(struct BatchJob *jobs, int num_jobs) {
+  struct BatchJob **sorted = XRealloc(NULL,
+                                      sizeof(struct BatchJob *) * (num_jobs ? num_jobs : 1));
+  for (int i = 0; i < num_jobs; i++) {
+    sorted[i] = jobs + i;
+  }
+  qsort(sorted, num_jobs, sizeof(sorted[0]), CompareJobOutput);
+  int err = 0;
+  for (int i = 1; i < num_jobs; i++) {
+    if (strcmp(sorted[i - 1]->outfile, sorted[i]->outfile) == 0) {
+      fprintf(stderr, "'%s' and '%s' would both be written to '%s'\n",
+              sorted[i - 1]->infile, sorted[i]->infile, sorted[i]->outfile);
+      err = -1;
+    }
+  }
+  free(sorted);
+  return err;
 }
 
-// 入力レジスタ番号を insn に設定する。
-// 入力が即値の場合は適切な即値番号（1 or 2）と即値を設定する。
-//
-// 戻り値
-// -1: 入力が両方とも 8 ビットで表せない大きな数値である
-// 2: 入力に byte リテラルが高々 1 つだけある
-// 3: 入力に word リテラルが含まれる
-int SetInput(struct Instruction *insn, struct RegImm *in1, struct RegImm *in2) {
-  if (in2 == NULL) {
-    if (in1->kind == kReg) {
-      insn->in = in1->val << 4;
-      return 2;
-    } else {
-      insn->in = in1->kind << 4;
-      SetImm(insn, in1->kind, in1->val);
-      return 1 + in1->kind;
+// 戻り値: すべて成功なら 0、1 つでも失敗すれば 1
+int RunBatch(char **infiles, int num_infiles, const char *outdir,
+             int num_threads, const struct Options *opt) {
+  if (mkdir(outdir, 0777) < 0 && errno != EEXIST) {
+    perror("failed to create output directory");
+    return 1;
+  }
+
+  struct Batch b = {
+    .jobs = XRealloc(NULL, sizeof(struct BatchJob) * (num_infiles ? num_infiles : 1)),
+    .num_jobs = num_infiles,
+    .next = 0,
+    .opt = opt,
+    .include_cache = ServeIncludeCache(),
+  };
+  for (int i = 0; i < num_infiles; i++) {
+    b.jobs[i].infile = infiles[i];
+    b.jobs[i].outfile = BatchOutputPath(outdir, infiles[i],
+                                        opt->object ? ".o" : FormatExtension(opt->outfmt));
+    b.jobs[i].failed = 0;
+    b.jobs[i].diag = NULL;
+    b.jobs[i].report = NULL;
+  }
+  if (CheckBatchOutputs(b.jobs, num_infiles) < 0) {
+    for (int i = 0; i < num_infiles; i++) {
+      free(b.jobs[i].outfile);
+    }
+    free(b.jobs);
+    return 1;
+  }
+  int own_cache = b.include_cache == NULL;
+  if (own_cache) {
+    b.include_cache = nlpasm_include_cache_new();
+  }
+
+  if (num_threads <= 0) {
+    num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if (num_threads > num_infiles) {
+    num_threads = num_infiles;
+  }
+  pthread_t *threads = XRealloc(NULL, sizeof(pthread_t) * (num_threads ? num_threads : 1));
+  int started = 0;
+  for (; started < num_threads; started++) {
+    if (pthread_create(&threads[started], NULL, BatchWorker, &b) != 0) {
+      break;
     }
   }
-
-  if (in1->kind == kReg && in2->kind == kReg) {
-    insn->in = (in1->val << 4) | in2->val;
-    return 2;
-  } else if (in1->kind == kReg && in2->kind != kReg) {
-    insn->in = (in1->val << 4) | in2->kind;
-    SetImm(insn, in2->kind, in2->val);
-    return 1 + in2->kind;
-  } else if (in1->kind != kReg && in2->kind == kReg) {
-    insn->in = (in1->kind << 4) | in2->val;
-    SetImm(insn, in1->kind, in1->val);
-    return 1 + in1->kind;
-  } else { // in1, in2 両方が即値
-    if (in1->kind == kImm16 && in2->kind == kImm16) {
-      return -1;
-    }
-    if (in1->kind == kImm8) {
-      insn->in = (kImm8 << 4) | kImm16;
-      SetImm(insn, kImm8, in1->val);
-      SetImm(insn, kImm16, in2->val);
-    } else {
-      insn->in = (kImm16 << 4) | kImm8;
-      SetImm(insn, kImm16, in1->val);
-      SetImm(insn, kImm8, in2->val);
-    }
-    return 3;
+  if (started == 0) { // スレッドを作れなければこのスレッドで処理する
+    BatchWorker(&b);
   }
-}
-
-// 前方ジャンプなら 1, 後方ジャンプなら 2 を返す。
-// 前方ジャンプであれば jump_to->val を符号反転する。
-int CalcJumpDirForIPRelImm(struct RegImm *jump_to) {
-  int dir = 1;
-  if (jump_to->label) {
-    int i;
-    for (i = 0; i < num_labels; i++) {
-      if (strcmp(jump_to->label, labels[i].label) == 0) {
-        break;
-      }
-    }
-    if (i == num_labels) {
-      dir = 2;
-    }
-  } else if (jump_to->val >= 0) {
-    dir = 2;
-  } else {
-    jump_to->val = -jump_to->val;
+  for (int i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
   }
-  return dir;
-}
+  free(threads);
 
-// ins->op の下位 4 ビットは、加算モードなら 2、減算モードなら 1
-int SetInputForBranch(struct Instruction *ins, struct Operand *addr) {
-  struct Token *tokens = addr->tokens;
-  if (tokens[0].kind == kTokenInt || tokens[0].kind == kTokenLabel) {
-    struct RegImm in = GetOperandRegImm(addr, 0, 0);
-    ins->op = 0x00;
-    return SetInput(ins, &in, NULL);
-  }
-  if (tokens[0].kind == kTokenByte || tokens[0].kind == kTokenWord ||
-      tokens[0].kind == kTokenRelInt || tokens[0].kind == kTokenRelLabel) {
-    struct RegImm in1 = {kReg, kRegIP, NULL};
-    struct RegImm in2 = GetOperandRegImm(addr, 0, 0);
-    ins->op = CalcJumpDirForIPRelImm(&in2);
-    return SetInput(ins, &in1, &in2);
-  }
-  if (tokens[0].kind < 16) { // レジスタ加算
-    char op;
-    if (tokens[1].kind == '+' || tokens[1].kind == '-') {
-      op = tokens[1].kind;
-    } else {
-      fprintf(stderr, "register-relative addressing needs +/-: '%.*s'\n",
-              tokens[1].len, tokens[1].raw);
-      exit(1);
+  int failed = 0;
+  for (int i = 0; i < num_infiles; i++) {
+    struct BatchJob *job = &b.jobs[i];
+    if (job->report) {
+      fputs(job->report, stderr);
+      free(job->report);
     }
-    struct RegImm in1 = {kReg, tokens[0].kind, NULL};
-    struct RegImm in2 = GetOperandRegImm(addr, 2, 0);
-    int dir = CalcJumpDirForIPRelImm(&in2);
-    if (in2.label == NULL && op == '-') {
-      dir = 3 - dir;
+    if (job->diag) {
+      fputs(job->diag, stderr);
+      free(job->diag);
     }
-    ins->op = dir;
-    return SetInput(ins, &in1, &in2);
+    failed |= job->failed;
+    free(job->outfile);
   }
-
-  return -1;
-}
-
-int ProcALUOp1In(uint8_t op, uint8_t flag, struct Operand *opr_out,
-                 struct Operand *opr_in) {
-  insn[insn_idx].op = op;
-  insn[insn_idx].out = (flag << 4) | GetOperandReg(opr_out);
-  struct RegImm in = GetOperandRegImm(opr_in, 0, 0);
-  return SetInput(insn + insn_idx, &in, NULL);
-}
-
-int ProcALUOp2In(uint8_t op, uint8_t flag, struct Operand *opr_out,
-                 struct Operand *opr_in1, struct Operand *opr_in2) {
-  insn[insn_idx].op = op;
-  insn[insn_idx].out = (flag << 4) | GetOperandReg(opr_out);
-  struct RegImm in1 = GetOperandRegImm(opr_in1, 0, 0);
-  struct RegImm in2 = GetOperandRegImm(opr_in2, 0, in1.kind);
-  return SetInput(insn + insn_idx, &in1, &in2);
+  free(b.jobs);
+  if (own_cache) {
+    nlpasm_include_cache_free(b.include_cache);
+  }
+  return failed;
 }
 
-#define ALU2OPR(op) \
-  do { \
-    insn_len = ProcALUOp1In((op), flag, GET_OPR(0), GET_OPR(1)); \
-  } while (0)
-
-#define ALU3OPR(op) \
-  do { \
-    insn_len = ProcALUOp2In((op), flag, GET_OPR(0), GET_OPR(1), GET_OPR(2)); \
-    if (insn_len  == -1) { \
-      \
-      fprintf(stderr, "both literals are imm16: %s\n", line0); \
-      exit(1); \
-    } \
-  } while (0)
-
-int DWGetValue(struct Operand *opr) {
-  struct Token *t = opr->tokens;
-  if (opr->len != 1 || t->kind != kTokenInt) {
-    fprintf(stderr, ".dw takes integers: '%.*s'\n", t->len, t->raw);
-    exit(1);
-  }
-  return t->val;
-}
+// nlpasm のコマンドラインを解析した結果
+struct Command {
+  struct Options opt;
+  const char *outfile_name;
+  const char *infile_name; // NULL なら標準入力
+  char **infiles;          // --batch の入力ファイル
+  int num_infiles;
+  const char **isr_names;
+  int num_isr_names;
+  int batch, num_threads;
+  int stats; // 1: --stats, 2: --stats=json
+  int advise;
+  int cycles;
+  int disasm;
+};
 
-int DumpWord(FILE *out, uint16_t word, int byte, int little_endian, int delim) {
-  int n;
-  if (!byte) {
-    n = fprintf(out, "%04X", word);
-  } else {
-    uint8_t first = word >> 8;
-    uint8_t second = word & 0xffu;
-    if (little_endian) {
-      uint8_t tmp = first;
-      first = second;
-      second = tmp;
+// 戻り値: 成功なら 0、不正な指定なら -1（メッセージは表示済み）
+int ParseCommand(struct Command *cmd, int argc, char **argv) {
+  struct Options *opt = &cmd->opt;
+  for (int i = 1; i < argc; i++) {
+    int parsed = ParseOutputOption(opt, argc, argv, &i);
+    if (parsed < 0) {
+      return -1;
+    } else if (parsed) {
+      continue;
+    } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+      cmd->outfile_name = argv[++i];
+    } else if (strcmp(argv[i], "-c") == 0) {
+      opt->object = 1;
+    } else if (strcmp(argv[i], "-O") == 0) {
+      opt->optimize = 1;
+    } else if (strcmp(argv[i], "-I") == 0 && i + 1 < argc) {
+      opt->include_dirs[opt->num_include_dirs++] = argv[++i];
+    } else if (strncmp(argv[i], "-I", 2) == 0 && argv[i][2]) {
+      opt->include_dirs[opt->num_include_dirs++] = argv[i] + 2;
+    } else if (strcmp(argv[i], "-MD") == 0) {
+      opt->make_deps = 1;
+    } else if (strcmp(argv[i], "-MF") == 0 && i + 1 < argc) {
+      opt->make_deps = 1;
+      opt->dep_file = argv[++i];
+    } else if (strcmp(argv[i], "--incremental") == 0) {
+      opt->incremental = 1;
+    } else if (strcmp(argv[i], "--advise") == 0) {
+      cmd->advise = 1;
+    } else if (strcmp(argv[i], "-D") == 0) {
+      cmd->disasm = 1;
+    } else if (strcmp(argv[i], "--cycles") == 0) {
+      cmd->cycles = 1;
+    } else if (strcmp(argv[i], "--isr") == 0 && i + 1 < argc) {
+      cmd->isr_names[cmd->num_isr_names++] = argv[++i];
+    } else if (strcmp(argv[i], "--stats") == 0) {
+      cmd->stats = 1;
+    } else if (strcmp(argv[i], "--stats=json") == 0) {
+      cmd->stats = 2;
+    } else if (strcmp(argv[i], "--max-errors") == 0 && i + 1 < argc) {
+      opt->max_errors = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--diagnostics=json") == 0) {
+      opt->diag_json = 1;
+    } else if (strcmp(argv[i], "--batch") == 0) {
+      cmd->batch = 1;
+    } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+      cmd->num_threads = atoi(argv[++i]);
+    } else if (argv[i][0] != '-') {
+      cmd->infile_name = argv[i];
+      cmd->infiles[cmd->num_infiles++] = argv[i];
     }
-    n = fprintf(out, "%02X %02X", first, second);
-  }
-  if (delim) {
-    n += fprintf(out, "%c", delim);
   }
-  return n;
+  return 0;
 }
 
-int PutSpace(FILE *out, int n) {
-  for (int i = 0; i < n; i++) {
-    if (fputc(' ', out) == EOF) {
-      return EOF;
-    }
+// --batch。戻り値: 終了コード
+int RunBatchCommand(const struct Command *cmd) {
+  if (cmd->opt.num_emits > 0) {
+    fprintf(stderr, "--emit cannot be used with --batch\n");
+    return 1;
   }
-  return n;
-}
-
-enum OutputFormat {
-  kFmtText,
-  kFmtBin,
-};
-
-void DumpWordToBytes(uint8_t *buf, uint16_t word, int little) {
-  if (little) {
-    buf[0] = word & 0xffu;
-    buf[1] = word >> 8;
-  } else {
-    buf[0] = word >> 8;
-    buf[1] = word & 0xffu;
+  if (cmd->outfile_name == NULL) {
+    fprintf(stderr, "--batch requires an output directory (-o outdir)\n");
+    return 1;
+  }
+  if (cmd->opt.dep_file) {
+    fprintf(stderr, "-MF cannot be used with --batch (use -MD)\n");
+    return 1;
   }
+  return RunBatch(cmd->infiles, cmd->num_infiles, cmd->outfile_name, cmd->num_threads,
+                  &cmd->opt);
 }
 
-int DumpInstruction(uint8_t *buf, struct Instruction *ins, int little) {
-  DumpWordToBytes(buf + 0, ins->op << 8 | ins->out, little);
-  if (ins->len >= 2) {
-    DumpWordToBytes(buf + 2, ins->in << 8 | ins->imm8, little);
+// -D。戻り値: 終了コード
+int RunDisassemble(const struct Command *cmd) {
+  int outfd = OpenOutput(cmd->outfile_name);
+  if (outfd < 0) {
+    perror("failed to open output file");
+    return 1;
+  }
+  struct Writer outfile;
+  OpenWriter(&outfile, outfd);
+  int err = Disassemble(&outfile, cmd->infile_name, &cmd->opt);
+  if (err < 0) {
+    perror("failed to open input file");
   }
-  if (ins->len == 3) {
-    DumpWordToBytes(buf + 4, ins->imm16, little);
+  if (CloseWriter(&outfile) < 0) {
+    err = -1;
   }
-  return ins->len * 2;
+  return err != 0;
 }
 
-int main(int argc, char **argv) {
-  char line[500], line0[500];
-  char *label;
-  char *mnemonic;
-  struct Operand operands[MAX_OPERAND];
-
-  while (fgets(line, sizeof(line), stdin) != NULL) {
-    strcpy(line0, line);
-    int num_opr = SplitOpcode(line, &label, &mnemonic, operands, MAX_OPERAND);
-
-    if (label) {
-      labels[num_labels].label = strdup(label);
-      labels[num_labels].ip = ip;
-      num_labels++;
+// ctx でアセンブルした結果を書く。戻り値: 終了コード
+int WriteAssembled(struct nlpasm_ctx *ctx, const struct Command *cmd, uint64_t start_ns,
+                   uint64_t read_ns) {
+  const struct Options *opt = &cmd->opt;
+  const char *src_name = cmd->infile_name ? cmd->infile_name : "<stdin>";
+  for (int i = 0; i < cmd->num_isr_names; i++) {
+    if (nlpasm_mark_isr(ctx, cmd->isr_names[i]) < 0) {
+      fprintf(stderr, "unknown label for --isr: '%s'\n", cmd->isr_names[i]);
+      return 1;
     }
+  }
 
-    if (num_opr < 0) {
-      continue;
-    }
-    ToLower(mnemonic);
-
-    char *sep = strchr(mnemonic + 1, '.');
-    uint8_t flag = 1; // always do
-    if (sep) {
-      char *flag_name = sep + 1;
-      *sep = '\0';
-      flag = FlagNameToBits(flag_name);
+  int outfd = OpenOutput(cmd->outfile_name);
+  if (outfd < 0) {
+    perror("failed to open output file");
+    return 1;
+  }
+  uint64_t output_start_ns = cmd->stats ? NowNs() : 0;
+  struct Writer outfile;
+  OpenWriter(&outfile, outfd);
+  int err = 0;
+  if (cmd->advise) {
+    WriteAdvice(&outfile, ctx, src_name);
+  } else if (cmd->cycles) {
+    WriteCycles(&outfile, ctx);
+  } else {
+    err = WriteOutput(&outfile, ctx, opt);
+    if (!err && !opt->object) {
+      err = WriteEmits(ctx, opt);
     }
-
-    int insn_len = 2;
-    if (strcmp(mnemonic, "add") == 0) {
-      ALU3OPR(0x12);
-    } else if (strcmp(mnemonic, "sub") == 0) {
-      ALU3OPR(0x11);
-    } else if (strcmp(mnemonic, "addc") == 0) {
-      ALU3OPR(0x16);
-    } else if (strcmp(mnemonic, "subc") == 0) {
-      ALU3OPR(0x15);
-    } else if (strcmp(mnemonic, "or") == 0) {
-      ALU3OPR(0x0a);
-    } else if (strcmp(mnemonic, "not") == 0) {
-      ALU2OPR(0x0c);
-    } else if (strcmp(mnemonic, "xor") == 0) {
-      ALU3OPR(0x0e);
-    } else if (strcmp(mnemonic, "and") == 0) {
-      ALU3OPR(0x06);
-    } else if (strcmp(mnemonic, "inc") == 0) {
-      ALU2OPR(0x1b);
-    } else if (strcmp(mnemonic, "dec") == 0) {
-      ALU2OPR(0x18);
-    } else if (strcmp(mnemonic, "incc") == 0) {
-      ALU2OPR(0x1f);
-    } else if (strcmp(mnemonic, "decc") == 0) {
-      ALU2OPR(0x1c);
-    } else if (strcmp(mnemonic, "slr") == 0) {
-      ALU2OPR(0x2c);
-    } else if (strcmp(mnemonic, "sll") == 0) {
-      ALU2OPR(0x20);
-    } else if (strcmp(mnemonic, "sar") == 0) {
-      ALU2OPR(0x2c);
-    } else if (strcmp(mnemonic, "sal") == 0) {
-      ALU2OPR(0x24);
-    } else if (strcmp(mnemonic, "ror") == 0) {
-      ALU2OPR(0x2a);
-    } else if (strcmp(mnemonic, "rol") == 0) {
-      ALU2OPR(0x22);
-    } else if (strcmp(mnemonic, "mov") == 0) {
-      insn[insn_idx].op = 0x00;
-      insn[insn_idx].out = (flag << 4) | GET_REG(0);
-      struct RegImm in = GET_REGIMM(1, 0);
-      insn_len = SetInput(insn + insn_idx, &in, NULL);
-    } else if (strcmp(mnemonic, "jmp") == 0) {
-      insn_len = SetInputForBranch(insn + insn_idx, operands + 0);
-      if (insn_len < 0) {
-        fprintf(stderr, "invalid jump instruction: %s\n", line0);
-        exit(1);
-      }
-      insn[insn_idx].op |= (insn[insn_idx].op & 0x0f) ? 0x10 : 0x00;
-      insn[insn_idx].out = (flag << 4) | kRegIP;
-    } else if (strcmp(mnemonic, "call") == 0) {
-      insn_len = SetInputForBranch(insn + insn_idx, operands + 0);
-      if (insn_len < 0) {
-        fprintf(stderr, "invalid call instruction: %s\n", line0);
-        exit(1);
-      }
-      insn[insn_idx].op |= (insn[insn_idx].op & 0x0f) ? 0xB8 : 0xB0;
-      insn[insn_idx].out = (flag << 4) | kRegIP;
-    } else if (strcmp(mnemonic, "load") == 0) {
-      insn_len = SetInputForBranch(insn + insn_idx, operands + 1);
-      if (insn_len < 0) {
-        fprintf(stderr, "invalid load instruction: %s\n", line0);
-        exit(1);
-      }
-      insn[insn_idx].op |= (insn[insn_idx].op & 0x0f) ? 0x88 : 0x80;
-      insn[insn_idx].out = (flag << 4) | GET_REG(0);
-    } else if (strcmp(mnemonic, "store") == 0) {
-      insn_len = SetInputForBranch(insn + insn_idx, operands);
-      if (insn_len < 0) {
-        fprintf(stderr, "invalid store instruction: %s\n", line0);
-        exit(1);
-      }
-      insn[insn_idx].op |= (insn[insn_idx].op & 0x0f) ? 0x98 : 0x90;
-      insn[insn_idx].out = (flag << 4) | GET_REG(1);
-    } else if (strcmp(mnemonic, "push") == 0) {
-      insn[insn_idx].op = 0xd0;
-      insn[insn_idx].out = (flag << 4) | GET_REG(0);
-      insn_len = 1;
-    } else if (strcmp(mnemonic, "pop") == 0) {
-      insn[insn_idx].op = 0xc0;
-      insn[insn_idx].out = (flag << 4) | GET_REG(0);
-      insn_len = 1;
-    } else if (strcmp(mnemonic, "cmp") == 0) {
-      insn[insn_idx].op = 0x11;
-      insn[insn_idx].out = (flag << 4) | kRegZR;
-      struct RegImm in1 = GET_REGIMM(0, 0);
-      struct RegImm in2 = GET_REGIMM(1, in1.kind);
-      insn_len = SetInput(insn + insn_idx, &in1, &in2);
-    } else if (strcmp(mnemonic, "ret") == 0) {
-      insn[insn_idx].op = 0xc0;
-      insn[insn_idx].out = (flag << 4) | kRegIP;
-      insn_len = 1;
-    } else if (strcmp(mnemonic, "iret") == 0) {
-      insn[insn_idx].op = 0xe0;
-      insn[insn_idx].out = (flag << 4) | kRegIP;
-      insn_len = 1;
-    } else if (strcmp(mnemonic, ".dw") == 0) {
-      if (num_opr < 1 || 3 < num_opr) {
-        fprintf(stderr, ".dw takes 1 to 3 integers (words): %s\n", line0);
-        exit(1);
-      }
-      insn[insn_idx].ip = ip;
-      insn[insn_idx].len = num_opr;
-      ip += num_opr;
-
-      uint16_t data = DWGetValue(operands + 0);
-      insn[insn_idx].op = data >> 8;
-      insn[insn_idx].out = data & 0xff;
-      if (num_opr >= 2) {
-        data = DWGetValue(operands + 1);
-        insn[insn_idx].in = data >> 8;
-        insn[insn_idx].imm8 = data & 0xff;
-      }
-      if (num_opr >= 3) {
-        data = DWGetValue(operands + 2);
-        insn[insn_idx].imm16 = data;
-      }
-
-      insn_idx++;
-      continue;
-    } else if (strcmp(mnemonic, ".origin") == 0) {
-      struct Token *t = operands[0].tokens;
-      if (operands[0].len != 1 || t->kind != kTokenInt) {
-        fprintf(stderr, ".origin takes just one integer: %s\n", line0);
-        exit(1);
-      }
-      ip = t->val;
-      continue;
-    } else {
-      fprintf(stderr, "unknown mnemonic: '%s'\n", mnemonic);
-      exit(1);
+  }
+  if (CloseWriter(&outfile) < 0) {
+    err = -1;
+  }
+  if (!err && opt->make_deps) {
+    char *dep_path = opt->dep_file ? NULL : DepPath(cmd->outfile_name);
+    if (WriteDepFile(opt->dep_file ? opt->dep_file : dep_path, cmd->outfile_name,
+                     cmd->infile_name, ctx) < 0) {
+      perror("failed to write dependency file");
+      err = 1;
     }
-
-    insn[insn_idx].ip = ip;
-    insn[insn_idx].len = insn_len;
-    ip += insn_len;
-    insn_idx++;
+    free(dep_path);
   }
+  if (opt->optimize && !opt->object) {
+    PrintRewrites(stderr, ctx, src_name);
+  }
+  if (!opt->object) {
+    PrintLowData(stderr, ctx, src_name);
+  }
+  if (cmd->stats) {
+    uint64_t end_ns = NowNs();
+    PrintStats(stderr, ctx, read_ns, end_ns - output_start_ns, end_ns - start_ns,
+               cmd->stats == 2);
+  }
+  return err != 0;
+}
 
-  for (int i = 0; i < num_backpatches; i++) {
-    int l = 0;
-    for (; l < num_labels; l++) {
-      if (strcmp(backpatches[i].label, labels[l].label)) {
-        continue;
-      }
-
-      struct Instruction *target_insn = insn + backpatches[i].insn_idx;
-      switch (backpatches[i].type) {
-      case BP_ABS8:
-        if (labels[l].ip >= 256) {
-          fprintf(stderr, "label cannot be fit in imm8: '%s' -> %d\n",
-                  labels[l].label, labels[l].ip);
-          exit(1);
-        }
-        target_insn->imm8 = labels[l].ip;
-        break;
-      case BP_ABS16:
-        target_insn->imm16 = labels[l].ip;
-        break;
-      case BP_IP_REL8:
-      case BP_IP_REL16: {
-        int ip_base = target_insn->ip + target_insn->len;
-        int ip_diff = labels[l].ip - ip_base;
-        if (ip_diff < 0) {
-          ip_diff = -ip_diff;
-        }
-        if (backpatches[i].type == BP_IP_REL16) {
-          target_insn->imm16 = ip_diff;
-        } else if (ip_diff >= 256) {
-          fprintf(stderr, "ip-diff cannot be fit in imm8: abs('%s' - %d) -> %d\n",
-                  labels[l].label, ip_base, ip_diff);
-          exit(1);
-        } else {
-          target_insn->imm8 = ip_diff;
-        }
-        break;
-      }
-      default:
-        fprintf(stderr, "unknown relocation type: %d\n", backpatches[i].type);
-        exit(1);
-      }
-      break;
+// 1 つの入力をアセンブルする。戻り値: 終了コード
+int RunAssemble(const struct Command *cmd) {
+  const struct Options *opt = &cmd->opt;
+  if (opt->incremental && cmd->outfile_name == NULL) {
+    fprintf(stderr, "--incremental requires an output file (-o)\n");
+    return 1;
+  }
+  if (opt->make_deps && cmd->outfile_name == NULL) {
+    fprintf(stderr, "-MD/-MF requires an output file (-o)\n");
+    return 1;
+  }
+  uint64_t start_ns = cmd->stats ? NowNs() : 0, read_ns = 0;
+  struct nlpasm_ctx *ctx = NewContext(opt, ServeIncludeCache());
+  if (cmd->stats) {
+    nlpasm_enable_stats(ctx);
+  }
+  char *cache_path = opt->incremental ? CachePath(cmd->outfile_name) : NULL;
+  int err = AssembleFile(ctx, cmd->infile_name, cache_path, !opt->object,
+                         cmd->stats ? &read_ns : NULL);
+  free(cache_path);
+  int ret = 1;
+  if (err == -2) {
+    perror("failed to open input file");
+  } else {
+    if (err < 0 || opt->diag_json) {
+      PrintDiagnostics(stderr, ctx, cmd->infile_name ? cmd->infile_name : "<stdin>",
+                       opt->diag_json);
     }
-    if (l == num_labels) {
-      fprintf(stderr, "unknown label: %s\n", backpatches[i].label);
-      exit(1);
+    if (err == 0) {
+      ret = WriteAssembled(ctx, cmd, start_ns, read_ns);
     }
   }
+  nlpasm_ctx_free(ctx);
+  return ret;
+}
 
-  int debug = 0, byte = 0, little = 0;
-  enum OutputFormat outfmt = kFmtText;
-  const char *outfile_name = NULL;
-  for (int i = 1; i < argc; i++) {
-    if (strcmp(argv[i], "-d") == 0) {
-      debug = 1;
-    } else if (strcmp(argv[i], "-b") == 0) {
-      byte = 1;
-    } else if (strcmp(argv[i], "-l") == 0) {
-      little = 1;
-    } else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
-      const char *name = argv[++i];
-      if (strcmp(name, "text") == 0) {
-        outfmt = kFmtText;
-      } else if (strcmp(name, "bin") == 0) {
-        outfmt = kFmtBin;
-      } else {
-        fprintf(stderr, "unknown output format: '%s'\n", name);
-        exit(1);
-      }
-    } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
-      outfile_name = argv[++i];
+// --serve のサーバーは依頼ごとにこれを呼ぶので、どの経路でも確保したものを解放して戻る
+int NlpasmMain(int argc, char **argv) {
+  struct Command cmd = {
+    .opt = { .outfmt = kFmtText, .max_errors = 20 },
+    .infiles = XRealloc(NULL, sizeof(char *) * argc),
+    .isr_names = XRealloc(NULL, sizeof(char *) * argc),
+  };
+  cmd.opt.include_dirs = XRealloc(NULL, sizeof(char *) * argc);
+  int ret = 1;
+  if (ParseCommand(&cmd, argc, argv) == 0) {
+    if (cmd.batch) {
+      ret = RunBatchCommand(&cmd);
+    } else if (cmd.disasm) {
+      ret = RunDisassemble(&cmd);
+    } else {
+      ret = RunAssemble(&cmd);
     }
   }
+  free(cmd.infiles);
+  free(cmd.isr_names);
+  free(cmd.opt.include_dirs);
+  free(cmd.opt.emits);
+  return ret;
+}
 
-  FILE *outfile = stdout;
-  if (outfile_name) {
-    outfile = fopen(outfile_name, outfmt == kFmtText ? "w" : "wb");
-    if (outfile == NULL) {
-      perror("failed to open output file");
+int main(int argc, char **argv) {
+  if (argc >= 2 && strcmp(argv[1], "--serve") == 0) {
+    if (argc != 3) {
+      fprintf(stderr, "usage: nlpasm --serve socket-path\n");
       return 1;
     }
+    return Serve(argv[2]);
   }
-
-  if (outfmt == kFmtBin) {
-    for (int i = 0; i < insn_idx; i++) {
-      uint8_t buf[6];
-      int bytes = DumpInstruction(buf, insn + i, little);
-      fwrite(buf, 1, bytes, outfile);
-    }
-    return 0;
-  }
-
-  for (int i = 0; i < insn_idx; i++) {
-    if (debug) {
-      printf("%08x: ", insn[i].ip);
-    }
-
-    DumpWord(outfile, insn[i].op << 8 | insn[i].out, byte, little, debug ? ' ' : '\n');
-    if (insn[i].len >= 2) {
-      DumpWord(outfile, insn[i].in << 8 | insn[i].imm8, byte, little, debug ? ' ' : '\n');
-    } else if (debug) {
-      PutSpace(outfile, 5 + byte);
-    }
-    if (insn[i].len >= 3) {
-      DumpWord(outfile, insn[i].imm16, byte, little, debug ? ' ' : '\n');
-    } else if (debug) {
-      PutSpace(outfile, 5 + byte);
+  // NLPASM_SERVER のサーバーが動いていれば処理を任せ、いなければ自分で処理する
+  const char *server = getenv("NLPASM_SERVER");
+  if (server && *server) {
+    int status = RunClient(server, argc, argv);
+    if (status >= 0) {
+      return status;
     }
-
-#define FLG flag_names[insn[i].out >> 4]
-#define OUT reg_names[insn[i].out & 0xf]
-#define IN1 reg_names[insn[i].in >> 4]
-#define IN2 reg_names[insn[i].in & 0xf]
-#define INSN1(fmt) printf(fmt "%s %s",         FLG, OUT)
-#define INSN2(fmt) printf(fmt "%s %s, %s",     FLG, OUT, IN1)
-#define INSN3(fmt) printf(fmt "%s %s, %s, %s", FLG, OUT, IN1, IN2)
-    if(insn[i].op != 0xc0 && //pop
-       insn[i].op != 0xd0 && //push
-       insn[i].op != 0xe0 && //ret
-       debug != 0 &&
-       //insn[i].op != 0xe0 && //iret
-       insn[i].len == 1){
-        char dw_data = insn[i].op<<8 | insn[i].out;
-        #define DWCTRL(data) printf(".dw :%x\t[ \\%c ]\n",data,data);
-        #define DWCHAR(data) printf(".dw :%x\t[  %c ]\n",data,data);
-        switch (dw_data)
-        {
-          case 0x00:DWCTRL('0');break;
-          case 0x01:DWCTRL('?');break;
-          case 0x02:DWCTRL('?');break;
-          case 0x03:DWCTRL('?');break;
-          case 0x04:DWCTRL('?');break;
-          case 0x05:DWCTRL('?');break;
-          case 0x06:DWCTRL('?');break;
-          case 0x07:DWCTRL('a');break;
-          case 0x08:DWCTRL('b');break;
-          case 0x09:DWCTRL('t');break;
-          case 0x0A:DWCTRL('n');break;
-          case 0x0B:DWCTRL('v');break;
-          case 0x0C:DWCTRL('f');break;
-          case 0x0D:DWCTRL('r');break;
-          default:  DWCHAR(dw_data);break;
-        }
-        
-    }
-    else{
-      if (debug) {
-        printf(" ; ");
-        switch (insn[i].op) {
-        case 0x12: INSN3("add"); break;
-        case 0x11: INSN3("sub"); break;
-        case 0x16: INSN3("addc"); break;
-        case 0x15: INSN3("subc"); break;
-        case 0x0a: INSN3("or"); break;
-        case 0x0c: INSN2("not"); break;
-        case 0x0e: INSN3("xor"); break;
-        case 0x06: INSN3("and"); break;
-        case 0x1b: INSN2("inc"); break;
-        case 0x18: INSN2("dec"); break;
-        case 0x1f: INSN2("incc"); break;
-        case 0x1c: INSN2("decc"); break;
-        case 0x2c: INSN2("slr"); break;
-        case 0x20: INSN2("sll"); break;
-        case 0x24: INSN2("sal"); break;
-        case 0x2a: INSN2("ror"); break;
-        case 0x22: INSN2("rol"); break;
-        case 0x00: INSN2("mov"); break;
-        case 0xd0: INSN1("push"); break;
-        case 0xc0: INSN1("pop"); break;
-        case 0xb0: printf("call%s %s", FLG, IN1); break;
-        case 0xb1:
-        case 0xba:
-        case 0xb9:
-          printf("call%s %s%c%s", FLG, IN1, insn[i].op == 0xb1 ? '-' : '+', IN2);
-          break;
-        case 0xe0: printf("iret%s", FLG); break;
-        case 0x80: printf("load%s %s, %s", FLG, OUT, IN1); break;
-        case 0x81:
-        case 0x82:
-        case 0x8a:
-        case 0x89:
-          printf("load%s %s, %s%c%s", FLG, OUT, IN1, insn[i].op == 0x81 ? '-' : '+', IN2);
-          break;
-        case 0x90: printf("store%s %s, %s", FLG, IN1, OUT); break;
-        case 0x91:
-        case 0x92:
-        case 0x9a:
-        case 0x99:
-          printf("store%s %s%c%s, %s", FLG, IN1, insn[i].op == 0x91 ? '-' : '+', IN2, OUT);
-          break;
-        default: printf("?");
-        }
-      printf("\n");
-      }
-    }
-
-#undef FLG
-#undef OUT
-#undef IN1
-#undef IN2
-#undef INSN1
-#undef INSN2
-#undef INSN3
   }
-  return 0;
+  return NlpasmMain(argc, argv);
 }
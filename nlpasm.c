@@ -0,0 +1,4749 @@
+#include "nlpasm.h"
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "isa.h"
+#include "isa_hash.h"
+
+#define MAX_OPERAND 8
+#define ORIGIN 0
+
+static void *XRealloc(void *p, size_t size) {
+  p = realloc(p, size);
+  if (p == NULL) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+  return p;
+}
+
+// 配列 p の容量 cap を少なくとも n 要素に伸ばす
+#define RESERVE(p, cap, n) \
+  do { \
+    if ((n) > (cap)) { \
+      (cap) = (cap) ? (cap) * 2 : 1024; \
+      if ((n) > (cap)) { \
+        (cap) = (n); \
+      } \
+      (p) = XRealloc((p), (cap) * sizeof(*(p))); \
+    } \
+  } while (0)
+
+__attribute__((noreturn, format(printf, 2, 3)))
+static void Error(struct nlpasm_ctx *ctx, const char *fmt, ...);
+__attribute__((noreturn, format(printf, 3, 4)))
+static void ErrorAt(struct nlpasm_ctx *ctx, const char *pos, const char *fmt, ...);
+
+enum TokenKind {
+  kTokenInt = 128,
+  kTokenRelInt,
+  kTokenLabel,
+  kTokenRelLabel,
+  kTokenByte,
+  kTokenWord,
+  kTokenShl, // <<
+  kTokenShr, // >>
+  kTokenString, // "..."。raw と len は引用符の内側
+};
+
+struct Token {
+  //   0 - 15  : レジスタ名（kRegIR1 - kRegZR）
+  //  32 - 127 : 一文字演算子
+  // 128 - last: TokenKind
+  int kind;
+  const char *raw; // 入力バッファ内の位置
+  int len;
+  int val;
+};
+
+static void InitToken(struct Token *token, enum TokenKind kind, const char *raw, int len, int val) {
+  token->kind = kind;
+  token->raw = raw;
+  token->len = len;
+  token->val = val;
+}
+
+static int TokenIs(const struct Token *t, const char *name, int len) {
+  return t->len == len && memcmp(t->raw, name, len) == 0;
+}
+
+static const char* const reg_names[16] = {
+#define REG(name) name,
+#include "isa.def"
+};
+enum RegNames {
+  kRegIR1,  kRegIR2, kRegIR3, kRegFLAG,
+  kRegIV,   kRegA,   kRegB,   kRegC,
+  kRegD,    kRegE,   kRegMEM, kRegBANK,
+  kRegADDR, kRegIP,  kRegSP,  kRegZR
+};
+
+static int RegNameToIndex(const char *name, int n) {
+  int i = reg_hash_slots[IsaHash(name, n, REG_HASH_SEED) & (REG_HASH_SIZE - 1)];
+  if (i >= 0 && strncasecmp(reg_names[i], name, n) == 0 && reg_names[i][n] == '\0') {
+    return i;
+  }
+  return -1;
+}
+
+struct Operand {
+  int len;
+  const struct Token *tokens; // TokenPool の中か、取り込んだファイルの字句解析結果の中
+};
+
+// トークンの置き場所
+// オペランドのトークン数に上限は無く、チャンク単位で確保する。チャンクは移動しないので、
+// マクロの展開が入れ子になっても外側のオペランドのトークンはそのまま使える。
+// 使い終わった分は TokenRelease で印を付けた位置まで戻し、チャンクは次に使い回す。
+#define TOKEN_CHUNK 1024
+struct TokenChunk {
+  struct TokenChunk *next;
+  int used, cap;
+  struct Token tokens[];
+};
+
+struct TokenPool {
+  struct TokenChunk *first;
+  struct TokenChunk *cur; // 使っている最後のチャンク。NULL なら何も使っていない
+};
+
+struct TokenMark {
+  struct TokenChunk *chunk;
+  int used;
+};
+
+// 次のチャンクへ進む。空きが need 個以上、容量が cap 個以上のものが無ければ作って挟む。
+static struct TokenChunk *NextTokenChunk(struct TokenPool *pool, int need, int cap) {
+  struct TokenChunk *c = pool->cur;
+  struct TokenChunk *next = c ? c->next : pool->first;
+  if (next == NULL || next->cap < need) {
+    if (cap < TOKEN_CHUNK) {
+      cap = TOKEN_CHUNK;
+    }
+    struct TokenChunk *k = XRealloc(NULL, sizeof(*k) + sizeof(struct Token) * cap);
+    k->cap = cap;
+    k->next = next;
+    *(c ? &c->next : &pool->first) = k;
+    next = k;
+  }
+  next->used = 0;
+  pool->cur = next;
+  return next;
+}
+
+// 空のオペランドを pool の末尾に作る
+static void BeginOperand(struct TokenPool *pool, struct Operand *opr) {
+  struct TokenChunk *c = pool->cur;
+  opr->len = 0;
+  opr->tokens = c ? c->tokens + c->used : NULL;
+}
+
+// pool の末尾にある opr にトークンを 1 つ足す。チャンクが一杯なら opr ごと次へ移す。
+static struct Token *AddToken(struct TokenPool *pool, struct Operand *opr) {
+  struct TokenChunk *c = pool->cur;
+  if (c == NULL || c->used == c->cap) {
+    if (c) {
+      c->used -= opr->len;
+    }
+    struct TokenChunk *next = NextTokenChunk(pool, opr->len + 1, (opr->len + 1) * 2);
+    if (opr->len > 0) {
+      memcpy(next->tokens, opr->tokens, sizeof(struct Token) * opr->len);
+    }
+    next->used = opr->len;
+    opr->tokens = next->tokens;
+    c = next;
+  }
+  opr->len++;
+  return c->tokens + c->used++;
+}
+
+static struct TokenMark TokenMarkOf(const struct TokenPool *pool) {
+  return (struct TokenMark){pool->cur, pool->cur ? pool->cur->used : 0};
+}
+
+// mark より後に確保したトークンを捨てる
+static void TokenRelease(struct TokenPool *pool, struct TokenMark mark) {
+  pool->cur = mark.chunk;
+  if (mark.chunk) {
+    mark.chunk->used = mark.used;
+  }
+}
+
+static void FreeTokenPool(struct TokenPool *pool) {
+  while (pool->first) {
+    struct TokenChunk *next = pool->first->next;
+    free(pool->first);
+    pool->first = next;
+  }
+  pool->cur = NULL;
+}
+
+// strtol(p, endptr, 0) と同様に整数を読む。ただし end より先は読まない。
+static int ParseInt(const char *p, const char *end, const char **endptr) {
+  int base = 10;
+  if (p < end && *p == '0') {
+    base = 8;
+    if (p + 2 < end && (p[1] == 'x' || p[1] == 'X') && isxdigit(p[2])) {
+      base = 16;
+      p += 2;
+    }
+  }
+
+  long v = 0;
+  for (; p < end; p++) {
+    int d;
+    if (isdigit(*p)) {
+      d = *p - '0';
+    } else if (isxdigit(*p)) {
+      d = tolower(*p) - 'a' + 10;
+    } else {
+      break;
+    }
+    if (d >= base) {
+      break;
+    }
+    v = v * base + d;
+  }
+  *endptr = p;
+  return v;
+}
+
+static const char *SkipAlnum(const char *p, const char *end) {
+  while (p < end && isalnum(*p)) {
+    p++;
+  }
+  return p;
+}
+
+// p（'"'）から始まる文字列リテラルの直後を返す。閉じていなければ NULL
+static const char *SkipString(const char *p, const char *end) {
+  for (p++; p < end; p++) {
+    if (*p == '\\' && p + 1 < end) {
+      p++;
+    } else if (*p == '"') {
+      return p + 1;
+    }
+  }
+  return NULL;
+}
+
+// [p, end) の文字列リテラルの外で c1 か c2 が最初に現れる位置を返す。無ければ end
+static const char *FindOutsideString(const char *p, const char *end, char c1, char c2) {
+  if (memchr(p, '"', end - p) == NULL) { // ほとんどの行は文字列を含まないので memchr で探す
+    const char *q1 = memchr(p, c1, end - p);
+    const char *q2 = c2 != c1 ? memchr(p, c2, (q1 ? q1 : end) - p) : NULL;
+    return q2 ? q2 : q1 ? q1 : end;
+  }
+  while (p < end && *p != c1 && *p != c2) {
+    if (*p != '"') {
+      p++;
+    } else if ((p = SkipString(p, end)) == NULL) {
+      return end;
+    }
+  }
+  return p;
+}
+
+// [p, end) をトークンに分割して pool に置く。トークンは入力バッファを直接指す。
+static void TokenizeOperand(struct nlpasm_ctx *ctx, struct TokenPool *pool, const char *p,
+                            const char *end, struct Operand *dest) {
+  BeginOperand(pool, dest);
+  for (;;) {
+    while (p < end && strchr(" \t\r", *p)) {
+      p++;
+    }
+    if (p == end) {
+      return;
+    }
+    struct Token *t = AddToken(pool, dest);
+
+    if (isdigit(*p)) {
+      const char *endptr;
+      int v = ParseInt(p, end, &endptr);
+      InitToken(t, kTokenInt, p, endptr - p, v);
+      p = endptr;
+    } else if (isalpha(*p)) {
+      const char *endptr = SkipAlnum(p + 1, end);
+      int len = endptr - p;
+      if (len == 4 && strncmp(p, "byte", 4) == 0) {
+        InitToken(t, kTokenByte, p, 4, 0);
+      } else if (len == 4 && strncmp(p, "word", 4) == 0) {
+        InitToken(t, kTokenWord, p, 4, 0);
+      } else {
+        int reg_idx = RegNameToIndex(p, len);
+        if (reg_idx < 0) {
+          InitToken(t, kTokenLabel, p, len, 0);
+        } else {
+          InitToken(t, reg_idx, p, len, 0);
+        }
+      }
+      p = endptr;
+    } else if (*p == '"') {
+      const char *endptr = SkipString(p, end);
+      if (endptr == NULL) {
+        ErrorAt(ctx, p, "unterminated string: %.*s\n", (int)(end - p), p);
+      }
+      InitToken(t, kTokenString, p + 1, endptr - p - 2, 0);
+      p = endptr;
+    } else if (strchr("+-*/%&|^~()", *p)) {
+      InitToken(t, *p, p, 1, 0);
+      p++;
+    } else if (p + 1 < end && (p[0] == '<' || p[0] == '>') && p[1] == p[0]) {
+      InitToken(t, p[0] == '<' ? kTokenShl : kTokenShr, p, 2, 0);
+      p += 2;
+    } else if (p[0] == '@') {
+      const char *endptr;
+      if (p + 1 < end && isdigit(p[1])) {
+        int v = ParseInt(p + 1, end, &endptr);
+        InitToken(t, kTokenRelInt, p + 1, endptr - p - 1, v);
+      } else if (p + 1 < end && isalpha(p[1])) {
+        endptr = SkipAlnum(p + 2, end);
+        InitToken(t, kTokenRelLabel, p + 1, endptr - p - 1, 0);
+      } else {
+        ErrorAt(ctx, p, "unexpectec character for relative-int/label: '%c'\n",
+                p + 1 < end ? p[1] : ' ');
+      }
+      p = endptr;
+    } else {
+      ErrorAt(ctx, p, "unexpected character:: '%c'\n", *p);
+    }
+  }
+}
+
+// 1 行を分解した結果。各部分は入力バッファを指す。
+struct SrcLine {
+  const char *label; // ラベルが無ければ NULL
+  int label_len;
+  const char *mnemonic; // 命令が無ければ NULL
+  int mnemonic_len;
+  const char *rest;     // 分割しきれなかったオペランド（先頭は ','）。無ければ NULL
+  const char *rest_end;
+};
+
+// [line, end) をラベル・ニーモニック・オペランドに分割する。入力は書き換えない。
+// オペランドのトークンは pool に置く。
+// 戻り値: オペランドの数。ニーモニックが無ければ -1
+static int SplitOpcode(struct nlpasm_ctx *ctx, struct TokenPool *pool, const char *line,
+                       const char *end, struct SrcLine *sl, struct Operand *operands, int n) {
+  end = FindOutsideString(line, end, ';', '#');
+
+  const char *colon = FindOutsideString(line, end, ':', '"');
+  sl->label = NULL;
+  if (colon < end && *colon == ':') {
+    sl->label = line;
+    sl->label_len = colon - line;
+    line = colon + 1;
+  }
+
+  while (line < end && strchr(" \t\r", *line)) {
+    line++;
+  }
+  if (line == end) {
+    sl->mnemonic = NULL;
+    sl->rest = NULL;
+    return -1;
+  }
+  sl->mnemonic = line;
+  while (line < end && !strchr(" \t\r", *line)) {
+    line++;
+  }
+  sl->mnemonic_len = line - sl->mnemonic;
+
+  int i = 0;
+  while (i < n && line < end) {
+    const char *opr = ++line;
+    line = FindOutsideString(line, end, ',', ',');
+    TokenizeOperand(ctx, pool, opr, line, operands + i);
+    if (operands[i].len > 0) { // 空のオペランドは読み飛ばす
+      i++;
+    }
+  }
+  sl->rest = line < end ? line : NULL;
+  sl->rest_end = end;
+  return i;
+}
+
+enum RegImmKind {
+  kReg = 0, kImm8 = 1, kImm16 = 2
+};
+
+struct RegImm {
+  enum RegImmKind kind;
+  int16_t val;
+  int sym; // 即値がラベルの場合は symbols のインデックス、それ以外は -1
+  int bp;  // 即値を後で埋める場合は backpatches のインデックス、それ以外は -1
+};
+
+struct FlagDef {
+  const char *name;
+  uint8_t bits;
+};
+static const struct FlagDef flag_defs[] = {
+#define FLAG(name, bits) {name, bits},
+#include "isa.def"
+};
+
+static uint8_t FlagNameToBits(struct nlpasm_ctx *ctx, const char* flag_name, int n) {
+  int i = flag_hash_slots[IsaHash(flag_name, n, FLAG_HASH_SEED) & (FLAG_HASH_SIZE - 1)];
+  if (i >= 0 && strncasecmp(flag_defs[i].name, flag_name, n) == 0 &&
+      flag_defs[i].name[n] == '\0') {
+    return flag_defs[i].bits;
+  }
+  ErrorAt(ctx, flag_name, "unknown flag: '%.*s'\n", n, flag_name);
+}
+
+// 符号化途中の命令。確定したら EmitInstruction で words に書き出す。
+struct Instruction {
+  uint8_t op, out;
+  uint8_t in, imm8;
+  uint16_t imm16;
+};
+
+enum DataWidth {
+  kByte,
+  kWord,
+};
+
+// hi()/lo() で取り出す部分
+enum ExprPart {
+  kPartAll,
+  kPartHi, // 上位 8 ビット
+  kPartLo, // 下位 8 ビット
+};
+
+// Back patch type
+enum BPType {
+  BP_ABS,
+  BP_ABS8,
+  BP_ABS16,
+  BP_IP_REL,
+  BP_IP_REL8,
+  BP_IP_REL16,
+};
+
+struct Backpatch {
+  int insn_idx;
+  int sym; // symbols のインデックス
+  enum BPType type;
+  uint8_t relax;  // サイズプレフィクスが無く、imm8 から imm16 へ伸長してよい
+  uint8_t shift;  // 即値番号が入っている in のニブル位置（4: 入力 1, 0: 入力 2）
+  uint8_t op_rel; // 0 以外なら分岐命令。IP 相対時の op は op_rel | 方向
+  uint8_t sign;   // IP 相対の差分を絶対値ではなく符号付きで埋める
+  uint8_t part;   // 値のうち埋める部分（enum ExprPart）
+  int sym2;       // 値から引くシンボル（ラベルの差）。無ければ -1
+  int addend;     // 値に足す定数
+  int col;        // 参照したオペランドの桁（1 始まり）。分からなければ 0
+};
+
+static void InitBackpatch(struct Backpatch *bp, int insn_idx,
+                   int sym, enum BPType type) {
+  bp->insn_idx = insn_idx;
+  bp->sym = sym;
+  bp->type = type;
+  bp->relax = 0;
+  bp->shift = 0;
+  bp->op_rel = 0;
+  bp->sign = 0;
+  bp->part = 0;
+  bp->sym2 = -1;
+  bp->addend = 0;
+  bp->col = 0;
+}
+
+// 文字列プール
+// ラベル名をチャンク単位でまとめて確保する。チャンクは移動しないので
+// 返したポインタは最後まで有効。
+#define STR_POOL_CHUNK 4096
+struct StrPoolChunk {
+  struct StrPoolChunk *next;
+  size_t used, cap;
+  char buf[];
+};
+enum ConstKind {
+  kConstNone,
+  kConstEqu, // 再定義できない
+  kConstSet, // .set で何度でも定義し直せる
+};
+
+// シンボル表
+// オープンアドレス法（線形探索）のハッシュ表。スロットには symbols のインデックスを格納する。
+struct Symbol {
+  const char *name; // 文字列プール内の名前
+  int len;
+  uint32_t hash;
+  int ip;       // 未定義なら -1
+  int insn_idx; // ラベルが指す位置（この番号の命令の直前）。固定アドレスなら -1
+  uint8_t global; // .global で公開する（オブジェクトファイルで他から参照できる）
+  uint8_t anon;   // 名前で引けない（ハッシュ表に入れない）
+  uint8_t constant; // .equ/.set で定義した定数（enum ConstKind）。ip は値の下位 16 ビット
+  int value;        // 定数の値
+};
+
+// アセンブラの状態
+struct nlpasm_ctx {
+  // 出力ワード列。命令もデータもここに詰めて格納する。
+  uint16_t *words;
+  int num_words, cap_words;
+
+  struct nlpasm_insn *insns;
+  int num_insns, cap_insns;
+  int ip;
+
+  struct Backpatch *backpatches;
+  int num_backpatches, cap_backpatches;
+
+  struct Symbol *symbols;
+  int num_symbols, cap_symbols;
+  int *sym_slots;    // -1 なら空き
+  int cap_sym_slots; // 2 のべき乗
+
+  struct StrPoolChunk *str_pool;
+
+  // オペランドのトークン。line_tokens は nlpasm_assemble_line の 1 行の間だけ使い、
+  // body_tokens には .macro/.rept の本体を記録する。
+  struct TokenPool line_tokens;
+  struct TokenPool body_tokens;
+
+  // 行キャッシュ（nlpasm_cache_load で有効になる）
+  int cache_enabled;
+  struct CacheLine *cache_lines;
+  int num_cache_lines, cap_cache_lines;
+  int *cache_slots;    // -1 なら空き
+  int cap_cache_slots; // 2 のべき乗
+  char *cache_blob;    // 行の本文とラベル名
+  int cache_blob_len, cap_cache_blob;
+  char *cache_out;     // nlpasm_cache_data が返す直列化済みのキャッシュ
+  int line_dep;        // 処理中の行の符号化が前の行の状態に依存した
+  int line_label;      // 処理中の行が定義したラベル。無ければ -1
+  int data_break;      // この添字の命令からはデータを前の命令につなげない（ラベルなどの位置）
+  int little_endian;   // .string と .incbin でバイト列をワードに詰める順
+  uint8_t *str_buf;    // .string のエスケープを解いたバイト列
+  int cap_str_buf;
+
+  struct nlpasm_stats stats;
+  int stats_enabled;
+
+  struct nlpasm_advice *advice;
+  int num_advice, cap_advice;
+
+  // のぞき穴最適化（nlpasm_enable_optimize で有効になる）
+  int optimize;
+  struct nlpasm_rewrite *rewrites;
+  int num_rewrites, cap_rewrites;
+  char opt_note[128]; // 命令長を変える書き換えを止めた理由。無ければ空
+
+  // 静的なサイクル数の見積もり（nlpasm_get_blocks などで作る）
+  int blocks_ready;
+  struct nlpasm_block *blocks;
+  int num_blocks, cap_blocks;
+  struct BlockExit *block_exits;
+  int *block_of;       // 命令ごとの所属ブロック。コードでなければ -1
+  struct IpIndex *code_by_ip; // コードの命令をアドレス順に並べたもの
+  int num_code;
+  struct nlpasm_routine *routines;
+  int num_routines, cap_routines;
+  int *isr_ips;        // nlpasm_mark_isr で指定された入口
+  int num_isr, cap_isr;
+
+  // マクロと .rept
+  struct BodyLine *body_lines;   // 記録した本体の行（マクロごとに連続した範囲）
+  int num_body_lines, cap_body_lines;
+  struct Operand *body_oprs;     // 本体の行のオペランド
+  int num_body_oprs, cap_body_oprs;
+  struct Macro *macros;
+  int num_macros, cap_macros;
+  int recording;   // 本体を記録中なら kRecMacro か kRecRept、それ以外は 0
+  int rec_depth;   // 記録中の本体の中にある .macro/.rept の入れ子の深さ
+  int rec_first;   // 記録中の本体の先頭（body_lines の添字）
+  struct TokenMark rec_tokens; // 記録を始めたときの body_tokens の位置
+  int rec_count;   // 記録中の .rept の回数
+  int expansions;  // 展開の通し番号（ローカルラベルの名前に使う）
+  int expand_depth;
+
+  // .include
+  const char *source_name;  // 最上位のソースの名前。NULL なら標準入力
+  const char *include_from; // 処理中のファイルの名前（相対パスの基準）
+  const char **include_dirs;
+  int num_include_dirs, cap_include_dirs;
+  struct Included *included; // 取り込んだファイル（インクルードガード用）
+  int num_included, cap_included;
+  const char **include_names; // nlpasm_get_includes が返す配列
+  struct nlpasm_include_cache *include_cache;
+  int own_include_cache;     // include_cache をこのコンテキストで作った
+  struct IncludeText *error_texts; // 字句解析でエラーの出た、共有しないファイル
+
+  // .lowdata
+  int low_start;               // 処理中の .lowdata の先頭の命令。区間の外なら -1
+  struct LowRange *low_ranges; // 閉じた .lowdata の区間（命令の添字の順）
+  int num_low_ranges, cap_low_ranges;
+  struct LowObj *low_objs;     // nlpasm_finish で作る、ラベルごとのかたまり（ソースの順）
+  int num_low_objs;
+  int *low_order;              // 配置する順（low_objs の添字）
+  struct nlpasm_lowdata *lowdata; // nlpasm_get_lowdata が返す配列
+
+  // nlpasm_get_segments が返すセグメント（アドレス順）
+  struct nlpasm_segment *segments;
+  int num_segments, cap_segments;
+
+  // nlpasm_get_object が返す直列化済みのオブジェクト
+  uint8_t *obj_out;
+  int obj_len, cap_obj;
+
+  // エラーメッセージ（改行区切り）
+  char *diag;
+  int diag_len, cap_diag;
+  struct Diag *diags;  // メッセージごとの場所
+  int num_diags, cap_diags;
+  struct nlpasm_diag *diag_out; // nlpasm_get_diags が返す配列
+  int num_diag_out, cap_diag_out;
+  int max_errors;      // この数のエラーで打ち切る。0 なら打ち切らない
+  int failed;          // 打ち切った。以降の行は受け付けない
+  jmp_buf *err_jmp;    // Error の戻り先
+
+  // 処理中の行の場所（エラーメッセージに付ける）
+  const char *loc_file;             // NULL なら標準入力
+  int loc_line;
+  const char *loc_text, *loc_end;   // 行の本文。桁を数える基準。無ければ NULL
+  int loc_col;                      // 本文が無いときに付ける桁（バックパッチの場所）。無ければ 0
+};
+
+// エラーメッセージ 1 件の場所。本文は diag の [msg, msg + msg_len)
+struct Diag {
+  const char *file;
+  int line, col;
+  int msg, msg_len;
+};
+
+// pos が処理中の行の本文を指していれば、その桁（1 始まり）。そうでなければ 0
+static int Column(const struct nlpasm_ctx *ctx, const char *pos) {
+  return pos && ctx->loc_text && ctx->loc_text <= pos && pos <= ctx->loc_end
+             ? pos - ctx->loc_text + 1 : 0;
+}
+
+// エラーメッセージを処理中の行の場所とともに記録する。
+// pos が処理中の行の本文を指していれば、その桁も記録する。
+static void AddDiag(struct nlpasm_ctx *ctx, const char *pos, const char *fmt, va_list ap) {
+  va_list ap2;
+  va_copy(ap2, ap);
+  int n = vsnprintf(NULL, 0, fmt, ap2);
+  va_end(ap2);
+
+  RESERVE(ctx->diag, ctx->cap_diag, ctx->diag_len + n + 1);
+  vsnprintf(ctx->diag + ctx->diag_len, n + 1, fmt, ap);
+  RESERVE(ctx->diags, ctx->cap_diags, ctx->num_diags + 1);
+  struct Diag *d = ctx->diags + ctx->num_diags++;
+  d->file = ctx->loc_file;
+  d->line = ctx->loc_line;
+  d->col = pos ? Column(ctx, pos) : ctx->loc_col;
+  d->msg = ctx->diag_len;
+  d->msg_len = n > 0 && ctx->diag[ctx->diag_len + n - 1] == '\n' ? n - 1 : n;
+  ctx->diag_len += n;
+  if (ctx->max_errors > 0 && ctx->num_diags >= ctx->max_errors) {
+    ctx->failed = 1;
+  }
+}
+
+// エラーを記録し、処理中の行（または nlpasm_finish）から抜ける
+__attribute__((noreturn, format(printf, 2, 3)))
+static void Error(struct nlpasm_ctx *ctx, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  AddDiag(ctx, NULL, fmt, ap);
+  va_end(ap);
+  longjmp(*ctx->err_jmp, 1);
+}
+
+// Error と同じ。pos（行の中のトークンなど）の桁をメッセージに付ける。
+__attribute__((noreturn, format(printf, 3, 4)))
+static void ErrorAt(struct nlpasm_ctx *ctx, const char *pos, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  AddDiag(ctx, pos, fmt, ap);
+  va_end(ap);
+  longjmp(*ctx->err_jmp, 1);
+}
+
+// エラーを記録する。エラーから回復する設定で、まだ打ち切っていなければ戻る。
+__attribute__((format(printf, 2, 3)))
+static void RecoverableError(struct nlpasm_ctx *ctx, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  AddDiag(ctx, NULL, fmt, ap);
+  va_end(ap);
+  if (ctx->failed) {
+    longjmp(*ctx->err_jmp, 1);
+  }
+}
+
+// 行の処理を始める前の状態。エラーになった行の途中までの出力を取り消すのに使う。
+struct LineState {
+  int num_words, num_insns, num_backpatches, ip;
+  int last_len; // 直前の命令の長さ（EmitData で伸びる）
+  int expand_depth;
+  const char *include_from;
+};
+
+static void SaveLineState(struct nlpasm_ctx *ctx, struct LineState *ls) {
+  ls->num_words = ctx->num_words;
+  ls->num_insns = ctx->num_insns;
+  ls->num_backpatches = ctx->num_backpatches;
+  ls->ip = ctx->ip;
+  ls->last_len = ctx->num_insns > 0 ? ctx->insns[ctx->num_insns - 1].len : 0;
+  ls->expand_depth = ctx->expand_depth;
+  ls->include_from = ctx->include_from;
+}
+
+static void RestoreLineState(struct nlpasm_ctx *ctx, const struct LineState *ls) {
+  ctx->num_words = ls->num_words;
+  ctx->num_insns = ls->num_insns;
+  if (ls->num_insns > 0) {
+    ctx->insns[ls->num_insns - 1].len = ls->last_len;
+  }
+  ctx->num_backpatches = ls->num_backpatches;
+  ctx->ip = ls->ip;
+  ctx->expand_depth = ls->expand_depth;
+  ctx->include_from = ls->include_from;
+}
+
+static const char *StrPoolAdd(struct nlpasm_ctx *ctx, const char *s, int len) {
+  if (ctx->str_pool == NULL || ctx->str_pool->cap - ctx->str_pool->used < (size_t)len + 1) {
+    size_t cap = len + 1 > STR_POOL_CHUNK ? len + 1 : STR_POOL_CHUNK;
+    struct StrPoolChunk *c = XRealloc(NULL, sizeof(*c) + cap);
+    c->next = ctx->str_pool;
+    c->used = 0;
+    c->cap = cap;
+    ctx->str_pool = c;
+  }
+  char *p = ctx->str_pool->buf + ctx->str_pool->used;
+  memcpy(p, s, len);
+  p[len] = '\0';
+  ctx->str_pool->used += len + 1;
+  return p;
+}
+
+
+static uint32_t HashName(const char *s, int len) {
+  uint32_t h = 2166136261u; // FNV-1a
+  for (int i = 0; i < len; i++) {
+    h = (h ^ (uint8_t)s[i]) * 16777619u;
+  }
+  return h;
+}
+
+static void GrowSymSlots(struct nlpasm_ctx *ctx) {
+  int cap = ctx->cap_sym_slots ? ctx->cap_sym_slots * 2 : 256;
+  free(ctx->sym_slots);
+  ctx->sym_slots = XRealloc(NULL, cap * sizeof(int));
+  for (int i = 0; i < cap; i++) {
+    ctx->sym_slots[i] = -1;
+  }
+  ctx->cap_sym_slots = cap;
+  for (int s = 0; s < ctx->num_symbols; s++) {
+    if (ctx->symbols[s].anon) {
+      continue;
+    }
+    int i = ctx->symbols[s].hash & (cap - 1);
+    while (ctx->sym_slots[i] >= 0) {
+      i = (i + 1) & (cap - 1);
+    }
+    ctx->sym_slots[i] = s;
+  }
+}
+
+// 名前に対応するシンボルを探し、無ければ未定義シンボルとして登録する
+// 戻り値: symbols のインデックス
+static int InternSymbol(struct nlpasm_ctx *ctx, const char *name, int len) {
+  if ((ctx->num_symbols + 1) * 4 > ctx->cap_sym_slots * 3) {
+    GrowSymSlots(ctx);
+  }
+
+  uint32_t hash = HashName(name, len);
+  int i = hash & (ctx->cap_sym_slots - 1);
+  long probes = 1;
+  ctx->stats.label_lookups++;
+  for (; ctx->sym_slots[i] >= 0; i = (i + 1) & (ctx->cap_sym_slots - 1), probes++) {
+    struct Symbol *sym = ctx->symbols + ctx->sym_slots[i];
+    if (sym->hash == hash && sym->len == len && memcmp(sym->name, name, len) == 0) {
+      break;
+    }
+  }
+  ctx->stats.label_probes += probes;
+  if (probes > ctx->stats.label_max_probe) {
+    ctx->stats.label_max_probe = probes;
+  }
+  if (ctx->sym_slots[i] >= 0) {
+    return ctx->sym_slots[i];
+  }
+
+  RESERVE(ctx->symbols, ctx->cap_symbols, ctx->num_symbols + 1);
+  struct Symbol *sym = ctx->symbols + ctx->num_symbols;
+  sym->name = StrPoolAdd(ctx, name, len);
+  sym->len = len;
+  sym->hash = hash;
+  sym->ip = -1;
+  sym->insn_idx = -1;
+  sym->global = 0;
+  sym->anon = 0;
+  sym->constant = kConstNone;
+  sym->value = 0;
+  ctx->sym_slots[i] = ctx->num_symbols;
+  return ctx->num_symbols++;
+}
+
+// 名前で引けないシンボルを登録する。
+// 固定アドレス（@ 付きの数値）や、リンク時のオブジェクト内のローカルラベルに使う。
+static int AddAnonSymbol(struct nlpasm_ctx *ctx, const char *raw, int len, int addr,
+                         int insn_idx) {
+  RESERVE(ctx->symbols, ctx->cap_symbols, ctx->num_symbols + 1);
+  struct Symbol *sym = ctx->symbols + ctx->num_symbols;
+  sym->name = StrPoolAdd(ctx, raw, len);
+  sym->len = len;
+  sym->hash = 0;
+  sym->ip = addr;
+  sym->insn_idx = insn_idx;
+  sym->global = 0;
+  sym->anon = 1;
+  sym->constant = kConstNone;
+  sym->value = 0;
+  return ctx->num_symbols++;
+}
+
+// 固定アドレスを指す名前なしのシンボルを登録する（@ 付きの数値用）
+static int AddAddrSymbol(struct nlpasm_ctx *ctx, const char *raw, int len, int addr) {
+  return AddAnonSymbol(ctx, raw, len, addr, -1);
+}
+
+// ラベルを定義する。二重定義はエラー。
+static void DefineLabel(struct nlpasm_ctx *ctx, const char *name, int len) {
+  while (len > 0 && strchr(" \t", *name)) {
+    name++;
+    len--;
+  }
+  while (len > 0 && strchr(" \t", name[len - 1])) {
+    len--;
+  }
+  int s = InternSymbol(ctx, name, len);
+  if (ctx->symbols[s].ip >= 0) {
+    ErrorAt(ctx, name, "label redefined: '%.*s'\n", len, name);
+  }
+  ctx->symbols[s].ip = ctx->ip;
+  ctx->symbols[s].insn_idx = ctx->num_insns;
+  ctx->line_label = s;
+  ctx->data_break = ctx->num_insns;
+}
+
+// n ワードの命令を追加し、そのワード列を返す（中身は呼び出し側で書く）
+static uint16_t *EmitSpace(struct nlpasm_ctx *ctx, int n) {
+  RESERVE(ctx->insns, ctx->cap_insns, ctx->num_insns + 1);
+  RESERVE(ctx->words, ctx->cap_words, ctx->num_words + n);
+  struct nlpasm_insn *info = ctx->insns + ctx->num_insns++;
+  info->ip = ctx->ip;
+  info->pos = ctx->num_words;
+  info->len = n;
+  info->data = 0;
+  info->line = ctx->stats.lines;
+  ctx->num_words += n;
+  ctx->ip += n;
+  return ctx->words + info->pos;
+}
+
+static void EmitWords(struct nlpasm_ctx *ctx, const uint16_t *w, int n) {
+  memcpy(EmitSpace(ctx, n), w, n * sizeof(uint16_t));
+}
+
+// n ワードのデータを置き、そのワード列を返す（中身は呼び出し側で書く）。
+// 直前もデータで、間にラベルや .lowdata の境目が無ければ同じ命令につなげるので、
+// 続けて書いた .dw などは 1 つの連続したデータになる。
+static uint16_t *EmitData(struct nlpasm_ctx *ctx, int n) {
+  struct nlpasm_insn *last = ctx->num_insns > 0 ? ctx->insns + ctx->num_insns - 1 : NULL;
+  if (last == NULL || !last->data || ctx->data_break == ctx->num_insns) {
+    uint16_t *w = EmitSpace(ctx, n);
+    ctx->insns[ctx->num_insns - 1].data = 1;
+    if (n > 3) {
+      ctx->line_dep = 1; // 行キャッシュは 3 ワードまでしか持てない
+    }
+    return w;
+  }
+  RESERVE(ctx->words, ctx->cap_words, ctx->num_words + n);
+  last->len += n;
+  ctx->num_words += n;
+  ctx->ip += n;
+  ctx->line_dep = 1; // 前の行の命令を伸ばしたので行キャッシュには記録できない
+  return ctx->words + ctx->num_words - n;
+}
+
+static void EmitInstruction(struct nlpasm_ctx *ctx, struct Instruction *ins, int len) {
+  uint16_t w[3] = {ins->op << 8 | ins->out, ins->in << 8 | ins->imm8, ins->imm16};
+  EmitWords(ctx, w, len);
+}
+
+static void EmitOrigin(struct nlpasm_ctx *ctx, int addr) {
+  RESERVE(ctx->insns, ctx->cap_insns, ctx->num_insns + 1);
+  struct nlpasm_insn *info = ctx->insns + ctx->num_insns++;
+  info->ip = addr;
+  info->pos = ctx->num_words;
+  info->len = 0;
+  info->data = 0;
+  info->line = ctx->stats.lines;
+  ctx->ip = addr;
+}
+
+// pos は参照しているオペランドの位置（解決できないときのエラーの桁）。
+// 取り込んだファイルの中の命令は行番号が .include の行になるので、桁は付けない。
+static int AddBackpatch(struct nlpasm_ctx *ctx, int sym, enum BPType type, const char *pos) {
+  RESERVE(ctx->backpatches, ctx->cap_backpatches, ctx->num_backpatches + 1);
+  struct Backpatch *bp = ctx->backpatches + ctx->num_backpatches;
+  InitBackpatch(bp, ctx->num_insns, sym, type);
+  bp->col = ctx->loc_file == ctx->source_name ? Column(ctx, pos) : 0;
+  return ctx->num_backpatches++;
+}
+
+// i 番目のオペランドを文字列として取得
+static struct Operand *GetOperand(struct nlpasm_ctx *ctx, const char *mnemonic,
+                                  struct Operand *operands, int n, int i) {
+  if (n <= i) {
+    Error(ctx, "too few operands for '%s': %d\n", mnemonic, n);
+  }
+  return operands + i;
+}
+
+// i 番目のオペランドをレジスタ番号として取得
+static int GetOperandReg(struct Operand *operand) {
+  if (operand->len == 1 && operand->tokens[0].kind < 16) {
+    return operand->tokens[0].kind;
+  }
+  return -1;
+}
+
+// 定数式
+//
+// 演算子の優先順位は C と同じ（単項 - ~ > * / % > + - > << >> > & > ^ > |）。
+// 定義済みの .equ/.set は値に置き換えて畳み込む。ラベルを含む式は
+// 「ラベル - ラベル + 定数」とそれを hi()/lo() で囲んだものに限り、
+// 値はアドレスが決まってから BackpatchValue で求める。
+struct Expr {
+  int val;
+  int sym;  // 足すラベル。無ければ -1
+  int sym2; // 引くラベル。無ければ -1
+  uint8_t part; // enum ExprPart
+};
+
+struct ExprParser {
+  struct nlpasm_ctx *ctx;
+  const struct Token *tok, *end;
+};
+
+static int IsConstExpr(const struct Expr *x) {
+  return x->sym < 0 && x->sym2 < 0;
+}
+
+static const struct Token *ExprToken(struct ExprParser *ps) {
+  if (ps->tok == ps->end) {
+    Error(ps->ctx, "incomplete expression after '%.*s'\n", ps->tok[-1].len, ps->tok[-1].raw);
+  }
+  return ps->tok++;
+}
+
+static struct Expr ParseExpr(struct ExprParser *ps, int min_prec);
+
+static struct Expr NegateExpr(struct nlpasm_ctx *ctx, const struct Token *op, struct Expr x) {
+  if (x.part != kPartAll) {
+    ErrorAt(ctx, op->raw, "hi()/lo() of a label cannot be used with '%.*s'\n", op->len, op->raw);
+  }
+  int sym = x.sym;
+  x.sym = x.sym2;
+  x.sym2 = sym;
+  x.val = -(unsigned)x.val;
+  return x;
+}
+
+// 足し算。ラベルは足す側・引く側にそれぞれ 1 つまで持てる。
+static struct Expr AddExpr(struct nlpasm_ctx *ctx, const struct Token *op, struct Expr a,
+                           struct Expr b) {
+  if (a.part != kPartAll || b.part != kPartAll) {
+    ErrorAt(ctx, op->raw, "hi()/lo() of a label cannot be used with '%.*s'\n", op->len, op->raw);
+  }
+  if ((a.sym >= 0 && b.sym >= 0) || (a.sym2 >= 0 && b.sym2 >= 0)) {
+    ErrorAt(ctx, op->raw, "too many labels in an expression at '%.*s'\n", op->len, op->raw);
+  }
+  a.val = (unsigned)a.val + (unsigned)b.val;
+  if (b.sym >= 0) {
+    a.sym = b.sym;
+  }
+  if (b.sym2 >= 0) {
+    a.sym2 = b.sym2;
+  }
+  if (a.sym >= 0 && a.sym == a.sym2) { // L - L
+    a.sym = a.sym2 = -1;
+  }
+  return a;
+}
+
+static struct Expr BinaryExpr(struct nlpasm_ctx *ctx, const struct Token *op, struct Expr a,
+                              struct Expr b) {
+  if (op->kind == '+') {
+    return AddExpr(ctx, op, a, b);
+  } else if (op->kind == '-') {
+    return AddExpr(ctx, op, a, NegateExpr(ctx, op, b));
+  }
+  if (!IsConstExpr(&a) || !IsConstExpr(&b)) {
+    ErrorAt(ctx, op->raw, "labels can only be added or subtracted: '%.*s'\n", op->len, op->raw);
+  }
+
+  unsigned x = a.val, y = b.val;
+  switch (op->kind) {
+  case '*':
+    a.val = x * y;
+    break;
+  case '/':
+  case '%':
+    if (b.val == 0) {
+      Error(ctx, "division by zero\n");
+    }
+    if (b.val == -1) { // INT_MIN / -1 を避ける
+      a.val = op->kind == '/' ? -x : 0;
+    } else {
+      a.val = op->kind == '/' ? a.val / b.val : a.val % b.val;
+    }
+    break;
+  case kTokenShl:
+  case kTokenShr:
+    if (b.val < 0 || b.val > 31) {
+      Error(ctx, "shift count out of range: %d\n", b.val);
+    }
+    a.val = op->kind == kTokenShl ? (int)(x << b.val) : a.val >> b.val;
+    break;
+  case '&':
+    a.val = x & y;
+    break;
+  case '^':
+    a.val = x ^ y;
+    break;
+  case '|':
+    a.val = x | y;
+    break;
+  }
+  return a;
+}
+
+// hi(式) と lo(式)
+static struct Expr PartExpr(struct ExprParser *ps, const struct Token *name, enum ExprPart part) {
+  ps->tok++; // (
+  struct Expr x = ParseExpr(ps, 0);
+  if (ps->tok == ps->end || ps->tok++->kind != ')') {
+    Error(ps->ctx, "missing ')' after '%.*s('\n", name->len, name->raw);
+  }
+  if (x.part != kPartAll) {
+    Error(ps->ctx, "hi()/lo() cannot be nested\n");
+  }
+  if (IsConstExpr(&x)) {
+    x.val = part == kPartHi ? (x.val >> 8) & 0xff : x.val & 0xff;
+  } else {
+    x.part = part;
+  }
+  return x;
+}
+
+static struct Expr ParseUnary(struct ExprParser *ps) {
+  struct nlpasm_ctx *ctx = ps->ctx;
+  const struct Token *t = ExprToken(ps);
+  struct Expr x = {0, -1, -1, kPartAll};
+  switch (t->kind) {
+  case kTokenInt:
+    x.val = t->val;
+    return x;
+  case '+':
+    return ParseUnary(ps);
+  case '-':
+    return NegateExpr(ctx, t, ParseUnary(ps));
+  case '~':
+    x = ParseUnary(ps);
+    if (!IsConstExpr(&x)) {
+      Error(ctx, "labels can only be added or subtracted: '~'\n");
+    }
+    x.val = ~x.val;
+    return x;
+  case '(':
+    x = ParseExpr(ps, 0);
+    if (ps->tok == ps->end || ps->tok++->kind != ')') {
+      Error(ctx, "missing ')'\n");
+    }
+    return x;
+  case kTokenLabel:
+    if (ps->tok < ps->end && ps->tok->kind == '(') {
+      if (TokenIs(t, "hi", 2)) {
+        return PartExpr(ps, t, kPartHi);
+      } else if (TokenIs(t, "lo", 2)) {
+        return PartExpr(ps, t, kPartLo);
+      }
+      ErrorAt(ctx, t->raw, "unknown function: '%.*s'\n", t->len, t->raw);
+    }
+    x.sym = InternSymbol(ctx, t->raw, t->len);
+    if (ctx->symbols[x.sym].constant && ctx->symbols[x.sym].ip >= 0) {
+      ctx->line_dep = 1; // 値が前の行の .equ/.set で決まる
+      x.val = ctx->symbols[x.sym].value;
+      x.sym = -1;
+    }
+    return x;
+  }
+  ErrorAt(ctx, t->raw, "unexpected token: '%.*s'\n", t->len, t->raw);
+}
+
+static int BinaryPrec(int kind) {
+  switch (kind) {
+  case '*': case '/': case '%':
+    return 5;
+  case '+': case '-':
+    return 4;
+  case kTokenShl: case kTokenShr:
+    return 3;
+  case '&':
+    return 2;
+  case '^':
+    return 1;
+  case '|':
+    return 0;
+  }
+  return -1;
+}
+
+// 優先順位が min_prec 以上の二項演算子だけを読む（優先順位法）
+static struct Expr ParseExpr(struct ExprParser *ps, int min_prec) {
+  struct Expr lhs = ParseUnary(ps);
+  while (ps->tok < ps->end && BinaryPrec(ps->tok->kind) >= min_prec) {
+    const struct Token *op = ps->tok++;
+    struct Expr rhs = ParseExpr(ps, BinaryPrec(op->kind) + 1);
+    lhs = BinaryExpr(ps->ctx, op, lhs, rhs);
+  }
+  return lhs;
+}
+
+// オペランドの start 番目のトークンから最後までを 1 つの式として読む
+static struct Expr ParseOperandExpr(struct nlpasm_ctx *ctx, const struct Operand *opr,
+                                    int start) {
+  struct ExprParser ps = {ctx, opr->tokens + start, opr->tokens + opr->len};
+  if (ps.tok >= ps.end) {
+    Error(ctx, "value must be specified\n");
+  }
+  struct Expr x = ParseExpr(&ps, 0);
+  if (ps.tok < ps.end) {
+    ErrorAt(ctx, ps.tok->raw, "unexpected token: '%.*s'\n", ps.tok->len, ps.tok->raw);
+  }
+  if (x.sym < 0 && x.sym2 >= 0) {
+    Error(ctx, "a label cannot be subtracted from a constant: '%s'\n",
+          ctx->symbols[x.sym2].name);
+  }
+  return x;
+}
+
+// 定義の時点で値が決まる式（ラベルを含まない式）の値を取得
+static int GetOperandConst(struct nlpasm_ctx *ctx, const char *mnemonic,
+                           const struct Operand *opr) {
+  struct Expr x = ParseOperandExpr(ctx, opr, 0);
+  if (!IsConstExpr(&x)) {
+    Error(ctx, "%s needs a constant expression: '%s' is not a defined constant\n",
+          mnemonic, ctx->symbols[x.sym].name);
+  }
+  return x.val;
+}
+
+// i 番目のオペランドを RegImm として取得
+static struct RegImm GetOperandRegImm(struct nlpasm_ctx *ctx, struct Operand *operand,
+                                      int start_token, uint8_t imm_slot) {
+  int token_idx = start_token;
+  const struct Token *value = operand->tokens + token_idx;
+  const struct Token *prefix = NULL;
+  if (value->kind == kTokenByte || value->kind == kTokenWord) {
+    prefix = value;
+    token_idx++;
+    value = operand->tokens + token_idx;
+  }
+
+  if (operand->len <= token_idx) {
+    Error(ctx, "value must be specified\n");
+  }
+
+  struct RegImm ri = {kReg, 0, -1, -1};
+  if (prefix == NULL && value->kind < 16 && operand->len == token_idx + 1) {
+    ri.val = value->kind;
+    return ri;
+  }
+
+  if (prefix) {
+    if (prefix->kind == kTokenWord) {
+      ri.kind = kImm16;
+    } else if (prefix->kind == kTokenByte) {
+      ri.kind = kImm8;
+    } else {
+      ErrorAt(ctx, prefix->raw, "unknown prefix: '%.*s'\n", prefix->len, prefix->raw);
+    }
+  }
+
+  if ((value->kind == kTokenRelLabel || value->kind == kTokenRelInt) &&
+      operand->len > token_idx + 1) {
+    const struct Token *tk = operand->tokens + token_idx + 1;
+    ErrorAt(ctx, tk->raw, "too many tokens: '%.*s'\n", tk->len, tk->raw);
+  }
+
+  if (value->kind == kTokenRelLabel) {
+    if (prefix == NULL) {
+      ri.kind = kImm8;
+    }
+    ri.sym = InternSymbol(ctx, value->raw, value->len);
+    ri.bp = AddBackpatch(ctx, ri.sym, BP_IP_REL + ri.kind, value->raw);
+    ctx->backpatches[ri.bp].relax = prefix == NULL;
+  } else if (value->kind == kTokenRelInt) {
+    ctx->line_dep = 1; // 差分と即値の大きさが現在の ip で決まる
+    if (imm_slot & kImm8) { // imm8 が使用されているので imm16 を使うしかなく、必ず 3 ワードになる
+      ri.val = value->val - ctx->ip - 3;
+      ri.kind = kImm16;
+    } else if (imm_slot & kImm16) { // imm16 が使用されているので必ず 3 ワードになる
+      ri.val = value->val - ctx->ip - 3;
+      ri.kind = kImm8;
+    } else if (prefix && prefix->kind == kImm16) { // imm16 が指定されているので必ず 3 ワードになる
+      ri.val = value->val - ctx->ip - 3;
+    } else { // imm8 も imm16 も未使用なので、どちらを使うか選択権がある
+      ri.val = value->val - ctx->ip - 2;
+      if (0 <= ri.val && ri.val < 256) {
+        if (prefix == NULL) {
+          ri.kind = kImm8;
+        }
+      } else { // imm8 では表せないので imm16 を使う
+        ri.val = value->val - ctx->ip - 3;
+        ri.kind = kImm16;
+      }
+    }
+    // 命令の伸長でアドレスがずれても正しい差分になるよう、最後に埋め直す
+    int sym = AddAddrSymbol(ctx, value->raw, value->len, value->val);
+    ri.bp = AddBackpatch(ctx, sym, BP_IP_REL + ri.kind, value->raw);
+    ctx->backpatches[ri.bp].relax = prefix == NULL;
+    ctx->backpatches[ri.bp].sign = 1;
+  } else {
+    struct Expr x = ParseOperandExpr(ctx, operand, token_idx);
+    if (IsConstExpr(&x)) { // 畳み込んだ値で即値の大きさを決める
+      ri.val = x.val;
+      if (0 <= x.val && x.val < 256) {
+        if (prefix == NULL) {
+          ri.kind = kImm8;
+        }
+      } else {
+        ri.kind = kImm16;
+      }
+    } else {
+      if (prefix == NULL) {
+        ri.kind = kImm8;
+      }
+      ri.sym = x.sym;
+      ri.bp = AddBackpatch(ctx, ri.sym, BP_ABS + ri.kind, value->raw);
+      struct Backpatch *bp = ctx->backpatches + ri.bp;
+      bp->relax = prefix == NULL;
+      bp->sym2 = x.sym2;
+      bp->addend = x.val;
+      bp->part = x.part;
+      if (x.sym2 >= 0 || x.val != 0 || x.part != kPartAll) {
+        ctx->line_dep = 1; // 行キャッシュはラベル 1 つの参照しか記録できない
+      }
+    }
+  }
+
+  if (prefix) {
+    if ((prefix->kind == kTokenByte && ri.kind != kImm8) ||
+        (prefix->kind == kTokenWord && ri.kind != kImm16)) {
+      ErrorAt(ctx, prefix->raw, "prefix conflicts with immediate size: '%.*s'\n",
+              prefix->len, prefix->raw);
+    }
+  }
+
+  return ri;
+}
+
+#define GET_OPR(i) GetOperand(ctx, e->name, l->operands, l->num_opr, (i))
+#define GET_REG(i) GetOperandReg(GET_OPR(i))
+#define GET_REGIMM(i, imm_slot) GetOperandRegImm(ctx, GET_OPR(i), 0, (imm_slot))
+
+// ri の値を imm_kind の即値欄に設定する。
+// shift は即値番号を書いた in のニブル位置。
+// ri がバックパッチを持つ場合は、実際に使った即値欄に合わせて種類を更新する。
+static void SetImm(struct nlpasm_ctx *ctx, struct Instruction *insn, enum RegImmKind imm_kind,
+                   struct RegImm *ri, int shift) {
+  if (imm_kind == kImm8) {
+    insn->imm8 = ri->val;
+  } else if (imm_kind == kImm16) {
+    insn->imm16 = ri->val;
+  }
+  if (ri->bp >= 0) {
+    struct Backpatch *bp = ctx->backpatches + ri->bp;
+    bp->type = (bp->type >= BP_IP_REL ? BP_IP_REL : BP_ABS) + imm_kind;
+    bp->shift = shift;
+  }
+}
+
+// 入力レジスタ番号を insn に設定する。
+// 入力が即値の場合は適切な即値番号（1 or 2）と即値を設定する。
+//
+// 戻り値
+// -1: 入力が両方とも 8 ビットで表せない大きな数値である
+// 2: 入力に byte リテラルが高々 1 つだけある
+// 3: 入力に word リテラルが含まれる
+static int SetInput(struct nlpasm_ctx *ctx, struct Instruction *insn, struct RegImm *in1,
+                    struct RegImm *in2) {
+  if (in2 == NULL) {
+    if (in1->kind == kReg) {
+      insn->in = in1->val << 4;
+      return 2;
+    } else {
+      insn->in = in1->kind << 4;
+      SetImm(ctx, insn, in1->kind, in1, 4);
+      return 1 + in1->kind;
+    }
+  }
+
+  if (in1->kind == kReg && in2->kind == kReg) {
+    insn->in = (in1->val << 4) | in2->val;
+    return 2;
+  } else if (in1->kind == kReg && in2->kind != kReg) {
+    insn->in = (in1->val << 4) | in2->kind;
+    SetImm(ctx, insn, in2->kind, in2, 0);
+    return 1 + in2->kind;
+  } else if (in1->kind != kReg && in2->kind == kReg) {
+    insn->in = (in1->kind << 4) | in2->val;
+    SetImm(ctx, insn, in1->kind, in1, 4);
+    return 1 + in1->kind;
+  } else { // in1, in2 両方が即値
+    if (in1->kind == kImm16 && in2->kind == kImm16) {
+      return -1;
+    }
+    if (in1->kind == kImm8) {
+      insn->in = (kImm8 << 4) | kImm16;
+      SetImm(ctx, insn, kImm8, in1, 4);
+      SetImm(ctx, insn, kImm16, in2, 0);
+    } else {
+      insn->in = (kImm16 << 4) | kImm8;
+      SetImm(ctx, insn, kImm16, in1, 4);
+      SetImm(ctx, insn, kImm8, in2, 0);
+    }
+    return 3;
+  }
+}
+
+// 前方ジャンプなら 1, 後方ジャンプなら 2 を返す。
+// 前方ジャンプであれば jump_to->val を符号反転する。
+static int CalcJumpDirForIPRelImm(struct nlpasm_ctx *ctx, struct RegImm *jump_to) {
+  int dir = 1;
+  if (jump_to->sym >= 0) {
+    ctx->line_dep = 1; // 方向がラベルの定義済み・未定義で決まる
+    if (ctx->symbols[jump_to->sym].ip < 0) { // 未定義なら前方参照
+      dir = 2;
+    }
+  } else if (jump_to->val >= 0) {
+    dir = 2;
+  } else {
+    jump_to->val = -jump_to->val;
+  }
+  return dir;
+}
+
+// ins->op の下位 4 ビットは、加算モードなら 2、減算モードなら 1
+// op_rel は IP 相対形式のときに op に OR する値。バックパッチに記録し、
+// サイズ調整で IP 相対形式へ変換するときや方向を決め直すときに使う。
+static int SetInputForBranch(struct nlpasm_ctx *ctx, struct Instruction *ins,
+                             struct Operand *addr, uint8_t op_rel) {
+  const struct Token *tokens = addr->tokens;
+  if (tokens[0].kind >= 16 && tokens[0].kind != kTokenByte && tokens[0].kind != kTokenWord &&
+      tokens[0].kind != kTokenRelInt && tokens[0].kind != kTokenRelLabel) { // 絶対アドレスの式
+    struct RegImm in = GetOperandRegImm(ctx, addr, 0, 0);
+    ins->op = 0x00;
+    if (in.bp >= 0) {
+      ctx->backpatches[in.bp].op_rel = op_rel;
+    }
+    return SetInput(ctx, ins, &in, NULL);
+  }
+  if (tokens[0].kind == kTokenByte || tokens[0].kind == kTokenWord ||
+      tokens[0].kind == kTokenRelInt || tokens[0].kind == kTokenRelLabel) {
+    struct RegImm in1 = {kReg, kRegIP, -1, -1};
+    struct RegImm in2 = GetOperandRegImm(ctx, addr, 0, 0);
+    int line_dep = ctx->line_dep;
+    ins->op = CalcJumpDirForIPRelImm(ctx, &in2);
+    if (in2.bp >= 0 && ctx->backpatches[in2.bp].type >= BP_IP_REL) {
+      ctx->backpatches[in2.bp].op_rel = op_rel;
+      ctx->backpatches[in2.bp].sign = 0;
+      ctx->line_dep = line_dep; // 方向は ResolveBackpatches で決め直すので依存しない
+    }
+    return SetInput(ctx, ins, &in1, &in2);
+  }
+  if (tokens[0].kind < 16) { // レジスタ加算
+    char op;
+    if (tokens[1].kind == '+' || tokens[1].kind == '-') {
+      op = tokens[1].kind;
+    } else {
+      ErrorAt(ctx, tokens[1].raw, "register-relative addressing needs +/-: '%.*s'\n",
+              tokens[1].len, tokens[1].raw);
+    }
+    struct RegImm in1 = {kReg, tokens[0].kind, -1, -1};
+    if (addr->len > 3 && tokens[2].kind != kTokenByte && tokens[2].kind != kTokenWord) {
+      // reg ± 式: 符号も含めて畳み込み、結果の符号で加算・減算モードを決める
+      struct Expr x = ParseOperandExpr(ctx, addr, 1);
+      if (!IsConstExpr(&x)) {
+        ErrorAt(ctx, tokens[2].raw,
+                "register-relative offset must be a constant expression: '%.*s'\n",
+                tokens[2].len, tokens[2].raw);
+      }
+      int v = x.val < 0 ? -x.val : x.val;
+      struct RegImm in2 = {v < 256 ? kImm8 : kImm16, v, -1, -1};
+      ins->op = x.val < 0 ? 1 : 2;
+      return SetInput(ctx, ins, &in1, &in2);
+    }
+    struct RegImm in2 = GetOperandRegImm(ctx, addr, 2, 0);
+    int dir = CalcJumpDirForIPRelImm(ctx, &in2);
+    if (in2.sym < 0 && op == '-') {
+      dir = 3 - dir;
+    }
+    ins->op = dir;
+    return SetInput(ctx, ins, &in1, &in2);
+  }
+
+  return -1;
+}
+
+static int ProcALUOp1In(struct nlpasm_ctx *ctx, struct Instruction *ins, uint8_t op, uint8_t flag,
+                 struct Operand *opr_out, struct Operand *opr_in) {
+  ins->op = op;
+  ins->out = (flag << 4) | GetOperandReg(opr_out);
+  struct RegImm in = GetOperandRegImm(ctx, opr_in, 0, 0);
+  return SetInput(ctx, ins, &in, NULL);
+}
+
+static int ProcALUOp2In(struct nlpasm_ctx *ctx, struct Instruction *ins, uint8_t op, uint8_t flag,
+                 struct Operand *opr_out, struct Operand *opr_in1,
+                 struct Operand *opr_in2) {
+  ins->op = op;
+  ins->out = (flag << 4) | GetOperandReg(opr_out);
+  struct RegImm in1 = GetOperandRegImm(ctx, opr_in1, 0, 0);
+  struct RegImm in2 = GetOperandRegImm(ctx, opr_in2, 0, in1.kind);
+  return SetInput(ctx, ins, &in1, &in2);
+}
+
+
+// 符号化中の行
+struct Line {
+  const char *src; // エラー表示用の元の行（入力バッファを指す）
+  int src_len;
+  uint8_t flag;
+  struct Operand *operands;
+  int num_opr;
+  const char *rest; // operands に入りきらなかったオペランド（.dw だけが使う）
+  const char *rest_end;
+};
+
+struct IsaEntry;
+
+// ins を符号化して命令のワード数を返す。
+// 命令を生成しない疑似命令は 0 を返す。
+typedef int (*Encoder)(struct nlpasm_ctx *ctx, const struct IsaEntry *e, struct Line *l,
+                       struct Instruction *ins);
+
+struct IsaEntry {
+  const char *name;
+  uint8_t op, op_rel; // op_rel は IP 相対（加減算モード）のときに op に OR する値
+  Encoder enc;
+};
+
+static int EncALU3(struct nlpasm_ctx *ctx, const struct IsaEntry *e, struct Line *l,
+                   struct Instruction *ins) {
+  int len = ProcALUOp2In(ctx, ins, e->op, l->flag, GET_OPR(0), GET_OPR(1), GET_OPR(2));
+  if (len == -1) {
+    Error(ctx, "both literals are imm16: %.*s\n", l->src_len, l->src);
+  }
+  return len;
+}
+
+static int EncALU2(struct nlpasm_ctx *ctx, const struct IsaEntry *e, struct Line *l,
+                   struct Instruction *ins) {
+  return ProcALUOp1In(ctx, ins, e->op, l->flag, GET_OPR(0), GET_OPR(1));
+}
+
+static int EncMov(struct nlpasm_ctx *ctx, const struct IsaEntry *e, struct Line *l,
+                  struct Instruction *ins) {
+  ins->op = e->op;
+  ins->out = (l->flag << 4) | GET_REG(0);
+  struct RegImm in = GET_REGIMM(1, 0);
+  return SetInput(ctx, ins, &in, NULL);
+}
+
+static int SetBranch(struct nlpasm_ctx *ctx, const struct IsaEntry *e, struct Line *l,
+                     struct Instruction *ins,
+              struct Operand *addr) {
+  int len = SetInputForBranch(ctx, ins, addr, e->op_rel);
+  if (len < 0) {
+    Error(ctx, "invalid %s instruction: %.*s\n", e->name, l->src_len, l->src);
+  }
+  ins->op |= (ins->op & 0x0f) ? e->op_rel : e->op;
+  return len;
+}
+
+static int EncJump(struct nlpasm_ctx *ctx, const struct IsaEntry *e, struct Line *l,
+                   struct Instruction *ins) {
+  int len = SetBranch(ctx, e, l, ins, GET_OPR(0));
+  ins->out = (l->flag << 4) | kRegIP;
+  return len;
+}
+
+static int EncLoad(struct nlpasm_ctx *ctx, const struct IsaEntry *e, struct Line *l,
+                   struct Instruction *ins) {
+  int len = SetBranch(ctx, e, l, ins, GET_OPR(1));
+  ins->out = (l->flag << 4) | GET_REG(0);
+  return len;
+}
+
+static int EncStore(struct nlpasm_ctx *ctx, const struct IsaEntry *e, struct Line *l,
+                    struct Instruction *ins) {
+  int len = SetBranch(ctx, e, l, ins, GET_OPR(0));
+  ins->out = (l->flag << 4) | GET_REG(1);
+  return len;
+}
+
+static int EncOut(struct nlpasm_ctx *ctx, const struct IsaEntry *e, struct Line *l,
+                  struct Instruction *ins) {
+  ins->op = e->op;
+  ins->out = (l->flag << 4) | GET_REG(0);
+  return 1;
+}
+
+static int EncCmp(struct nlpasm_ctx *ctx, const struct IsaEntry *e, struct Line *l,
+                  struct Instruction *ins) {
+  ins->op = e->op;
+  ins->out = (l->flag << 4) | kRegZR;
+  struct RegImm in1 = GET_REGIMM(0, 0);
+  struct RegImm in2 = GET_REGIMM(1, in1.kind);
+  return SetInput(ctx, ins, &in1, &in2);
+}
+
+static int EncRet(struct nlpasm_ctx *ctx, const struct IsaEntry *e, struct Line *l,
+                  struct Instruction *ins) {
+  (void)ctx;
+  ins->op = e->op;
+  ins->out = (l->flag << 4) | kRegIP;
+  return 1;
+}
+
+// .dw 値, ...
+// 値の数に制限は無い。operands に入りきらなかった分は l->rest から 1 つずつ読み、
+// 数値だけのオペランドは字句解析を省いて直接読む。
+static int EncDW(struct nlpasm_ctx *ctx, const struct IsaEntry *e, struct Line *l,
+                 struct Instruction *ins) {
+  (void)ins;
+  if (l->num_opr < 1) {
+    Error(ctx, "%s takes integers (words): %.*s\n", e->name, l->src_len, l->src);
+  }
+  uint16_t data[MAX_OPERAND];
+  for (int i = 0; i < l->num_opr; i++) {
+    data[i] = GetOperandConst(ctx, e->name, l->operands + i);
+  }
+  memcpy(EmitData(ctx, l->num_opr), data, l->num_opr * sizeof(uint16_t));
+
+  for (const char *p = l->rest; p && p < l->rest_end; ) {
+    const char *opr = p + 1;
+    p = memchr(opr, ',', l->rest_end - opr);
+    if (p == NULL) {
+      p = l->rest_end;
+    }
+    while (opr < p && strchr(" \t\r", *opr)) {
+      opr++;
+    }
+    const char *q = opr;
+    int v = isdigit(*opr) ? ParseInt(opr, p, &q) : 0;
+    while (q < p && strchr(" \t\r", *q)) {
+      q++;
+    }
+    if (q < p || opr == p) {
+      struct TokenMark mark = TokenMarkOf(&ctx->line_tokens);
+      struct Operand operand;
+      TokenizeOperand(ctx, &ctx->line_tokens, opr, p, &operand);
+      if (operand.len == 0) { // 空のオペランドは読み飛ばす
+        continue;
+      }
+      v = GetOperandConst(ctx, e->name, &operand);
+      TokenRelease(&ctx->line_tokens, mark);
+    }
+    *EmitData(ctx, 1) = v;
+  }
+  return 0;
+}
+
+// .fill 個数[, 値]
+static int EncFill(struct nlpasm_ctx *ctx, const struct IsaEntry *e, struct Line *l,
+                   struct Instruction *ins) {
+  (void)ins;
+  if (l->num_opr < 1 || 2 < l->num_opr) {
+    Error(ctx, "%s takes a count and an optional value: %.*s\n", e->name, l->src_len, l->src);
+  }
+  int count = GetOperandConst(ctx, e->name, l->operands);
+  uint16_t value = l->num_opr == 2 ? GetOperandConst(ctx, e->name, l->operands + 1) : 0;
+  if (count < 0 || count > 0x10000) {
+    Error(ctx, "%s takes a count from 0 to 65536: %d\n", e->name, count);
+  }
+  if (count > 0) {
+    uint16_t *w = EmitData(ctx, count);
+    for (int i = 0; i < count; i++) {
+      w[i] = value;
+    }
+  }
+  return 0;
+}
+
+// バイト列 b を 2 バイトずつ 1 ワードに詰めて w に書く。奇数なら最後のワードの残りは 0
+static void PackBytes(struct nlpasm_ctx *ctx, const uint8_t *b, size_t n, uint16_t *w) {
+  size_t i = 0;
+  if (ctx->little_endian) {
+    for (; i + 1 < n; i += 2) {
+      *w++ = b[i] | b[i + 1] << 8;
+    }
+  } else {
+    for (; i + 1 < n; i += 2) {
+      *w++ = b[i] << 8 | b[i + 1];
+    }
+  }
+  if (i < n) {
+    *w = ctx->little_endian ? b[i] : b[i] << 8;
+  }
+}
+
+static int HexDigit(char c) {
+  return isdigit(c) ? c - '0' : tolower(c) - 'a' + 10;
+}
+
+// 文字列リテラルのエスケープ（\n \t \r \0 \\ \" \' \xHH）を解いて buf に書き、バイト数を返す
+static int Unescape(struct nlpasm_ctx *ctx, const struct Token *t, uint8_t *buf) {
+  int n = 0;
+  for (const char *p = t->raw, *end = t->raw + t->len; p < end; p++) {
+    if (*p != '\\') {
+      buf[n++] = *p;
+      continue;
+    }
+    switch (*++p) {
+    case 'n': buf[n++] = '\n'; break;
+    case 't': buf[n++] = '\t'; break;
+    case 'r': buf[n++] = '\r'; break;
+    case '0': buf[n++] = '\0'; break;
+    case '\\': case '"': case '\'': buf[n++] = *p; break;
+    case 'x': {
+      if (p + 2 >= end || !isxdigit(p[1]) || !isxdigit(p[2])) {
+        Error(ctx, "\\x needs two hex digits in a string\n");
+      }
+      buf[n++] = HexDigit(p[1]) << 4 | HexDigit(p[2]);
+      p += 2;
+      break;
+    }
+    default:
+      Error(ctx, "unknown escape sequence in a string: '\\%c'\n", *p);
+    }
+  }
+  return n;
+}
+
+// .string "文字列", ...
+// 文字列ごとに末尾に 0 を付け、2 バイトずつ 1 ワードに詰める。
+static int EncString(struct nlpasm_ctx *ctx, const struct IsaEntry *e, struct Line *l,
+                     struct Instruction *ins) {
+  (void)ins;
+  if (l->num_opr < 1) {
+    Error(ctx, "%s takes strings in quotes: %.*s\n", e->name, l->src_len, l->src);
+  }
+  for (int i = 0; i < l->num_opr; i++) {
+    const struct Token *t = l->operands[i].tokens;
+    if (l->operands[i].len != 1 || t->kind != kTokenString) {
+      ErrorAt(ctx, t->raw, "%s takes strings in quotes: '%.*s'\n", e->name, t->len, t->raw);
+    }
+    RESERVE(ctx->str_buf, ctx->cap_str_buf, t->len + 1);
+    int n = Unescape(ctx, t, ctx->str_buf);
+    ctx->str_buf[n++] = '\0';
+    ctx->line_dep = 1; // 詰め方がバイト順の設定（-l）で変わる
+    PackBytes(ctx, ctx->str_buf, n, EmitData(ctx, (n + 1) / 2));
+  }
+  return 0;
+}
+
+
+static int EncOrigin(struct nlpasm_ctx *ctx, const struct IsaEntry *e, struct Line *l,
+                     struct Instruction *ins) {
+  (void)ins;
+  if (l->num_opr != 1) {
+    Error(ctx, "%s takes just one integer: %.*s\n", e->name, l->src_len, l->src);
+  }
+  int addr = GetOperandConst(ctx, e->name, l->operands);
+  if (addr < 0) {
+    Error(ctx, "%s takes a non-negative address: %d\n", e->name, addr);
+  }
+  EmitOrigin(ctx, addr);
+  return 0;
+}
+
+static int EncGlobal(struct nlpasm_ctx *ctx, const struct IsaEntry *e, struct Line *l,
+                     struct Instruction *ins) {
+  (void)ins;
+  if (l->num_opr < 1) {
+    Error(ctx, "%s takes label names: %.*s\n", e->name, l->src_len, l->src);
+  }
+  for (int i = 0; i < l->num_opr; i++) {
+    const struct Token *t = l->operands[i].tokens;
+    if (l->operands[i].len != 1 || t->kind != kTokenLabel) {
+      ErrorAt(ctx, t->raw, "%s takes label names: '%.*s'\n", e->name, t->len, t->raw);
+    }
+    int sym = InternSymbol(ctx, t->raw, t->len);
+    ctx->symbols[sym].global = 1;
+  }
+  ctx->line_dep = 1; // 行キャッシュには記録できない
+  return 0;
+}
+
+// .equ 名前, 式 / .set 名前, 式
+// 式は定義の時点で値が決まっていなければならない。.set は何度でも定義し直せる。
+static int EncEqu(struct nlpasm_ctx *ctx, const struct IsaEntry *e, struct Line *l,
+                  struct Instruction *ins) {
+  (void)ins;
+  const struct Token *t = l->operands[0].tokens;
+  if (l->num_opr != 2 || l->operands[0].len != 1 || t->kind != kTokenLabel) {
+    Error(ctx, "%s takes a name and a value: %.*s\n", e->name, l->src_len, l->src);
+  }
+  int value = GetOperandConst(ctx, e->name, l->operands + 1);
+  enum ConstKind kind = strcmp(e->name, ".set") == 0 ? kConstSet : kConstEqu;
+  int s = InternSymbol(ctx, t->raw, t->len);
+  struct Symbol *sym = ctx->symbols + s;
+  if (sym->ip >= 0 && !(kind == kConstSet && sym->constant == kConstSet)) {
+    ErrorAt(ctx, t->raw, "symbol redefined: '%.*s'\n", t->len, t->raw);
+  }
+  sym->constant = kind;
+  sym->value = value;
+  sym->ip = value & 0xffff; // 前方参照はバックパッチで 16 ビットの値として埋める
+  sym->insn_idx = -1;
+  ctx->line_dep = 1; // 行キャッシュには記録できない
+  return 0;
+}
+
+// 低位アドレスへのデータの配置
+//
+// .lowdata（.hot）から .text までを区間として覚えておき、nlpasm_finish で
+// 区間の中のデータをラベルごとのかたまりに分けてコードの後ろへ移す。
+// かたまりのアドレスは Relax の各反復で PlaceLowData が決め直す。
+
+struct LowRange {
+  int first, end; // 命令の添字の範囲
+};
+
+struct LowObj {
+  int origin;   // かたまりの前に置いた .origin の命令の添字
+  int len;      // ワード数
+  int sym;      // 先頭のラベル。無ければ -1
+  int refs;     // ラベルを imm8 で参照できる箇所の数
+  int home;     // ソースで直後にあったコードの命令の添字
+  int home_off; // 同じ区間の中で前にあるかたまりのワード数
+  int placed;   // 0〜255 に置けた
+};
+
+static void CloseLowData(struct nlpasm_ctx *ctx) {
+  if (ctx->low_start < ctx->num_insns) {
+    RESERVE(ctx->low_ranges, ctx->cap_low_ranges, ctx->num_low_ranges + 1);
+    ctx->low_ranges[ctx->num_low_ranges++] = (struct LowRange){ctx->low_start, ctx->num_insns};
+  }
+  ctx->low_start = -1;
+}
+
+// .lowdata / .hot: 以降のデータを低位アドレスへの配置の対象にする。.text で元に戻る。
+static int EncLowData(struct nlpasm_ctx *ctx, const struct IsaEntry *e, struct Line *l,
+                      struct Instruction *ins) {
+  (void)ins;
+  if (l->num_opr != 0) {
+    Error(ctx, "%s takes no operands: %.*s\n", e->name, l->src_len, l->src);
+  }
+  if (strcmp(e->name, ".text") == 0) {
+    if (ctx->low_start >= 0) {
+      CloseLowData(ctx);
+    }
+  } else if (ctx->low_start < 0) {
+    ctx->low_start = ctx->num_insns;
+  }
+  ctx->data_break = ctx->num_insns;
+  ctx->line_dep = 1; // 行キャッシュには記録できない
+  return 0;
+}
+
+// マクロと繰り返し
+//
+// .macro と .rept の本体は、記録するときに 1 度だけ行を分割・字句解析して
+// トークン列として持っておく。展開では、パラメータのトークンを実引数の
+// トークン列に置き換えたものを、字句解析をせずに符号化へ直接渡す。
+// 本体の中で定義したラベルはローカルラベルで、展開（.rept なら 1 回の繰り返し）
+// ごとに「名前@通し番号」という別のシンボルになる。
+
+enum { kRecMacro = 1, kRecRept };
+
+#define MAX_MACRO_PARAMS 16
+#define MAX_EXPAND_DEPTH 64
+
+// 記録した本体の 1 行。src とトークンは文字列プール内を指す。
+struct BodyLine {
+  const char *src;
+  int src_len;
+  struct SrcLine sl;
+  int opr;     // オペランドの先頭（body_oprs の添字）
+  int num_opr; // ニーモニックが無ければ -1
+};
+
+struct Macro {
+  const char *name;
+  int name_len;
+  struct Token params[MAX_MACRO_PARAMS];
+  int num_params;
+  int first, num_lines; // 本体（body_lines の範囲）
+};
+
+// 展開中の本体。入れ子の .rept やマクロの中のマクロ呼び出しは outer でつながる。
+struct Scope {
+  const struct Scope *outer;
+  const struct Macro *macro;   // マクロの展開なら、そのマクロ（.rept なら NULL）
+  const struct Operand *args;  // マクロの実引数
+  const struct Token *locals;  // 本体で定義しているラベル
+  const char **local_names;    // その、この展開での名前
+  int num_locals;
+};
+
+static void AssembleParsed(struct nlpasm_ctx *ctx, const char *line, int line_len,
+                           struct SrcLine *sl, struct Operand *operands, int num_opr);
+static const struct IsaEntry *LookupMnemonic(const char *name, int n);
+
+static int MnemonicIs(const struct SrcLine *sl, const char *name) {
+  int n = strlen(name);
+  return sl->mnemonic && sl->mnemonic_len == n && strncasecmp(sl->mnemonic, name, n) == 0;
+}
+
+// 空白を除いたラベル名
+static struct Token LabelToken(const struct SrcLine *sl) {
+  struct Token t = {kTokenLabel, sl->label, sl->label_len, 0};
+  while (t.len > 0 && strchr(" \t", *t.raw)) {
+    t.raw++;
+    t.len--;
+  }
+  while (t.len > 0 && strchr(" \t", t.raw[t.len - 1])) {
+    t.len--;
+  }
+  return t;
+}
+
+static const struct Macro *FindMacro(struct nlpasm_ctx *ctx, const char *name, int len) {
+  for (int i = 0; i < ctx->num_macros; i++) {
+    const struct Macro *m = ctx->macros + i;
+    if (m->name_len == len && strncasecmp(m->name, name, len) == 0) {
+      return m;
+    }
+  }
+  return NULL;
+}
+
+static int EncMacro(struct nlpasm_ctx *ctx, const struct IsaEntry *e, struct Line *l,
+                    struct Instruction *ins) {
+  (void)ins;
+  if (l->num_opr < 1 || l->operands[0].tokens[0].kind != kTokenLabel) {
+    Error(ctx, "%s takes a name and parameters: %.*s\n", e->name, l->src_len, l->src);
+  }
+  const struct Token *name = l->operands[0].tokens;
+  if (LookupMnemonic(name->raw, name->len) || FindMacro(ctx, name->raw, name->len)) {
+    ErrorAt(ctx, name->raw, "macro name already in use: '%.*s'\n", name->len, name->raw);
+  }
+  RESERVE(ctx->macros, ctx->cap_macros, ctx->num_macros + 1);
+  struct Macro *m = ctx->macros + ctx->num_macros;
+  m->name = StrPoolAdd(ctx, name->raw, name->len);
+  m->name_len = name->len;
+  m->num_params = 0;
+  // パラメータはカンマでも空白でも区切れる
+  for (int i = 0; i < l->num_opr; i++) {
+    for (int j = i == 0; j < l->operands[i].len; j++) {
+      const struct Token *t = l->operands[i].tokens + j;
+      if (t->kind != kTokenLabel) {
+        ErrorAt(ctx, t->raw, "macro parameter must be a name (not a register): '%.*s'\n",
+                t->len, t->raw);
+      }
+      if (m->num_params == MAX_MACRO_PARAMS) {
+        Error(ctx, "too many macro parameters (max %d)\n", MAX_MACRO_PARAMS);
+      }
+      m->params[m->num_params] = *t;
+      m->params[m->num_params].raw = StrPoolAdd(ctx, t->raw, t->len);
+      m->num_params++;
+    }
+  }
+  ctx->num_macros++;
+  ctx->recording = kRecMacro;
+  ctx->rec_depth = 0;
+  ctx->rec_first = ctx->num_body_lines;
+  ctx->rec_tokens = TokenMarkOf(&ctx->body_tokens);
+  ctx->line_dep = 1;
+  return 0;
+}
+
+static int EncRept(struct nlpasm_ctx *ctx, const struct IsaEntry *e, struct Line *l,
+                   struct Instruction *ins) {
+  (void)ins;
+  if (l->num_opr != 1) {
+    Error(ctx, "%s takes a repeat count: %.*s\n", e->name, l->src_len, l->src);
+  }
+  ctx->rec_count = GetOperandConst(ctx, e->name, l->operands);
+  ctx->recording = kRecRept;
+  ctx->rec_depth = 0;
+  ctx->rec_first = ctx->num_body_lines;
+  ctx->rec_tokens = TokenMarkOf(&ctx->body_tokens);
+  ctx->line_dep = 1;
+  return 0;
+}
+
+static int EncEnd(struct nlpasm_ctx *ctx, const struct IsaEntry *e, struct Line *l,
+                  struct Instruction *ins) {
+  (void)l;
+  (void)ins;
+  Error(ctx, "'%s' without '%s'\n", e->name, strcmp(e->name, ".endm") == 0 ? ".macro" : ".rept");
+}
+
+// 展開する本体の中で定義しているラベルを集め、この展開での名前を付ける
+static void EnterScope(struct nlpasm_ctx *ctx, struct Scope *sc, int first, int num_lines) {
+  sc->num_locals = 0;
+  sc->locals = NULL;
+  sc->local_names = NULL;
+  struct Token *locals = NULL;
+  for (int i = first; i < first + num_lines; i++) {
+    if (ctx->body_lines[i].sl.label) {
+      locals = XRealloc(locals, sizeof(struct Token) * (sc->num_locals + 1));
+      locals[sc->num_locals++] = LabelToken(&ctx->body_lines[i].sl);
+    }
+  }
+  sc->locals = locals;
+  sc->local_names = XRealloc(NULL, sizeof(char *) * (sc->num_locals ? sc->num_locals : 1));
+}
+
+// 新しい展開の通し番号でローカルラベルの名前を作り直す
+static void RenameLocals(struct nlpasm_ctx *ctx, struct Scope *sc) {
+  int id = ++ctx->expansions;
+  for (int i = 0; i < sc->num_locals; i++) {
+    char buf[32];
+    int n = snprintf(buf, sizeof(buf), "@%d", id);
+    int len = sc->locals[i].len;
+    char *name = XRealloc(NULL, len + n);
+    memcpy(name, sc->locals[i].raw, len);
+    memcpy(name + len, buf, n);
+    sc->local_names[i] = StrPoolAdd(ctx, name, len + n);
+    free(name);
+  }
+}
+
+static void LeaveScope(struct Scope *sc) {
+  free((void *)sc->locals);
+  free(sc->local_names);
+}
+
+// 名前 t を展開の中で解決する。
+// パラメータなら *arg に実引数を、ローカルラベルなら *local に新しい名前を入れて 1 を返す。
+static int ResolveName(const struct Scope *sc, const struct Token *t,
+                       const struct Operand **arg, const char **local) {
+  for (; sc; sc = sc->outer) {
+    for (int i = 0; i < sc->num_locals; i++) {
+      if (TokenIs(t, sc->locals[i].raw, sc->locals[i].len)) {
+        *arg = NULL;
+        *local = sc->local_names[i];
+        return 1;
+      }
+    }
+    for (int i = 0; sc->macro && i < sc->macro->num_params; i++) {
+      if (TokenIs(t, sc->macro->params[i].raw, sc->macro->params[i].len)) {
+        *arg = sc->args + i;
+        *local = NULL;
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+// 本体のオペランド src のパラメータとローカルラベルを置き換えて dest に書く
+static void SubstOperand(struct nlpasm_ctx *ctx, const struct Scope *sc,
+                         const struct Operand *src, struct Operand *dest) {
+  BeginOperand(&ctx->line_tokens, dest);
+  for (int i = 0; i < src->len; i++) {
+    const struct Token *t = src->tokens + i;
+    const struct Operand *arg;
+    const char *local;
+    if ((t->kind != kTokenLabel && t->kind != kTokenRelLabel) || !ResolveName(sc, t, &arg, &local)) {
+      arg = NULL;
+      local = NULL;
+    }
+    if (local) {
+      InitToken(AddToken(&ctx->line_tokens, dest), t->kind, local, strlen(local), 0);
+    } else if (arg && t->kind == kTokenRelLabel) { // @param: 実引数は 1 つのラベルか数値
+      const struct Token *a = arg->tokens;
+      if (arg->len != 1 || (a->kind != kTokenLabel && a->kind != kTokenInt)) {
+        ErrorAt(ctx, t->raw, "'@%.*s' needs a label or an integer argument\n", t->len, t->raw);
+      }
+      InitToken(AddToken(&ctx->line_tokens, dest),
+                a->kind == kTokenLabel ? kTokenRelLabel : kTokenRelInt, a->raw, a->len, a->val);
+    } else if (arg) {
+      for (int j = 0; j < arg->len; j++) {
+        *AddToken(&ctx->line_tokens, dest) = arg->tokens[j];
+      }
+    } else {
+      *AddToken(&ctx->line_tokens, dest) = *t;
+    }
+  }
+}
+
+static void ReplayBody(struct nlpasm_ctx *ctx, const struct Scope *sc, int first, int num_lines);
+
+// 本体の範囲 [first, first + num_lines) を count 回展開する
+static void ExpandRept(struct nlpasm_ctx *ctx, const struct Scope *outer, int count, int first,
+                       int num_lines) {
+  if (++ctx->expand_depth > MAX_EXPAND_DEPTH) {
+    Error(ctx, "macro expansion nested too deeply\n");
+  }
+  struct Scope sc = {outer, NULL, NULL, NULL, NULL, 0};
+  EnterScope(ctx, &sc, first, num_lines);
+  for (int i = 0; i < count; i++) {
+    RenameLocals(ctx, &sc);
+    ReplayBody(ctx, &sc, first, num_lines);
+  }
+  LeaveScope(&sc);
+  ctx->expand_depth--;
+}
+
+// マクロを展開する。実引数は呼び出し側の展開で置き換え済みなので、外側の展開は見ない。
+static void ExpandMacro(struct nlpasm_ctx *ctx, const struct Macro *m,
+                        const struct Operand *args, int num_args) {
+  if (num_args != m->num_params) {
+    Error(ctx, "macro '%.*s' takes %d argument%s, got %d\n", m->name_len, m->name,
+          m->num_params, m->num_params == 1 ? "" : "s", num_args);
+  }
+  if (++ctx->expand_depth > MAX_EXPAND_DEPTH) {
+    Error(ctx, "macro expansion nested too deeply\n");
+  }
+  struct Scope sc = {NULL, m, args, NULL, NULL, 0};
+  EnterScope(ctx, &sc, m->first, m->num_lines);
+  RenameLocals(ctx, &sc);
+  ReplayBody(ctx, &sc, m->first, m->num_lines);
+  LeaveScope(&sc);
+  ctx->expand_depth--;
+}
+
+static void ReplayBody(struct nlpasm_ctx *ctx, const struct Scope *sc, int first, int num_lines) {
+  for (int i = first; i < first + num_lines; i++) {
+    struct BodyLine bl = ctx->body_lines[i]; // 展開中に配列が伸びても影響しないよう複製する
+    struct TokenMark mark = TokenMarkOf(&ctx->line_tokens); // 置き換えたトークンは行ごとに捨てる
+    struct Operand operands[MAX_OPERAND];
+    for (int j = 0; j < bl.num_opr; j++) {
+      SubstOperand(ctx, sc, ctx->body_oprs + bl.opr + j, operands + j);
+    }
+
+    if (MnemonicIs(&bl.sl, ".rept")) { // 対応する .endr までを繰り返す
+      int depth = 0, end = i + 1;
+      for (; end < first + num_lines; end++) {
+        const struct SrcLine *e = &ctx->body_lines[end].sl;
+        if (MnemonicIs(e, ".rept") || MnemonicIs(e, ".macro")) {
+          depth++;
+        } else if ((MnemonicIs(e, ".endr") || MnemonicIs(e, ".endm")) && depth-- == 0) {
+          break;
+        }
+      }
+      if (bl.num_opr != 1) {
+        Error(ctx, ".rept takes a repeat count: %.*s\n", bl.src_len, bl.src);
+      }
+      int count = GetOperandConst(ctx, ".rept", operands);
+      if (bl.sl.label) {
+        struct Token t = LabelToken(&bl.sl);
+        const struct Operand *arg;
+        const char *local = NULL;
+        ResolveName(sc, &t, &arg, &local);
+        DefineLabel(ctx, local ? local : t.raw, local ? (int)strlen(local) : t.len);
+      }
+      ExpandRept(ctx, sc, count, i + 1, end - i - 1);
+      TokenRelease(&ctx->line_tokens, mark);
+      i = end;
+      continue;
+    }
+    if (MnemonicIs(&bl.sl, ".macro")) {
+      Error(ctx, "macros cannot be defined inside .macro or .rept\n");
+    }
+
+    // ラベルもパラメータ・ローカルラベルなら置き換える
+    struct SrcLine sl = bl.sl;
+    if (sl.label) {
+      struct Token t = LabelToken(&sl);
+      const struct Operand *arg;
+      const char *local;
+      if (ResolveName(sc, &t, &arg, &local)) {
+        if (arg && (arg->len != 1 || arg->tokens[0].kind != kTokenLabel)) {
+          ErrorAt(ctx, t.raw, "label parameter '%.*s' needs a name argument\n", t.len, t.raw);
+        }
+        sl.label = local ? local : arg->tokens[0].raw;
+        sl.label_len = local ? (int)strlen(local) : arg->tokens[0].len;
+      }
+    }
+    AssembleParsed(ctx, bl.src, bl.src_len, &sl, operands, bl.num_opr);
+    TokenRelease(&ctx->line_tokens, mark);
+  }
+}
+
+// .macro/.rept の記録中に 1 行を受け取る。対応する .endm/.endr で記録を終え、
+// .rept ならその場で展開する。
+static void RecordBodyLine(struct nlpasm_ctx *ctx, const char *line, int line_len) {
+  const char *src = StrPoolAdd(ctx, line, line_len);
+  RESERVE(ctx->body_oprs, ctx->cap_body_oprs, ctx->num_body_oprs + MAX_OPERAND);
+  struct BodyLine bl = {src, line_len, {0}, ctx->num_body_oprs, 0};
+  bl.num_opr = SplitOpcode(ctx, &ctx->body_tokens, src, src + line_len, &bl.sl,
+                           ctx->body_oprs + bl.opr, MAX_OPERAND);
+  if (bl.sl.rest && ctx->recording == kRecMacro) { // 残りのオペランドはパラメータを置き換えられない
+    Error(ctx, "more than %d operands in a .macro body line\n", MAX_OPERAND);
+  }
+
+  int is_end = MnemonicIs(&bl.sl, ".endm") || MnemonicIs(&bl.sl, ".endr");
+  if (MnemonicIs(&bl.sl, ".macro") || MnemonicIs(&bl.sl, ".rept")) {
+    ctx->rec_depth++;
+  } else if (is_end && ctx->rec_depth > 0) {
+    ctx->rec_depth--;
+  } else if (is_end) {
+    int want_macro = ctx->recording == kRecMacro;
+    if (MnemonicIs(&bl.sl, ".endm") != want_macro) {
+      Error(ctx, "'%.*s' closes a %s\n", bl.sl.mnemonic_len, bl.sl.mnemonic,
+            want_macro ? ".macro (use .endm)" : ".rept (use .endr)");
+    }
+    if (bl.sl.label) {
+      ErrorAt(ctx, bl.sl.mnemonic, "label not allowed on '%.*s'\n",
+              bl.sl.mnemonic_len, bl.sl.mnemonic);
+    }
+    int first = ctx->rec_first;
+    int num_lines = ctx->num_body_lines - first;
+    ctx->recording = 0;
+    ctx->line_dep = 1;
+    if (want_macro) {
+      ctx->macros[ctx->num_macros - 1].first = first;
+      ctx->macros[ctx->num_macros - 1].num_lines = num_lines;
+    } else { // 最上位の .rept の本体は展開したら要らない
+      ExpandRept(ctx, NULL, ctx->rec_count, first, num_lines);
+      if (num_lines > 0) {
+        ctx->num_body_oprs = ctx->body_lines[first].opr;
+      }
+      ctx->num_body_lines = first;
+      TokenRelease(&ctx->body_tokens, ctx->rec_tokens);
+    }
+    return;
+  }
+
+  if (bl.num_opr > 0) {
+    ctx->num_body_oprs += bl.num_opr;
+  }
+  RESERVE(ctx->body_lines, ctx->cap_body_lines, ctx->num_body_lines + 1);
+  ctx->body_lines[ctx->num_body_lines++] = bl;
+}
+
+// .include
+//
+// 取り込むファイルは行に分割・字句解析した結果を、内容のハッシュで引けるキャッシュに
+// 持っておく。キャッシュの内容は一度作ったら変更しないので、ロックはキャッシュを
+// 引くときと登録するときだけで済む。
+
+// 取り込んだファイル（インクルードガード用）
+struct Included {
+  dev_t dev;
+  ino_t ino;
+  const char *path; // 文字列プール内の名前
+  int binary;       // .incbin で読んだもの（インクルードガードの対象にしない）
+};
+
+struct IncludeLine {
+  const char *src; // text 内の行
+  int src_len;
+  int line;    // ファイル内の行番号（1 始まり）
+  struct SrcLine sl;
+  int tok;     // 最初のオペランドの先頭トークン（tokens の添字）
+  int opr;     // 最初のオペランドのトークン数（opr_len の添字）
+  int num_opr; // ニーモニックが無ければ -1
+};
+
+// 字句解析済みのファイル。トークンは text を指す。
+struct IncludeText {
+  uint64_t hash;
+  char *text;
+  size_t len;
+  struct IncludeLine *lines;
+  int num_lines, cap_lines;
+  struct Token *tokens;
+  int num_tokens, cap_tokens;
+  int *opr_len;
+  int num_oprs, cap_oprs;
+  int errors; // 字句解析でエラーになった行の数。あれば共有のキャッシュには入れない
+  struct IncludeText *next;
+};
+
+// 取り込んだファイルと、そのときの内容の字句解析結果。
+// 大きさと更新時刻が同じなら、ファイルを読み直さずに it を使う。
+struct IncludeFile {
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  struct timespec mtime, ctime;
+  struct IncludeText *it;
+};
+
+struct nlpasm_include_cache {
+  pthread_mutex_t lock;
+  struct IncludeText *texts;
+  struct IncludeFile *files;
+  int num_files, cap_files;
+};
+
+static void FreeIncludeText(struct IncludeText *it) {
+  free(it->text);
+  free(it->lines);
+  free(it->tokens);
+  free(it->opr_len);
+  free(it);
+}
+
+struct nlpasm_include_cache *nlpasm_include_cache_new(void) {
+  struct nlpasm_include_cache *cache = XRealloc(NULL, sizeof(*cache));
+  memset(cache, 0, sizeof(*cache));
+  pthread_mutex_init(&cache->lock, NULL);
+  return cache;
+}
+
+void nlpasm_include_cache_free(struct nlpasm_include_cache *cache) {
+  if (cache == NULL) {
+    return;
+  }
+  while (cache->texts) {
+    struct IncludeText *next = cache->texts->next;
+    FreeIncludeText(cache->texts);
+    cache->texts = next;
+  }
+  free(cache->files);
+  pthread_mutex_destroy(&cache->lock);
+  free(cache);
+}
+
+void nlpasm_include_cache_trim(struct nlpasm_include_cache *cache) {
+  pthread_mutex_lock(&cache->lock);
+  for (struct IncludeText **p = &cache->texts; *p; ) {
+    int used = 0;
+    for (int i = 0; i < cache->num_files && !used; i++) {
+      used = cache->files[i].it == *p;
+    }
+    if (used) {
+      p = &(*p)->next;
+    } else {
+      struct IncludeText *next = (*p)->next;
+      FreeIncludeText(*p);
+      *p = next;
+    }
+  }
+  pthread_mutex_unlock(&cache->lock);
+}
+
+void nlpasm_set_include_cache(struct nlpasm_ctx *ctx, struct nlpasm_include_cache *cache) {
+  if (ctx->own_include_cache) {
+    nlpasm_include_cache_free(ctx->include_cache);
+  }
+  ctx->include_cache = cache;
+  ctx->own_include_cache = 0;
+}
+
+void nlpasm_set_source_name(struct nlpasm_ctx *ctx, const char *path) {
+  ctx->source_name = path ? StrPoolAdd(ctx, path, strlen(path)) : NULL;
+  ctx->include_from = ctx->source_name;
+}
+
+void nlpasm_add_include_dir(struct nlpasm_ctx *ctx, const char *dir) {
+  RESERVE(ctx->include_dirs, ctx->cap_include_dirs, ctx->num_include_dirs + 1);
+  ctx->include_dirs[ctx->num_include_dirs++] = StrPoolAdd(ctx, dir, strlen(dir));
+}
+
+const char *const *nlpasm_get_includes(struct nlpasm_ctx *ctx, size_t *num_includes) {
+  free(ctx->include_names);
+  ctx->include_names = XRealloc(NULL, sizeof(char *) * (ctx->num_included ? ctx->num_included : 1));
+  for (int i = 0; i < ctx->num_included; i++) {
+    ctx->include_names[i] = ctx->included[i].path;
+  }
+  *num_includes = ctx->num_included;
+  return ctx->include_names;
+}
+
+// dir（長さ dir_len、0 ならカレントディレクトリ）の下の name を開く
+static int OpenIn(struct nlpasm_ctx *ctx, const char *dir, int dir_len, const char *name,
+                  int len, const char **path) {
+  char *buf = XRealloc(NULL, dir_len + len + 2);
+  int n = dir_len ? sprintf(buf, "%.*s/%.*s", dir_len, dir, len, name)
+                  : sprintf(buf, "%.*s", len, name);
+  int fd = open(buf, O_RDONLY);
+  if (fd >= 0) {
+    *path = StrPoolAdd(ctx, buf, n);
+  }
+  free(buf);
+  return fd;
+}
+
+// .include のファイルを探して開く。*path に見つけた名前を入れる。
+// 戻り値: ファイル記述子。見つからなければ -1
+static int OpenInclude(struct nlpasm_ctx *ctx, const char *name, int len, const char **path) {
+  if (name[0] == '/') {
+    return OpenIn(ctx, NULL, 0, name, len, path);
+  }
+  const char *from = ctx->include_from;
+  const char *slash = from ? strrchr(from, '/') : NULL;
+  int fd = OpenIn(ctx, from, slash ? slash - from : 0, name, len, path);
+  for (int i = 0; fd < 0 && i < ctx->num_include_dirs; i++) {
+    fd = OpenIn(ctx, ctx->include_dirs[i], strlen(ctx->include_dirs[i]), name, len, path);
+  }
+  return fd;
+}
+
+static uint64_t HashText(const char *s, size_t len) {
+  uint64_t h = 14695981039346656037u; // FNV-1a (64 ビット)
+  for (size_t i = 0; i < len; i++) {
+    h = (h ^ (uint8_t)s[i]) * 1099511628211u;
+  }
+  return h;
+}
+
+// [p, eol) を字句解析して it に加える
+static void ParseIncludeLine(struct nlpasm_ctx *ctx, struct IncludeText *it, const char *p,
+                             const char *eol, int line) {
+  struct IncludeLine il = {p, eol - p, line, {0}, it->num_tokens, it->num_oprs, 0};
+  struct Operand operands[MAX_OPERAND];
+  struct TokenMark mark = TokenMarkOf(&ctx->line_tokens); // it に写したら要らない
+  il.num_opr = SplitOpcode(ctx, &ctx->line_tokens, p, eol, &il.sl, operands, MAX_OPERAND);
+  if (il.num_opr < 0 && il.sl.label == NULL) { // 空行とコメントは持たない
+    TokenRelease(&ctx->line_tokens, mark);
+    return;
+  }
+  for (int i = 0; i < il.num_opr; i++) {
+    RESERVE(it->tokens, it->cap_tokens, it->num_tokens + operands[i].len);
+    memcpy(it->tokens + it->num_tokens, operands[i].tokens,
+           sizeof(struct Token) * operands[i].len);
+    it->num_tokens += operands[i].len;
+    RESERVE(it->opr_len, it->cap_oprs, it->num_oprs + 1);
+    it->opr_len[it->num_oprs++] = operands[i].len;
+  }
+  RESERVE(it->lines, it->cap_lines, it->num_lines + 1);
+  it->lines[it->num_lines++] = il;
+  TokenRelease(&ctx->line_tokens, mark);
+}
+
+// text を行に分割して字句解析する。text の所有権は戻り値に移る。
+// エラーになった行は持たずに次の行へ進む。エラーの上限に達したら text も解放してから
+// Error の戻り先へ抜ける。
+static struct IncludeText *ParseIncludeText(struct nlpasm_ctx *ctx, char *text, size_t len,
+                                            uint64_t hash) {
+  struct IncludeText *it = XRealloc(NULL, sizeof(*it));
+  memset(it, 0, sizeof(*it));
+  it->hash = hash;
+  it->text = text;
+  it->len = len;
+
+  jmp_buf env, *outer = ctx->err_jmp;
+  ctx->err_jmp = &env;
+  int line = 0;
+  for (const char *p = text, *end = text + len; p < end; ) {
+    const char *eol = memchr(p, '\n', end - p);
+    if (eol == NULL) {
+      eol = end;
+    }
+    ctx->loc_line = ++line;
+    ctx->loc_text = p;
+    ctx->loc_end = eol;
+    if (setjmp(env) == 0) {
+      ParseIncludeLine(ctx, it, p, eol, line);
+    } else if (ctx->failed) {
+      ctx->err_jmp = outer;
+      FreeIncludeText(it);
+      longjmp(*outer, 1);
+    } else {
+      it->errors++;
+    }
+    p = eol + 1;
+  }
+  ctx->err_jmp = outer;
+  return it;
+}
+
+static struct IncludeText *FindIncludeText(struct nlpasm_include_cache *cache, uint64_t hash,
+                                           const char *text, size_t len) {
+  struct IncludeText *it = cache->texts;
+  while (it && (it->hash != hash || it->len != len || memcmp(it->text, text, len) != 0)) {
+    it = it->next;
+  }
+  return it;
+}
+
+// 内容が text と同じ字句解析済みのファイルを返す。キャッシュに無ければ作って登録する。
+// text の所有権はこの関数に移る。
+static const struct IncludeText *LookupIncludeText(struct nlpasm_ctx *ctx, char *text,
+                                                   size_t len) {
+  if (ctx->include_cache == NULL) {
+    ctx->include_cache = nlpasm_include_cache_new();
+    ctx->own_include_cache = 1;
+  }
+  struct nlpasm_include_cache *cache = ctx->include_cache;
+  uint64_t hash = HashText(text, len);
+  pthread_mutex_lock(&cache->lock);
+  struct IncludeText *it = FindIncludeText(cache, hash, text, len);
+  pthread_mutex_unlock(&cache->lock);
+  if (it) {
+    free(text);
+    ctx->stats.include_hits++;
+    return it;
+  }
+
+  // 字句解析はロックの外で行う。その間に他のスレッドが同じ内容を登録していたらそちらを使う。
+  struct IncludeText *parsed = ParseIncludeText(ctx, text, len, hash);
+  if (parsed->errors) { // 次に取り込むときにもエラーを報告できるよう、このコンテキストだけで使う
+    parsed->next = ctx->error_texts;
+    ctx->error_texts = parsed;
+    return parsed;
+  }
+  pthread_mutex_lock(&cache->lock);
+  it = FindIncludeText(cache, hash, parsed->text, len);
+  if (it == NULL) {
+    parsed->next = cache->texts;
+    cache->texts = parsed;
+    it = parsed;
+    parsed = NULL;
+  }
+  pthread_mutex_unlock(&cache->lock);
+  if (parsed) {
+    FreeIncludeText(parsed);
+  }
+  return it;
+}
+
+static int SameFileVersion(const struct IncludeFile *f, const struct stat *st) {
+  return f->size == st->st_size &&
+         f->mtime.tv_sec == st->st_mtim.tv_sec && f->mtime.tv_nsec == st->st_mtim.tv_nsec &&
+         f->ctime.tv_sec == st->st_ctim.tv_sec && f->ctime.tv_nsec == st->st_ctim.tv_nsec;
+}
+
+// st のファイルを前に字句解析していて、それから変わっていなければその結果を返す
+static const struct IncludeText *FindIncludeFile(struct nlpasm_ctx *ctx, const struct stat *st) {
+  struct nlpasm_include_cache *cache = ctx->include_cache;
+  if (cache == NULL || !S_ISREG(st->st_mode)) {
+    return NULL;
+  }
+  const struct IncludeText *it = NULL;
+  pthread_mutex_lock(&cache->lock);
+  for (int i = 0; i < cache->num_files; i++) {
+    const struct IncludeFile *f = cache->files + i;
+    if (f->dev == st->st_dev && f->ino == st->st_ino) {
+      it = SameFileVersion(f, st) ? f->it : NULL;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&cache->lock);
+  return it;
+}
+
+// st のファイルの字句解析結果として it を覚える
+static void RememberIncludeFile(struct nlpasm_ctx *ctx, const struct stat *st,
+                                const struct IncludeText *it) {
+  struct nlpasm_include_cache *cache = ctx->include_cache;
+  if (!S_ISREG(st->st_mode) || it->errors) { // エラーのあったものは共有のキャッシュに無い
+    return;
+  }
+  pthread_mutex_lock(&cache->lock);
+  int i = 0;
+  while (i < cache->num_files &&
+         (cache->files[i].dev != st->st_dev || cache->files[i].ino != st->st_ino)) {
+    i++;
+  }
+  if (i == cache->num_files) {
+    RESERVE(cache->files, cache->cap_files, cache->num_files + 1);
+    cache->num_files++;
+  }
+  cache->files[i] = (struct IncludeFile){
+    .dev = st->st_dev,
+    .ino = st->st_ino,
+    .size = st->st_size,
+    .mtime = st->st_mtim,
+    .ctime = st->st_ctim,
+    .it = (struct IncludeText *)it,
+  };
+  pthread_mutex_unlock(&cache->lock);
+}
+
+// fd の内容をすべて読む。fd は閉じる。
+static char *ReadIncludeFile(struct nlpasm_ctx *ctx, int fd, const struct stat *st,
+                             const char *path, size_t *len) {
+  size_t n = 0, cap = S_ISREG(st->st_mode) ? (size_t)st->st_size + 1 : 4096;
+  char *text = XRealloc(NULL, cap);
+  for (;;) {
+    if (n == cap) {
+      cap *= 2;
+      text = XRealloc(text, cap);
+    }
+    ssize_t r = read(fd, text + n, cap - n);
+    if (r < 0) {
+      free(text);
+      close(fd);
+      Error(ctx, "cannot read include file: '%s'\n", path);
+    } else if (r == 0) {
+      break;
+    }
+    n += r;
+  }
+  close(fd);
+  *len = n;
+  return text;
+}
+
+// 字句解析済みのファイルの 1 行を符号化する
+static void ReplayIncludeLine(struct nlpasm_ctx *ctx, const struct IncludeText *it,
+                              const struct IncludeLine *il) {
+  if (ctx->recording) { // .macro/.rept の本体
+    RecordBodyLine(ctx, il->src, il->src_len);
+    return;
+  }
+  struct Operand operands[MAX_OPERAND]; // トークンは it のものをそのまま指す
+  const struct Token *t = it->tokens + il->tok;
+  for (int j = 0; j < il->num_opr; j++) {
+    operands[j].len = it->opr_len[il->opr + j];
+    operands[j].tokens = t;
+    t += operands[j].len;
+  }
+  struct SrcLine sl = il->sl;
+  AssembleParsed(ctx, il->src, il->src_len, &sl, operands, il->num_opr);
+}
+
+// 字句解析済みのファイルの行を順に符号化する。エラーになった行は取り消して次の行へ進む。
+static void ReplayIncludeText(struct nlpasm_ctx *ctx, const struct IncludeText *it) {
+  jmp_buf env, *outer = ctx->err_jmp;
+  ctx->err_jmp = &env;
+  struct LineState ls;
+  for (int i = 0; i < it->num_lines; i++) {
+    const struct IncludeLine *il = it->lines + i;
+    ctx->loc_line = il->line;
+    ctx->loc_text = il->src;
+    ctx->loc_end = il->src + il->src_len;
+    SaveLineState(ctx, &ls);
+    if (setjmp(env) == 0) {
+      ReplayIncludeLine(ctx, it, il);
+    } else {
+      RestoreLineState(ctx, &ls);
+      if (ctx->failed) {
+        ctx->err_jmp = outer;
+        longjmp(*outer, 1);
+      }
+    }
+  }
+  ctx->err_jmp = outer;
+}
+
+static int EncInclude(struct nlpasm_ctx *ctx, const struct IsaEntry *e, struct Line *l,
+                      struct Instruction *ins) {
+  (void)ins;
+  const struct Token *t = l->operands[0].tokens;
+  if (l->num_opr != 1 || l->operands[0].len != 1 || t->kind != kTokenString || t->len == 0) {
+    Error(ctx, "%s takes a file name in quotes: %.*s\n", e->name, l->src_len, l->src);
+  }
+  ctx->line_dep = 1; // 取り込むファイルの内容は行キャッシュでは分からない
+
+  const char *path;
+  int fd = OpenInclude(ctx, t->raw, t->len, &path);
+  if (fd < 0) {
+    ErrorAt(ctx, t->raw, "cannot open include file: '%.*s'\n", t->len, t->raw);
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    close(fd);
+    Error(ctx, "cannot read include file: '%s'\n", path);
+  }
+  for (int i = 0; i < ctx->num_included; i++) {
+    if (!ctx->included[i].binary && ctx->included[i].dev == st.st_dev &&
+        ctx->included[i].ino == st.st_ino) {
+      close(fd);
+      return 0;
+    }
+  }
+
+  // 前に読んだときから変わっていなければ読み直さない（--serve やバッチモードで効く）
+  const struct IncludeText *it = FindIncludeFile(ctx, &st);
+  char *text = NULL;
+  size_t len = 0;
+  if (it) {
+    close(fd);
+    ctx->stats.include_hits++;
+  } else {
+    text = ReadIncludeFile(ctx, fd, &st, path, &len);
+  }
+
+  RESERVE(ctx->included, ctx->cap_included, ctx->num_included + 1);
+  struct Included *inc = ctx->included + ctx->num_included++;
+  inc->dev = st.st_dev;
+  inc->ino = st.st_ino;
+  inc->path = path;
+  inc->binary = 0;
+  ctx->stats.includes++;
+
+  // エラーの場所は取り込んだファイルの中を指す（戻り先の nlpasm_assemble_line で元に戻る）
+  const char *from = ctx->include_from;
+  const char *loc_file = ctx->loc_file, *loc_text = ctx->loc_text, *loc_end = ctx->loc_end;
+  int loc_line = ctx->loc_line;
+  ctx->include_from = path;
+  ctx->loc_file = path;
+  if (it == NULL) {
+    it = LookupIncludeText(ctx, text, len);
+    RememberIncludeFile(ctx, &st, it);
+  }
+  ReplayIncludeText(ctx, it);
+  ctx->include_from = from;
+  ctx->loc_file = loc_file;
+  ctx->loc_line = loc_line;
+  ctx->loc_text = loc_text;
+  ctx->loc_end = loc_end;
+  return 0;
+}
+
+// .incbin "ファイル名"[, 先頭から飛ばすバイト数[, バイト数]]
+// ファイルは .include と同じ順に探し、2 バイトずつ 1 ワードに詰めてデータとして置く。
+// 通常のファイルはメモリマップしてワード列へ直接変換し、行単位の処理を通さない。
+static int EncIncbin(struct nlpasm_ctx *ctx, const struct IsaEntry *e, struct Line *l,
+                     struct Instruction *ins) {
+  (void)ins;
+  const struct Token *t = l->operands[0].tokens;
+  if (l->num_opr < 1 || 3 < l->num_opr || l->operands[0].len != 1 ||
+      t->kind != kTokenString || t->len == 0) {
+    Error(ctx, "%s takes a file name in quotes, an offset and a length: %.*s\n",
+          e->name, l->src_len, l->src);
+  }
+  long skip = l->num_opr >= 2 ? GetOperandConst(ctx, e->name, l->operands + 1) : 0;
+  long want = l->num_opr >= 3 ? GetOperandConst(ctx, e->name, l->operands + 2) : -1;
+  ctx->line_dep = 1; // ファイルの内容は行キャッシュでは分からない
+
+  const char *path;
+  int fd = OpenInclude(ctx, t->raw, t->len, &path);
+  if (fd < 0) {
+    ErrorAt(ctx, t->raw, "cannot open binary file: '%.*s'\n", t->len, t->raw);
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    close(fd);
+    Error(ctx, "cannot read binary file: '%s'\n", path);
+  }
+
+  // メモリマップできないもの（パイプや空のファイル）は読み込む
+  uint8_t *buf = NULL;
+  size_t len = 0;
+  void *map = S_ISREG(st.st_mode) && st.st_size > 0
+                  ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+  if (map != MAP_FAILED) {
+    len = st.st_size;
+    madvise(map, len, MADV_SEQUENTIAL);
+  } else {
+    size_t cap = 4096;
+    buf = XRealloc(NULL, cap);
+    ssize_t n;
+    while ((n = read(fd, buf + len, cap - len)) > 0) {
+      len += n;
+      if (len == cap) {
+        cap *= 2;
+        buf = XRealloc(buf, cap);
+      }
+    }
+    if (n < 0) {
+      free(buf);
+      close(fd);
+      Error(ctx, "cannot read binary file: '%s'\n", path);
+    }
+  }
+  close(fd);
+  const uint8_t *bytes = map != MAP_FAILED ? map : buf;
+
+  if (skip < 0 || (size_t)skip > len || want < -1 || (want >= 0 && (size_t)want > len - skip)) {
+    if (map != MAP_FAILED) {
+      munmap(map, st.st_size);
+    }
+    free(buf);
+    Error(ctx, "%s: offset %ld and length %ld are outside '%s' (%zu bytes)\n",
+          e->name, skip, want, path, len);
+  }
+  size_t n = want >= 0 ? (size_t)want : len - skip;
+  if ((n + 1) / 2 > 0x10000) {
+    if (map != MAP_FAILED) {
+      munmap(map, st.st_size);
+    }
+    free(buf);
+    Error(ctx, "%s: '%s' does not fit in the address space (%zu bytes)\n", e->name, path, n);
+  }
+  if (n > 0) {
+    PackBytes(ctx, bytes + skip, n, EmitData(ctx, (n + 1) / 2));
+  }
+  if (map != MAP_FAILED) {
+    munmap(map, st.st_size);
+  }
+  free(buf);
+
+  for (int i = 0; i < ctx->num_included; i++) { // 依存ファイルには 1 度だけ並べる
+    if (ctx->included[i].dev == st.st_dev && ctx->included[i].ino == st.st_ino) {
+      return 0;
+    }
+  }
+  RESERVE(ctx->included, ctx->cap_included, ctx->num_included + 1);
+  struct Included *inc = ctx->included + ctx->num_included++;
+  inc->dev = st.st_dev;
+  inc->ino = st.st_ino;
+  inc->path = path;
+  inc->binary = 1;
+  return 0;
+}
+
+void nlpasm_set_little_endian(struct nlpasm_ctx *ctx, int little_endian) {
+  ctx->little_endian = little_endian;
+}
+
+static const struct IsaEntry isa[] = {
+#define MNEMONIC(name, op, op_rel, enc) {name, op, op_rel, enc},
+#include "isa.def"
+};
+
+static const struct IsaEntry *LookupMnemonic(const char *name, int n) {
+  int i = mnemonic_hash_slots[IsaHash(name, n, MNEMONIC_HASH_SEED) & (MNEMONIC_HASH_SIZE - 1)];
+  if (i >= 0 && strncasecmp(isa[i].name, name, n) == 0 && isa[i].name[n] == '\0') {
+    return isa + i;
+  }
+  return NULL;
+}
+
+// 命令とラベルのアドレスを命令長から計算し直す
+static void Layout(struct nlpasm_ctx *ctx) {
+  int addr = ORIGIN;
+  for (int i = 0; i < ctx->num_insns; i++) {
+    if (ctx->insns[i].len == 0) { // .origin
+      addr = ctx->insns[i].ip;
+    } else {
+      ctx->insns[i].ip = addr;
+      addr += ctx->insns[i].len;
+    }
+  }
+  for (int s = 0; s < ctx->num_symbols; s++) {
+    int idx = ctx->symbols[s].insn_idx;
+    if (idx > 0) {
+      ctx->symbols[s].ip = ctx->insns[idx - 1].ip + ctx->insns[idx - 1].len;
+    } else if (idx == 0) {
+      ctx->symbols[s].ip = ORIGIN;
+    }
+  }
+}
+
+// バックパッチ先の即値を imm8 から imm16 に伸長する（2 ワード → 3 ワード）
+// 追加のワードは RebuildWords で挿入する。
+static void GrowImm(struct nlpasm_ctx *ctx, struct Backpatch *bp) {
+  uint16_t *w = ctx->words + ctx->insns[bp->insn_idx].pos;
+  w[1] = (w[1] & ~(0xfu << (8 + bp->shift)) & 0xff00u) | (kImm16 << (8 + bp->shift));
+  ctx->insns[bp->insn_idx].len = 3;
+  bp->type++; // BP_ABS8 -> BP_ABS16, BP_IP_REL8 -> BP_IP_REL16
+}
+
+// 絶対アドレスへの分岐を IP 相対形式に変換する（長さは 2 ワードのまま）
+// op の方向ビットは ResolveBackpatches で決める。
+static void ConvertToIPRel(struct nlpasm_ctx *ctx, struct Backpatch *bp) {
+  uint16_t *w = ctx->words + ctx->insns[bp->insn_idx].pos;
+  w[0] = (bp->op_rel << 8) | (w[0] & 0xffu);
+  w[1] = ((kRegIP << 4) | kImm8) << 8;
+  bp->type = BP_IP_REL8;
+  bp->shift = 0;
+}
+
+// バックパッチの参照先のシンボルがすべて定義済みか。未定義なら最初の未定義シンボルを返す。
+static const struct Symbol *UndefinedSymbol(struct nlpasm_ctx *ctx, const struct Backpatch *bp) {
+  if (ctx->symbols[bp->sym].ip < 0) {
+    return ctx->symbols + bp->sym;
+  } else if (bp->sym2 >= 0 && ctx->symbols[bp->sym2].ip < 0) {
+    return ctx->symbols + bp->sym2;
+  }
+  return NULL;
+}
+
+// 現在のレイアウトでのバックパッチの値（絶対アドレスまたは式の値）
+static int BackpatchValue(struct nlpasm_ctx *ctx, const struct Backpatch *bp) {
+  int v = ctx->symbols[bp->sym].ip + bp->addend;
+  if (bp->sym2 >= 0) {
+    v -= ctx->symbols[bp->sym2].ip;
+  }
+  if (bp->part == kPartHi) {
+    v = (v >> 8) & 0xff;
+  } else if (bp->part == kPartLo) {
+    v &= 0xff;
+  }
+  return v;
+}
+
+static int FitsImm8(struct Backpatch *bp, int v) {
+  if (bp->type == BP_IP_REL8 && !bp->sign && v < 0) {
+    v = -v;
+  }
+  return 0 <= v && v < 256;
+}
+
+// 伸長した命令に imm16 のワードを挿入し、words を詰め直す
+static void RebuildWords(struct nlpasm_ctx *ctx) {
+  int n = 0;
+  for (int i = 0; i < ctx->num_insns; i++) {
+    n += ctx->insns[i].len;
+  }
+  if (n == ctx->num_words) {
+    return;
+  }
+
+  uint16_t *new_words = XRealloc(NULL, n * sizeof(uint16_t));
+  int pos = 0;
+  for (int i = 0; i < ctx->num_insns; i++) {
+    int old_end = i + 1 < ctx->num_insns ? ctx->insns[i + 1].pos : ctx->num_words;
+    int old_len = old_end - ctx->insns[i].pos;
+    memcpy(new_words + pos, ctx->words + ctx->insns[i].pos, old_len * sizeof(uint16_t));
+    if (ctx->insns[i].len > old_len) {
+      new_words[pos + old_len] = 0;
+    }
+    ctx->insns[i].pos = pos;
+    pos += ctx->insns[i].len;
+  }
+  free(ctx->words);
+  ctx->words = new_words;
+  ctx->num_words = ctx->cap_words = n;
+}
+
+// 低位アドレスへ置くと 1 ワード減る参照か（サイズプレフィクスの無い、ラベル 1 つの絶対参照）
+static int IsLowDataRef(const struct Backpatch *bp) {
+  return bp->relax && bp->type == BP_ABS8 && bp->sym2 < 0 && bp->part == kPartAll;
+}
+
+// .lowdata の区間をラベルごとのかたまりに分け、コードの後ろへ移す。
+// かたまりの前にはそれぞれ .origin を置き、そのアドレスを PlaceLowData で決める。
+static void SplitLowData(struct nlpasm_ctx *ctx) {
+  int n = ctx->num_insns;
+  for (int r = 0; r < ctx->num_low_ranges; r++) {
+    for (int i = ctx->low_ranges[r].first; i < ctx->low_ranges[r].end; i++) {
+      if (ctx->insns[i].len == 0 || !ctx->insns[i].data) {
+        ctx->loc_line = ctx->insns[i].line;
+        Error(ctx, "only data can be placed in .lowdata\n");
+      }
+    }
+  }
+
+  // mark: 0 ならコード、-1 なら区間の中、正ならかたまりの先頭（番号 + 1）
+  int *mark = XRealloc(NULL, (n + 1) * sizeof(int));
+  memset(mark, 0, (n + 1) * sizeof(int));
+  for (int r = 0; r < ctx->num_low_ranges; r++) {
+    for (int i = ctx->low_ranges[r].first; i < ctx->low_ranges[r].end; i++) {
+      mark[i] = i == ctx->low_ranges[r].first ? 1 : -1;
+    }
+  }
+  for (int s = 0; s < ctx->num_symbols; s++) {
+    int idx = ctx->symbols[s].insn_idx;
+    if (idx >= 0 && mark[idx] != 0) {
+      mark[idx] = 1;
+    }
+  }
+  int num_objs = 0;
+  for (int i = 0; i < n; i++) {
+    if (mark[i] > 0) {
+      mark[i] = ++num_objs;
+    }
+  }
+  struct LowObj *objs = XRealloc(NULL, num_objs * sizeof(struct LowObj));
+  memset(objs, 0, num_objs * sizeof(struct LowObj));
+  for (int o = 0; o < num_objs; o++) {
+    objs[o].sym = -1;
+  }
+  for (int s = 0; s < ctx->num_symbols; s++) {
+    int idx = ctx->symbols[s].insn_idx;
+    if (idx >= 0 && mark[idx] > 0) {
+      struct LowObj *obj = objs + mark[idx] - 1;
+      if (obj->sym < 0 || (ctx->symbols[obj->sym].anon && !ctx->symbols[s].anon)) {
+        obj->sym = s;
+      }
+    }
+  }
+  for (int i = 0; i < ctx->num_backpatches; i++) {
+    const struct Backpatch *bp = ctx->backpatches + i;
+    int idx = ctx->symbols[bp->sym].insn_idx;
+    if (IsLowDataRef(bp) && idx >= 0 && mark[idx] > 0) {
+      objs[mark[idx] - 1].refs++;
+    }
+  }
+
+  // コード、続いて .origin とかたまりの順に並べ直す
+  int m = n + num_objs;
+  struct nlpasm_insn *insns = XRealloc(NULL, m * sizeof(struct nlpasm_insn));
+  uint16_t *words = XRealloc(NULL, (ctx->num_words ? ctx->num_words : 1) * sizeof(uint16_t));
+  int *new_idx = XRealloc(NULL, (n + 1) * sizeof(int));
+  int k = 0, pos = 0;
+  for (int i = 0; i < n; i++) {
+    if (mark[i] == 0) {
+      new_idx[i] = k;
+      insns[k] = ctx->insns[i];
+      memcpy(words + pos, ctx->words + ctx->insns[i].pos, insns[k].len * sizeof(uint16_t));
+      insns[k].pos = pos;
+      pos += insns[k++].len;
+    }
+  }
+  new_idx[n] = k;
+  int code = 0, o = -1;
+  for (int i = 0; i < n; i++) {
+    if (mark[i] == 0) {
+      code++;
+      continue;
+    }
+    if (mark[i] > 0) {
+      struct LowObj *prev = o >= 0 ? objs + o : NULL;
+      o = mark[i] - 1;
+      objs[o].origin = k;
+      objs[o].home = code;
+      objs[o].home_off = i > 0 && mark[i - 1] != 0 ? prev->home_off + prev->len : 0;
+      insns[k] = (struct nlpasm_insn){.ip = 0, .pos = pos, .len = 0, .line = ctx->insns[i].line};
+      k++;
+    }
+    new_idx[i] = k;
+    insns[k] = ctx->insns[i];
+    memcpy(words + pos, ctx->words + ctx->insns[i].pos, insns[k].len * sizeof(uint16_t));
+    insns[k].pos = pos;
+    pos += insns[k++].len;
+    objs[o].len += ctx->insns[i].len;
+  }
+  for (int s = 0; s < ctx->num_symbols; s++) {
+    if (ctx->symbols[s].insn_idx >= 0) {
+      ctx->symbols[s].insn_idx = new_idx[ctx->symbols[s].insn_idx];
+    }
+  }
+  for (int i = 0; i < ctx->num_backpatches; i++) {
+    ctx->backpatches[i].insn_idx = new_idx[ctx->backpatches[i].insn_idx];
+  }
+  free(mark);
+  free(new_idx);
+  free(ctx->insns);
+  free(ctx->words);
+  ctx->insns = insns;
+  ctx->num_insns = ctx->cap_insns = m;
+  ctx->words = words;
+  ctx->cap_words = ctx->num_words ? ctx->num_words : 1;
+  ctx->low_objs = objs;
+  ctx->num_low_objs = num_objs;
+
+  // 参照の多い順（同じならワード数の少ない順、ソースの順）に置く
+  ctx->low_order = XRealloc(NULL, num_objs * sizeof(int));
+  for (int i = 0; i < num_objs; i++) {
+    int j = i;
+    for (; j > 0; j--) {
+      const struct LowObj *a = objs + ctx->low_order[j - 1], *b = objs + i;
+      if (a->refs > b->refs || (a->refs == b->refs && a->len <= b->len)) {
+        break;
+      }
+      ctx->low_order[j] = ctx->low_order[j - 1];
+    }
+    ctx->low_order[j] = i;
+  }
+}
+
+// Layout の結果をもとに、かたまりのアドレス（前に置いた .origin）を決める。
+// 0〜255 の空きに先頭から詰め、置けないものと参照の無いものはすべての末尾に並べる。
+static void PlaceLowData(struct nlpasm_ctx *ctx) {
+  uint8_t used[256] = {0};
+  int code = ctx->low_objs[0].origin;
+  int tail = ORIGIN;
+  for (int i = 0; i < code; i++) {
+    const struct nlpasm_insn *info = ctx->insns + i;
+    for (int a = info->ip; a < info->ip + info->len && a < 256; a++) {
+      used[a] = 1;
+    }
+    if (info->len > 0 && info->ip + info->len > tail) {
+      tail = info->ip + info->len;
+    }
+  }
+
+  for (int i = 0; i < ctx->num_low_objs; i++) {
+    struct LowObj *obj = ctx->low_objs + ctx->low_order[i];
+    obj->placed = 0;
+    if (obj->refs == 0) {
+      continue;
+    }
+    int run = 0, a = 0;
+    for (; a < 256 && run < obj->len; a++) {
+      run = used[a] ? 0 : run + 1;
+    }
+    if (run < obj->len) {
+      continue;
+    }
+    int addr = a - obj->len;
+    memset(used + addr, 1, obj->len);
+    obj->placed = 1;
+    ctx->insns[obj->origin].ip = addr;
+    if (a > tail) {
+      tail = a;
+    }
+  }
+  for (int o = 0; o < ctx->num_low_objs; o++) {
+    struct LowObj *obj = ctx->low_objs + o;
+    if (!obj->placed) {
+      ctx->insns[obj->origin].ip = tail;
+      tail += obj->len;
+    }
+  }
+}
+
+// nlpasm_get_lowdata が返す配置の結果と、減ったワード数をまとめる
+static void ReportLowData(struct nlpasm_ctx *ctx) {
+  ctx->lowdata = XRealloc(NULL, ctx->num_low_objs * sizeof(struct nlpasm_lowdata));
+  for (int o = 0; o < ctx->num_low_objs; o++) {
+    const struct LowObj *obj = ctx->low_objs + o;
+    struct nlpasm_lowdata *ld = ctx->lowdata + o;
+    ld->symbol = obj->sym >= 0 ? ctx->symbols[obj->sym].name : NULL;
+    ld->line = ctx->insns[obj->origin].line;
+    ld->addr = ctx->insns[obj->origin].ip;
+    ld->len = obj->len;
+    ld->refs = obj->refs;
+    ld->placed = obj->placed;
+    ld->words_saved = 0;
+  }
+
+  // ソースに書いた位置（直後のコードの手前）に置いた場合に imm8 に収まらない参照を数える
+  for (int i = 0; i < ctx->num_backpatches; i++) {
+    const struct Backpatch *bp = ctx->backpatches + i;
+    int idx = ctx->symbols[bp->sym].insn_idx;
+    if (!IsLowDataRef(bp) || idx <= 0 || ctx->insns[idx - 1].len != 0) {
+      continue;
+    }
+    int lo = 0, hi = ctx->num_low_objs;
+    while (lo < hi) { // かたまりは .origin の添字の順に並んでいる
+      int mid = (lo + hi) / 2;
+      if (ctx->low_objs[mid].origin < idx - 1) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    const struct LowObj *obj = ctx->low_objs + lo;
+    if (lo == ctx->num_low_objs || obj->origin != idx - 1 || !obj->placed) {
+      continue;
+    }
+    const struct nlpasm_insn *prev = obj->home > 0 ? ctx->insns + obj->home - 1 : NULL;
+    int home = (prev ? prev->ip + prev->len : ORIGIN) + obj->home_off;
+    if (home >= 256) {
+      ctx->lowdata[lo].words_saved++;
+      ctx->stats.lowdata_saved++;
+    }
+  }
+}
+
+// サイズプレフィクスの無いラベル参照を最短（2 ワード）から始め、
+// 収まらないものだけを伸長してアドレスが動かなくなるまで繰り返す。
+// 絶対アドレスへの分岐は、IP 相対なら imm8 に収まる場合は IP 相対形式にする。
+static void Relax(struct nlpasm_ctx *ctx) {
+  int changed;
+  do {
+    changed = 0;
+    ctx->stats.relax_passes++;
+    Layout(ctx);
+    if (ctx->num_low_objs) {
+      PlaceLowData(ctx);
+      Layout(ctx);
+    }
+    for (int i = 0; i < ctx->num_backpatches; i++) {
+      struct Backpatch *bp = ctx->backpatches + i;
+      if (!bp->relax || (bp->type != BP_ABS8 && bp->type != BP_IP_REL8)) {
+        continue;
+      }
+      struct nlpasm_insn *info = ctx->insns + bp->insn_idx;
+      if (UndefinedSymbol(ctx, bp)) { // 未定義ラベルは ResolveBackpatches でエラーにする
+        continue;
+      }
+
+      int target = BackpatchValue(ctx, bp);
+      int ip_diff = target - (info->ip + info->len);
+      if (bp->type == BP_ABS8) {
+        if (0 <= target && target < 256) {
+          continue;
+        }
+        if (bp->op_rel && info->len == 2 && -256 < ip_diff && ip_diff < 256) {
+          ConvertToIPRel(ctx, bp);
+          continue;
+        }
+      } else if (FitsImm8(bp, ip_diff)) {
+        continue;
+      }
+
+      if (info->len == 2) {
+        GrowImm(ctx, bp);
+        changed = 1;
+      }
+    }
+  } while (changed);
+
+  RebuildWords(ctx);
+}
+
+static uint64_t NowNs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+// エラーから回復する設定なら、埋められないバックパッチをすべて報告する
+static void ResolveBackpatches(struct nlpasm_ctx *ctx) {
+  for (int i = 0; i < ctx->num_backpatches; i++) {
+    ctx->loc_line = ctx->insns[ctx->backpatches[i].insn_idx].line;
+    ctx->loc_col = ctx->backpatches[i].col;
+    const struct Symbol *sym = UndefinedSymbol(ctx, ctx->backpatches + i);
+    if (sym) {
+      RecoverableError(ctx, "unknown label: %s\n", sym->name);
+      continue;
+    }
+    sym = ctx->symbols + ctx->backpatches[i].sym;
+    int target = BackpatchValue(ctx, ctx->backpatches + i);
+
+    struct nlpasm_insn *target_insn = ctx->insns + ctx->backpatches[i].insn_idx;
+    uint16_t *target_words = ctx->words + target_insn->pos;
+    switch (ctx->backpatches[i].type) {
+    case BP_ABS8:
+      if (target < 0 || target >= 256) {
+        RecoverableError(ctx, "label cannot be fit in imm8: '%s' -> %d\n", sym->name, target);
+        break;
+      }
+      target_words[1] = (target_words[1] & 0xff00u) | target;
+      break;
+    case BP_ABS16:
+      target_words[2] = target;
+      break;
+    case BP_IP_REL8:
+    case BP_IP_REL16: {
+      int ip_base = target_insn->ip + target_insn->len;
+      int ip_diff = target - ip_base;
+      if (ctx->backpatches[i].op_rel) { // 分岐命令は差分の符号で加算・減算モードを決める
+        uint8_t op = ctx->backpatches[i].op_rel | (ip_diff < 0 ? 1 : 2);
+        target_words[0] = (op << 8) | (target_words[0] & 0xffu);
+      }
+      if (ip_diff < 0 && !ctx->backpatches[i].sign) {
+        ip_diff = -ip_diff;
+      }
+      if (ctx->backpatches[i].type == BP_IP_REL16) {
+        target_words[2] = ip_diff;
+      } else if (ip_diff < 0 || ip_diff >= 256) {
+        RecoverableError(ctx, "ip-diff cannot be fit in imm8: abs('%s' - %d) -> %d\n",
+                         sym->name, ip_base, ip_diff);
+      } else {
+        target_words[1] = (target_words[1] & 0xff00u) | ip_diff;
+      }
+      break;
+    }
+    default:
+      Error(ctx, "unknown relocation type: %d\n", ctx->backpatches[i].type);
+    }
+  }
+  ctx->loc_col = 0;
+}
+
+// のぞき穴最適化
+// 命令サイズを決める前（Relax の前）の命令列を、より短い・速い等価な形に書き換える。
+// ラベル参照を含む命令の即値はまだ決まっていないので、バックパッチを持つ命令は
+// call を jmp にする書き換え以外では触らない。
+#define OP_MOV  0x00
+#define OP_SUB  0x11
+#define OP_ADD  0x12
+#define OP_DEC  0x18
+#define OP_INC  0x1b
+#define OP_CALL 0xb0
+#define OP_RET  0xc0
+#define FLAG_ALWAYS 1 // 条件なしで実行するときのフラグ欄
+
+static void AddRewrite(struct nlpasm_ctx *ctx, int insn, enum nlpasm_rewrite_kind kind,
+                       int value, int words_saved) {
+  RESERVE(ctx->rewrites, ctx->cap_rewrites, ctx->num_rewrites + 1);
+  struct nlpasm_rewrite *r = ctx->rewrites + ctx->num_rewrites++;
+  r->line = ctx->insns[insn].line;
+  r->kind = kind;
+  r->value = value;
+  r->words_saved = words_saved;
+}
+
+// i 番目の命令の直後のフラグが以降で使われないことが確かなら 1 を返す。
+// 次にフラグを書き換える演算命令までに、フラグを読む命令が無ければよい。
+// 分岐・ラベル・データに行き当たったら、その先で読まれるかもしれないので 0 を返す。
+static int FlagsDead(struct nlpasm_ctx *ctx, const uint8_t *labeled, int i) {
+  for (i++; i < ctx->num_insns; i++) {
+    struct nlpasm_insn *info = ctx->insns + i;
+    if (labeled[i] || info->len <= 0 || info->data) {
+      return 0;
+    }
+    const uint16_t *w = ctx->words + info->pos;
+    uint8_t op = w[0] >> 8, cond = (w[0] >> 4) & 0xf, out = w[0] & 0xf;
+    if (cond != FLAG_ALWAYS || out == kRegIP || out == kRegFLAG) { // 条件付き実行、分岐、flag の読み書き
+      return 0;
+    }
+    if (info->len >= 2 && ((w[1] >> 12) == kRegFLAG || ((w[1] >> 8) & 0xf) == kRegFLAG)) {
+      return 0;
+    }
+    if ((op & 0xf0) == 0x20 || ((op & 0xf0) == 0x10 && (op & 0x04))) { // シフトと桁上げ付きの演算
+      return 0;
+    }
+    if (op != OP_MOV && op < 0x80) { // 演算命令はフラグを書き換える
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static void Peephole(struct nlpasm_ctx *ctx) {
+  int n = ctx->num_insns;
+  if (n == 0) {
+    return;
+  }
+  // ラベルが指す命令と、バックパッチを持つ命令
+  uint8_t *labeled = XRealloc(NULL, n + 1);
+  int *bp_of = XRealloc(NULL, n * sizeof(int));
+  memset(labeled, 0, n + 1);
+  for (int i = 0; i < n; i++) {
+    bp_of[i] = -1;
+  }
+  for (int s = 0; s < ctx->num_symbols; s++) {
+    if (ctx->symbols[s].insn_idx >= 0) {
+      labeled[ctx->symbols[s].insn_idx] = 1;
+    }
+  }
+  for (int i = 0; i < ctx->num_backpatches; i++) {
+    bp_of[ctx->backpatches[i].insn_idx] = i;
+  }
+
+  // 数値で書いた ip 相対のオフセット（jmp byte 10 など）は、間の命令長が変わると
+  // 狂ってしまう。そのような命令があれば命令長を変える書き換えはしない。
+  int resize = 1;
+  ctx->opt_note[0] = '\0';
+  for (int i = 0; i < n && resize; i++) {
+    struct nlpasm_insn *info = ctx->insns + i;
+    if (info->len < 2 || info->data || bp_of[i] >= 0) {
+      continue;
+    }
+    int in1 = ctx->words[info->pos + 1] >> 12, in2 = (ctx->words[info->pos + 1] >> 8) & 0xf;
+    if ((in1 == kRegIP && (in2 == kImm8 || in2 == kImm16)) ||
+        (in2 == kRegIP && (in1 == kImm8 || in1 == kImm16))) {
+      resize = 0;
+      snprintf(ctx->opt_note, sizeof(ctx->opt_note),
+               "line %d uses a literal ip offset; rewrites that change code size were skipped",
+               info->line);
+    }
+  }
+
+  int changed = 0;
+  for (int i = 0; i < n; i++) {
+    struct nlpasm_insn *info = ctx->insns + i;
+    if (info->len < 2 || info->data) {
+      continue;
+    }
+    uint16_t *w = ctx->words + info->pos;
+    uint8_t op = w[0] >> 8, cond = (w[0] >> 4) & 0xf, out = w[0] & 0xf;
+    int in1 = w[1] >> 12, in2 = (w[1] >> 8) & 0xf;
+
+    // call の直後の ret: 呼び出し先の ret で直接戻ればよい
+    if ((op & 0xf0) == OP_CALL && cond == FLAG_ALWAYS && resize && i + 1 < n && !labeled[i + 1]) {
+      struct nlpasm_insn *next = ctx->insns + i + 1;
+      if (next->len == 1 && !next->data && ctx->words[next->pos] == (OP_RET << 8 | FLAG_ALWAYS << 4 | kRegIP)) {
+        op = (op & 0x0f) ? 0x10 | (op & 0x07) : OP_MOV; // jmp の絶対・IP 相対形式
+        w[0] = op << 8 | (w[0] & 0xffu);
+        if (bp_of[i] >= 0 && ctx->backpatches[bp_of[i]].op_rel) {
+          ctx->backpatches[bp_of[i]].op_rel = 0x10;
+        }
+        next->len = -1;
+        AddRewrite(ctx, i, NLPASM_REWRITE_TAIL_CALL, 0, 1);
+        changed = 1;
+        continue;
+      }
+    }
+    if (bp_of[i] >= 0 || out == kRegIP || in1 == kRegIP || in2 == kRegIP) {
+      continue;
+    }
+
+    // word を付けた 8 ビットのリテラル
+    if (resize && info->len == 3 && in1 != kImm8 && in2 != kImm8 && w[2] < 256) {
+      if (in1 == kImm16) {
+        in1 = kImm8;
+      } else {
+        in2 = kImm8;
+      }
+      w[1] = (in1 << 12) | (in2 << 8) | w[2];
+      info->len = 2;
+      AddRewrite(ctx, i, NLPASM_REWRITE_SHORT_IMM, w[1] & 0xff, 1);
+      changed = 1;
+    }
+
+    // 負のリテラルの加減算は、逆の演算にすれば imm8 に収まる。
+    // 桁上げフラグの結果が変わるので、フラグが使われない場合に限る。
+    if (resize && info->len == 3 && w[2] > 0xff00 && in1 != kImm8 && in2 != kImm8 &&
+        ((op == OP_ADD && (in1 == kImm16) != (in2 == kImm16)) ||
+         (op == OP_SUB && in2 == kImm16 && in1 != kImm16)) &&
+        FlagsDead(ctx, labeled, i)) {
+      int reg = in1 == kImm16 ? in2 : in1;
+      int v = 0x10000 - w[2];
+      op = op == OP_ADD ? OP_SUB : OP_ADD;
+      in1 = reg;
+      in2 = kImm8;
+      w[0] = op << 8 | (w[0] & 0xffu);
+      w[1] = (in1 << 12) | (in2 << 8) | v;
+      info->len = 2;
+      AddRewrite(ctx, i, NLPASM_REWRITE_NEGATE, v, 1);
+      changed = 1;
+    }
+
+    // 1 の加減算は inc/dec にして即値欄を使わない
+    if ((op == OP_ADD || op == OP_SUB) && info->len == 2 && (w[1] & 0xff) == 1) {
+      int reg = -1;
+      if (in2 == kImm8) {
+        reg = in1;
+      } else if (in1 == kImm8 && op == OP_ADD) {
+        reg = in2;
+      }
+      if (reg >= 0) {
+        w[0] = (op == OP_ADD ? OP_INC : OP_DEC) << 8 | (w[0] & 0xffu);
+        w[1] = reg << 12;
+        AddRewrite(ctx, i, op == OP_ADD ? NLPASM_REWRITE_INC : NLPASM_REWRITE_DEC, 0, 0);
+        continue;
+      }
+    }
+
+    // 何もしない mov。フラグを書き換えるかもしれないので、フラグが使われない場合に限る。
+    if (resize && op == OP_MOV && cond == FLAG_ALWAYS && info->len == 2 && in1 == out &&
+        kRegA <= out && out <= kRegE && FlagsDead(ctx, labeled, i)) {
+      info->len = -1;
+      AddRewrite(ctx, i, NLPASM_REWRITE_MOV_SELF, 0, 2);
+      changed = 1;
+    }
+  }
+  free(labeled);
+  free(bp_of);
+  if (!changed) {
+    return;
+  }
+
+  // 消した命令を詰め、ワード列とラベル・バックパッチの命令番号を付け直す
+  int *new_idx = XRealloc(NULL, (n + 1) * sizeof(int));
+  uint16_t *new_words = XRealloc(NULL, (ctx->num_words ? ctx->num_words : 1) * sizeof(uint16_t));
+  int m = 0, pos = 0;
+  for (int i = 0; i < n; i++) {
+    new_idx[i] = m;
+    struct nlpasm_insn info = ctx->insns[i];
+    if (info.len < 0) {
+      continue;
+    }
+    memcpy(new_words + pos, ctx->words + info.pos, info.len * sizeof(uint16_t));
+    info.pos = pos;
+    ctx->insns[m++] = info;
+    pos += info.len;
+  }
+  new_idx[n] = m;
+  for (int s = 0; s < ctx->num_symbols; s++) {
+    if (ctx->symbols[s].insn_idx >= 0) {
+      ctx->symbols[s].insn_idx = new_idx[ctx->symbols[s].insn_idx];
+    }
+  }
+  for (int i = 0; i < ctx->num_backpatches; i++) {
+    ctx->backpatches[i].insn_idx = new_idx[ctx->backpatches[i].insn_idx];
+  }
+  for (int r = 0; r < ctx->num_low_ranges; r++) {
+    ctx->low_ranges[r].first = new_idx[ctx->low_ranges[r].first];
+    ctx->low_ranges[r].end = new_idx[ctx->low_ranges[r].end];
+  }
+  free(new_idx);
+  free(ctx->words);
+  ctx->cap_words = ctx->num_words ? ctx->num_words : 1;
+  ctx->words = new_words;
+  ctx->num_words = pos;
+  ctx->num_insns = m;
+}
+
+// 行キャッシュ
+// 行の本文をキーに、その行を符号化した結果（ワード列・ラベル・バックパッチ）を
+// 覚えておく。前回と同じ行は字句解析と符号化を省き、記録した結果を再生する。
+// 結果が前の行の状態（現在の ip やラベルの定義状況）に依存した行は覚えない。
+// 命令サイズの決定とバックパッチの解決はアドレスが全体に波及するので、
+// キャッシュの有無に関わらず nlpasm_finish で全体に対して行う。
+#define CACHE_MAGIC "NLPC"
+#define CACHE_VERSION 3
+#define CACHE_MAX_BP 2
+
+enum CacheKind {
+  kCacheNone,   // ラベルや空行など、ワードを生成しない行
+  kCacheWords,  // 命令
+  kCacheOrigin, // .origin
+  kCacheData,   // .dw
+};
+
+struct CacheBackpatch {
+  int sym, sym_len; // シンボル名（cache_blob 内の位置）
+  uint8_t type, relax, shift, op_rel, sign;
+  uint16_t col;
+};
+
+struct CacheLine {
+  uint32_t hash;
+  int text, text_len;   // 行の本文（cache_blob 内の位置）
+  int label, label_len; // 定義するラベル。無ければ label は -1
+  uint8_t kind, num_words, num_bp, used;
+  uint16_t words[3];
+  int origin;
+  struct CacheBackpatch bp[CACHE_MAX_BP];
+};
+
+// 直列化したキャッシュの先頭。続いて CacheLine の配列、cache_blob が並ぶ。
+// 同じビルドの nlpasm が読み書きする前提なので、構造体をそのまま書き出す。
+struct CacheHeader {
+  char magic[4];
+  uint32_t version;
+  uint32_t line_size;
+  uint32_t num_lines;
+  uint32_t blob_len;
+};
+
+static int CacheBlobAdd(struct nlpasm_ctx *ctx, const char *s, int len) {
+  RESERVE(ctx->cache_blob, ctx->cap_cache_blob, ctx->cache_blob_len + len);
+  memcpy(ctx->cache_blob + ctx->cache_blob_len, s, len);
+  ctx->cache_blob_len += len;
+  return ctx->cache_blob_len - len;
+}
+
+static void GrowCacheSlots(struct nlpasm_ctx *ctx) {
+  int cap = ctx->cap_cache_slots ? ctx->cap_cache_slots * 2 : 1024;
+  free(ctx->cache_slots);
+  ctx->cache_slots = XRealloc(NULL, cap * sizeof(int));
+  for (int i = 0; i < cap; i++) {
+    ctx->cache_slots[i] = -1;
+  }
+  ctx->cap_cache_slots = cap;
+  for (int c = 0; c < ctx->num_cache_lines; c++) {
+    int i = ctx->cache_lines[c].hash & (cap - 1);
+    while (ctx->cache_slots[i] >= 0) {
+      i = (i + 1) & (cap - 1);
+    }
+    ctx->cache_slots[i] = c;
+  }
+}
+
+// 行を探す。見つからなければ -(挿入すべきスロット + 1) を返す。
+static int FindCacheLine(struct nlpasm_ctx *ctx, const char *line, int len, uint32_t hash) {
+  if ((ctx->num_cache_lines + 1) * 4 > ctx->cap_cache_slots * 3) {
+    GrowCacheSlots(ctx);
+  }
+  int mask = ctx->cap_cache_slots - 1;
+  int i = hash & mask;
+  for (; ctx->cache_slots[i] >= 0; i = (i + 1) & mask) {
+    struct CacheLine *c = ctx->cache_lines + ctx->cache_slots[i];
+    if (c->hash == hash && c->text_len == len &&
+        memcmp(ctx->cache_blob + c->text, line, len) == 0) {
+      return ctx->cache_slots[i];
+    }
+  }
+  return -(i + 1);
+}
+
+// 記録した結果を再生する
+static void ReplayCacheLine(struct nlpasm_ctx *ctx, struct CacheLine *c) {
+  c->used = 1;
+  if (c->label >= 0) {
+    DefineLabel(ctx, ctx->cache_blob + c->label, c->label_len);
+  }
+  for (int i = 0; i < c->num_bp; i++) {
+    struct CacheBackpatch *cb = c->bp + i;
+    int sym = InternSymbol(ctx, ctx->cache_blob + cb->sym, cb->sym_len);
+    int i_bp = AddBackpatch(ctx, sym, cb->type, NULL);
+    struct Backpatch *bp = ctx->backpatches + i_bp;
+    bp->col = cb->col;
+    bp->relax = cb->relax;
+    bp->shift = cb->shift;
+    bp->op_rel = cb->op_rel;
+    bp->sign = cb->sign;
+  }
+  if (c->kind == kCacheWords || c->kind == kCacheData) {
+    EmitWords(ctx, c->words, c->num_words);
+    ctx->insns[ctx->num_insns - 1].data = c->kind == kCacheData;
+  } else if (c->kind == kCacheOrigin) {
+    EmitOrigin(ctx, c->origin);
+  }
+}
+
+// AssembleLine が 1 行分に追加した結果を記録する。
+// num_insns, num_backpatches はその行を処理する前の値。
+static void RecordCacheLine(struct nlpasm_ctx *ctx, const char *line, int len, uint32_t hash,
+                            int slot, int num_insns, int num_backpatches) {
+  int nb = ctx->num_backpatches - num_backpatches;
+  int ni = ctx->num_insns - num_insns;
+  if (ctx->line_dep || nb > CACHE_MAX_BP || ni > 1) {
+    return;
+  }
+
+  RESERVE(ctx->cache_lines, ctx->cap_cache_lines, ctx->num_cache_lines + 1);
+  struct CacheLine *c = ctx->cache_lines + ctx->num_cache_lines;
+  memset(c, 0, sizeof(*c));
+  c->hash = hash;
+  c->text = CacheBlobAdd(ctx, line, len);
+  c->text_len = len;
+  c->label = -1;
+  if (ctx->line_label >= 0) {
+    struct Symbol *sym = ctx->symbols + ctx->line_label;
+    c->label = CacheBlobAdd(ctx, sym->name, sym->len);
+    c->label_len = sym->len;
+  }
+  c->kind = kCacheNone;
+  if (ni == 1) {
+    struct nlpasm_insn *info = ctx->insns + num_insns;
+    if (info->len == 0) {
+      c->kind = kCacheOrigin;
+      c->origin = info->ip;
+    } else {
+      c->kind = info->data ? kCacheData : kCacheWords;
+      c->num_words = info->len;
+      memcpy(c->words, ctx->words + info->pos, info->len * sizeof(uint16_t));
+    }
+  }
+  c->num_bp = nb;
+  for (int i = 0; i < nb; i++) {
+    struct Backpatch *bp = ctx->backpatches + num_backpatches + i;
+    struct Symbol *sym = ctx->symbols + bp->sym;
+    c->bp[i].sym = CacheBlobAdd(ctx, sym->name, sym->len);
+    c->bp[i].sym_len = sym->len;
+    c->bp[i].type = bp->type;
+    c->bp[i].relax = bp->relax;
+    c->bp[i].shift = bp->shift;
+    c->bp[i].op_rel = bp->op_rel;
+    c->bp[i].sign = bp->sign;
+    c->bp[i].col = bp->col <= UINT16_MAX ? bp->col : 0;
+  }
+  c->used = 1;
+  ctx->cache_slots[slot] = ctx->num_cache_lines++;
+}
+
+struct nlpasm_ctx *nlpasm_ctx_new(void) {
+  struct nlpasm_ctx *ctx = XRealloc(NULL, sizeof(*ctx));
+  memset(ctx, 0, sizeof(*ctx));
+  ctx->ip = ORIGIN;
+  ctx->low_start = -1;
+  ctx->max_errors = 1;
+  RESERVE(ctx->diag, ctx->cap_diag, 1);
+  ctx->diag[0] = '\0';
+  return ctx;
+}
+
+void nlpasm_ctx_free(struct nlpasm_ctx *ctx) {
+  if (ctx == NULL) {
+    return;
+  }
+  while (ctx->str_pool) {
+    struct StrPoolChunk *next = ctx->str_pool->next;
+    free(ctx->str_pool);
+    ctx->str_pool = next;
+  }
+  FreeTokenPool(&ctx->line_tokens);
+  FreeTokenPool(&ctx->body_tokens);
+  free(ctx->words);
+  free(ctx->insns);
+  free(ctx->backpatches);
+  free(ctx->symbols);
+  free(ctx->sym_slots);
+  free(ctx->diag);
+  free(ctx->diags);
+  free(ctx->diag_out);
+  while (ctx->error_texts) {
+    struct IncludeText *next = ctx->error_texts->next;
+    FreeIncludeText(ctx->error_texts);
+    ctx->error_texts = next;
+  }
+  free(ctx->cache_lines);
+  free(ctx->cache_slots);
+  free(ctx->cache_blob);
+  free(ctx->cache_out);
+  free(ctx->obj_out);
+  free(ctx->advice);
+  free(ctx->rewrites);
+  free(ctx->blocks);
+  free(ctx->block_exits);
+  free(ctx->block_of);
+  free(ctx->code_by_ip);
+  free(ctx->routines);
+  free(ctx->isr_ips);
+  free(ctx->segments);
+  free(ctx->body_lines);
+  free(ctx->body_oprs);
+  free(ctx->macros);
+  free(ctx->include_dirs);
+  free(ctx->included);
+  free(ctx->include_names);
+  free(ctx->str_buf);
+  free(ctx->low_ranges);
+  free(ctx->low_objs);
+  free(ctx->low_order);
+  free(ctx->lowdata);
+  if (ctx->own_include_cache) {
+    nlpasm_include_cache_free(ctx->include_cache);
+  }
+  free(ctx);
+}
+
+// 分割・字句解析の済んだ 1 行を符号化する
+static void AssembleParsed(struct nlpasm_ctx *ctx, const char *line, int line_len,
+                           struct SrcLine *sl, struct Operand *operands, int num_opr) {
+  if (sl->label) {
+    DefineLabel(ctx, sl->label, sl->label_len);
+  }
+
+  if (num_opr < 0) {
+    return;
+  }
+
+  const char *mnemonic = sl->mnemonic;
+  int mnemonic_len = sl->mnemonic_len;
+  const char *sep = memchr(mnemonic + 1, '.', mnemonic_len - 1);
+  uint8_t flag = 1; // always do
+  if (sep) {
+    mnemonic_len = sep - mnemonic;
+    flag = FlagNameToBits(ctx, sep + 1, sl->mnemonic + sl->mnemonic_len - sep - 1);
+  }
+
+  const struct IsaEntry *e = LookupMnemonic(mnemonic, mnemonic_len);
+  if (e == NULL) {
+    const struct Macro *m = FindMacro(ctx, mnemonic, mnemonic_len);
+    if (m == NULL) {
+      ErrorAt(ctx, mnemonic, "unknown mnemonic: '%.*s'\n", mnemonic_len, mnemonic);
+    } else if (sep) {
+      ErrorAt(ctx, sl->mnemonic, "macros take no condition: '%.*s'\n",
+              sl->mnemonic_len, sl->mnemonic);
+    }
+    ctx->line_dep = 1; // 行キャッシュには記録できない
+    ExpandMacro(ctx, m, operands, num_opr);
+    return;
+  }
+
+  if (sl->rest && e->enc != EncDW) {
+    ErrorAt(ctx, sl->mnemonic, "too many operands for '%.*s'\n", sl->mnemonic_len, sl->mnemonic);
+  }
+  struct Line l = {line, line_len, flag, operands, num_opr, sl->rest, sl->rest_end};
+  struct Instruction ins = {0};
+  int insn_len = e->enc(ctx, e, &l, &ins);
+  if (insn_len > 0) {
+    EmitInstruction(ctx, &ins, insn_len);
+  }
+}
+
+static void AssembleLine(struct nlpasm_ctx *ctx, const char *line, int line_len) {
+  struct SrcLine sl;
+  struct Operand operands[MAX_OPERAND];
+  uint64_t t0 = ctx->stats_enabled ? NowNs() : 0;
+  int num_opr = SplitOpcode(ctx, &ctx->line_tokens, line, line + line_len, &sl, operands,
+                            MAX_OPERAND);
+  if (ctx->stats_enabled) {
+    ctx->stats.ns_tokenize += NowNs() - t0;
+  }
+  AssembleParsed(ctx, line, line_len, &sl, operands, num_opr);
+}
+
+// 最終イメージから命令数などを数える
+static void CountStats(struct nlpasm_ctx *ctx) {
+  struct nlpasm_stats *st = &ctx->stats;
+  for (int i = 0; i < ctx->num_insns; i++) {
+    struct nlpasm_insn *info = ctx->insns + i;
+    if (info->len == 0) { // .origin
+      continue;
+    } else if (info->data) {
+      st->data_words += info->len;
+      continue;
+    }
+    st->insns_by_len[info->len]++;
+    if (info->len >= 2) { // 入力のニブルが 1, 2 なら即値欄を使っている
+      uint8_t in = ctx->words[info->pos + 1] >> 8;
+      st->imm8 += (in >> 4) == kImm8 || (in & 0xf) == kImm8;
+      st->imm16 += (in >> 4) == kImm16 || (in & 0xf) == kImm16;
+    }
+  }
+  for (int i = 0; i < ctx->num_backpatches; i++) {
+    st->backpatches_by_type[ctx->backpatches[i].type]++;
+  }
+  st->symbols = ctx->num_symbols;
+  st->words = ctx->num_words;
+}
+
+int nlpasm_assemble_line(struct nlpasm_ctx *ctx, const char *line, size_t len) {
+  if (ctx->failed) {
+    return -1;
+  }
+
+  TokenRelease(&ctx->line_tokens, (struct TokenMark){NULL, 0}); // 前の行のトークンは要らない
+
+  // エラーになった行の途中までの出力は取り消す
+  struct LineState ls;
+  SaveLineState(ctx, &ls);
+  int num_insns = ls.num_insns;
+  int num_backpatches = ls.num_backpatches;
+  int num_diags = ctx->num_diags;
+  uint64_t tokenize_ns = ctx->stats.ns_tokenize;
+
+  jmp_buf env;
+  ctx->err_jmp = &env;
+  if (setjmp(env)) {
+    RestoreLineState(ctx, &ls);
+    return -1;
+  }
+
+  ctx->stats.lines++;
+  ctx->loc_file = ctx->source_name;
+  ctx->loc_line = ctx->stats.lines;
+  ctx->loc_text = line;
+  ctx->loc_end = line + len;
+  if (ctx->recording) { // .macro/.rept の本体は記録するだけで、行キャッシュも使わない
+    RecordBodyLine(ctx, line, len);
+    return 0;
+  }
+  uint64_t t0 = ctx->stats_enabled ? NowNs() : 0;
+  if (!ctx->cache_enabled) {
+    AssembleLine(ctx, line, len);
+  } else {
+    uint32_t hash = HashName(line, len);
+    int c = FindCacheLine(ctx, line, len, hash);
+    ctx->line_label = -1;
+    if (c >= 0) {
+      ReplayCacheLine(ctx, ctx->cache_lines + c);
+      ctx->stats.cache_hits++;
+    } else {
+      ctx->line_dep = 0;
+      AssembleLine(ctx, line, len);
+      RecordCacheLine(ctx, line, len, hash, -c - 1, num_insns, num_backpatches);
+    }
+  }
+  if (ctx->stats_enabled) { // 字句解析の時間は AssembleLine で別に足している
+    uint64_t ns = NowNs() - t0;
+    ctx->stats.ns_encode += ns - (ctx->stats.ns_tokenize - tokenize_ns);
+  }
+  return ctx->num_diags > num_diags ? -1 : 0; // 取り込んだファイルの中のエラー
+}
+
+int nlpasm_finish(struct nlpasm_ctx *ctx) {
+  if (ctx->failed) {
+    return -1;
+  }
+
+  // ここからのエラーは行番号だけを付ける（ResolveBackpatches などが命令の行を設定する）
+  ctx->loc_file = ctx->source_name;
+  ctx->loc_line = 0;
+  ctx->loc_text = NULL;
+  jmp_buf env;
+  ctx->err_jmp = &env;
+  if (setjmp(env)) {
+    return -1;
+  }
+  if (ctx->recording) {
+    Error(ctx, "missing '%s' at the end of the source\n",
+          ctx->recording == kRecMacro ? ".endm" : ".endr");
+  }
+  if (ctx->low_start >= 0) {
+    CloseLowData(ctx);
+  }
+  uint64_t t0 = ctx->stats_enabled ? NowNs() : 0;
+  if (ctx->optimize) {
+    Peephole(ctx);
+  }
+  if (ctx->num_low_ranges) {
+    SplitLowData(ctx);
+  }
+  Relax(ctx);
+  if (ctx->num_low_objs) {
+    ReportLowData(ctx);
+  }
+  uint64_t t1 = ctx->stats_enabled ? NowNs() : 0;
+  ResolveBackpatches(ctx);
+  if (ctx->stats_enabled) {
+    ctx->stats.ns_relax += t1 - t0;
+    ctx->stats.ns_resolve += NowNs() - t1;
+    CountStats(ctx);
+  }
+  return ctx->num_diags > 0 ? -1 : 0;
+}
+
+int nlpasm_assemble_buffer(struct nlpasm_ctx *ctx, const char *src, size_t len) {
+  const char *end = src + len;
+  while (src < end) {
+    const char *nl = memchr(src, '\n', end - src);
+    const char *line_end = nl ? nl : end;
+    if (nlpasm_assemble_line(ctx, src, line_end - src) < 0 && ctx->failed) {
+      return -1;
+    }
+    src = line_end + 1;
+  }
+  return nlpasm_finish(ctx);
+}
+
+const uint16_t *nlpasm_get_image(struct nlpasm_ctx *ctx, size_t *num_words) {
+  *num_words = ctx->num_words;
+  return ctx->words;
+}
+
+const struct nlpasm_lowdata *nlpasm_get_lowdata(struct nlpasm_ctx *ctx, size_t *num_lowdata) {
+  *num_lowdata = ctx->lowdata ? ctx->num_low_objs : 0;
+  return ctx->lowdata;
+}
+
+const struct nlpasm_insn *nlpasm_get_insns(struct nlpasm_ctx *ctx, size_t *num_insns) {
+  *num_insns = ctx->num_insns;
+  return ctx->insns;
+}
+
+static int CompareSegment(const void *a, const void *b) {
+  const struct nlpasm_segment *x = a, *y = b;
+  if (x->addr != y->addr) {
+    return x->addr < y->addr ? -1 : 1;
+  }
+  return x->pos < y->pos ? -1 : x->pos > y->pos;
+}
+
+const struct nlpasm_segment *nlpasm_get_segments(struct nlpasm_ctx *ctx, size_t *num_segments) {
+  // 命令を順にたどり、アドレスもイメージ内の位置も続いている間は同じセグメントにする
+  ctx->num_segments = 0;
+  struct nlpasm_segment *cur = NULL;
+  for (int i = 0; i < ctx->num_insns; i++) {
+    const struct nlpasm_insn *ins = ctx->insns + i;
+    if (ins->len == 0) {
+      continue;
+    }
+    if (cur && ins->ip == (long)(cur->addr + cur->len) && ins->pos == (long)(cur->pos + cur->len)) {
+      cur->len += ins->len;
+      continue;
+    }
+    RESERVE(ctx->segments, ctx->cap_segments, ctx->num_segments + 1);
+    cur = ctx->segments + ctx->num_segments++;
+    cur->addr = ins->ip;
+    cur->pos = ins->pos;
+    cur->len = ins->len;
+  }
+  qsort(ctx->segments, ctx->num_segments, sizeof(ctx->segments[0]), CompareSegment);
+  *num_segments = ctx->num_segments;
+  return ctx->segments;
+}
+
+const char *nlpasm_get_diagnostics(struct nlpasm_ctx *ctx) {
+  return ctx->diag;
+}
+
+// 場所の順（ファイル名、行番号、桁）。標準入力（NULL）は先に、行に結び付かないものは
+// そのファイルの後に並べる。
+static int CompareDiagPlace(const struct nlpasm_diag *a, const struct nlpasm_diag *b) {
+  if (a->file != b->file) {
+    int c = a->file == NULL ? -1 : b->file == NULL ? 1 : strcmp(a->file, b->file);
+    if (c) {
+      return c;
+    }
+  }
+  if (a->line != b->line) {
+    return a->line == 0 ? 1 : b->line == 0 ? -1 : a->line < b->line ? -1 : 1;
+  }
+  return a->column < b->column ? -1 : a->column > b->column;
+}
+
+const struct nlpasm_diag *nlpasm_get_diags(struct nlpasm_ctx *ctx, size_t *num_diags) {
+  // 前に呼んだときから増えた分だけ作り、場所の順に挿入する（同じ場所なら出た順）。
+  // ラベルの解決などのエラーは最後に出るので、ソースの順とは限らない。
+  RESERVE(ctx->diag_out, ctx->cap_diag_out, ctx->num_diags + 1);
+  for (int i = ctx->num_diag_out; i < ctx->num_diags; i++) {
+    const struct Diag *d = ctx->diags + i;
+    struct nlpasm_diag nd = {
+      .file = d->file,
+      .line = d->line,
+      .column = d->col,
+      .message = StrPoolAdd(ctx, ctx->diag + d->msg, d->msg_len),
+    };
+    int k = i;
+    for (; k > 0 && CompareDiagPlace(ctx->diag_out + k - 1, &nd) > 0; k--) {
+      ctx->diag_out[k] = ctx->diag_out[k - 1];
+    }
+    ctx->diag_out[k] = nd;
+  }
+  ctx->num_diag_out = ctx->num_diags;
+  *num_diags = ctx->num_diags;
+  return ctx->diag_out;
+}
+
+void nlpasm_set_max_errors(struct nlpasm_ctx *ctx, int max_errors) {
+  ctx->max_errors = max_errors < 0 ? 0 : max_errors;
+}
+
+int nlpasm_stopped(struct nlpasm_ctx *ctx) {
+  return ctx->failed;
+}
+
+int nlpasm_cache_load(struct nlpasm_ctx *ctx, const void *data, size_t len) {
+  ctx->cache_enabled = 1;
+  if (data == NULL) {
+    return 0;
+  }
+
+  struct CacheHeader h;
+  if (len < sizeof(h)) {
+    return -1;
+  }
+  memcpy(&h, data, sizeof(h));
+  size_t lines_size = (size_t)h.num_lines * sizeof(struct CacheLine);
+  if (memcmp(h.magic, CACHE_MAGIC, 4) != 0 || h.version != CACHE_VERSION ||
+      h.line_size != sizeof(struct CacheLine) ||
+      len != sizeof(h) + lines_size + h.blob_len) {
+    return -1;
+  }
+
+  const char *p = (const char *)data + sizeof(h);
+  const struct CacheLine *lines = (const struct CacheLine *)p;
+  const char *blob = p + lines_size;
+  int base = ctx->cache_blob_len;
+  CacheBlobAdd(ctx, blob, h.blob_len);
+  for (uint32_t i = 0; i < h.num_lines; i++) {
+    struct CacheLine c;
+    memcpy(&c, lines + i, sizeof(c));
+    // 壊れたキャッシュで範囲外を読まないよう、文字列の位置を確かめる
+    int ok = c.num_bp <= CACHE_MAX_BP && c.num_words <= 3 && c.kind <= kCacheData &&
+             c.text >= 0 && c.text_len >= 0 && (uint32_t)(c.text + c.text_len) <= h.blob_len &&
+             (c.label < 0 ||
+              (c.label_len >= 0 && (uint32_t)(c.label + c.label_len) <= h.blob_len));
+    for (int j = 0; j < c.num_bp && ok; j++) {
+      ok = c.bp[j].sym >= 0 && c.bp[j].sym_len >= 0 &&
+           (uint32_t)(c.bp[j].sym + c.bp[j].sym_len) <= h.blob_len &&
+           c.bp[j].type <= BP_IP_REL16;
+    }
+    if (!ok) {
+      continue;
+    }
+    c.text += base;
+    c.label += c.label >= 0 ? base : 0;
+    for (int j = 0; j < c.num_bp; j++) {
+      c.bp[j].sym += base;
+    }
+    c.used = 0;
+
+    int slot = FindCacheLine(ctx, ctx->cache_blob + c.text, c.text_len, c.hash);
+    if (slot >= 0) {
+      continue;
+    }
+    RESERVE(ctx->cache_lines, ctx->cap_cache_lines, ctx->num_cache_lines + 1);
+    ctx->cache_lines[ctx->num_cache_lines] = c;
+    ctx->cache_slots[-slot - 1] = ctx->num_cache_lines++;
+  }
+  return 0;
+}
+
+const void *nlpasm_cache_data(struct nlpasm_ctx *ctx, size_t *len) {
+  // 今回使った行だけを書き出し、文字列も詰め直す
+  struct CacheHeader h = {CACHE_MAGIC, CACHE_VERSION, sizeof(struct CacheLine), 0, 0};
+  for (int i = 0; i < ctx->num_cache_lines; i++) {
+    struct CacheLine *c = ctx->cache_lines + i;
+    if (c->used) {
+      h.num_lines++;
+      h.blob_len += c->text_len + (c->label >= 0 ? c->label_len : 0);
+      for (int j = 0; j < c->num_bp; j++) {
+        h.blob_len += c->bp[j].sym_len;
+      }
+    }
+  }
+
+  size_t lines_size = (size_t)h.num_lines * sizeof(struct CacheLine);
+  *len = sizeof(h) + lines_size + h.blob_len;
+  free(ctx->cache_out);
+  ctx->cache_out = XRealloc(NULL, *len);
+  memcpy(ctx->cache_out, &h, sizeof(h));
+  struct CacheLine *out = (struct CacheLine *)(ctx->cache_out + sizeof(h));
+  char *blob = ctx->cache_out + sizeof(h) + lines_size;
+  int blob_len = 0;
+#define COPY_STR(pos, n) \
+  do { \
+    memcpy(blob + blob_len, ctx->cache_blob + (pos), (n)); \
+    (pos) = blob_len; \
+    blob_len += (n); \
+  } while (0)
+  for (int i = 0; i < ctx->num_cache_lines; i++) {
+    struct CacheLine c = ctx->cache_lines[i];
+    if (!c.used) {
+      continue;
+    }
+    COPY_STR(c.text, c.text_len);
+    if (c.label >= 0) {
+      COPY_STR(c.label, c.label_len);
+    }
+    for (int j = 0; j < c.num_bp; j++) {
+      COPY_STR(c.bp[j].sym, c.bp[j].sym_len);
+    }
+    memcpy(out++, &c, sizeof(c));
+  }
+#undef COPY_STR
+  return ctx->cache_out;
+}
+
+// オブジェクトファイル
+// 命令サイズを決める前の状態（ワード列・命令・バックパッチ・シンボル）を
+// そのまま書き出し、リンク時に 1 つのコンテキストへつなげてから
+// nlpasm_finish で命令サイズの決定とバックパッチの解決を行う。
+// 数値はすべてリトルエンディアン。
+//
+//   ヘッダ       "NLPO", version, ワード数, 命令数, バックパッチ数, シンボル数, 文字列表の長さ
+//   ワード列     u16 × ワード数
+//   命令         ip, len（i32 × 2）× 命令数。len が 0 なら .origin、データなら len に OBJ_DATA、
+//                .lowdata の中ならさらに OBJ_LOW を足す
+//   バックパッチ insn_idx, sym（i32 × 2）, type, relax, shift, op_rel, sign（u8 × 5）
+//   シンボル     name, name_len, ip, insn_idx（i32 × 4）, global（u8）
+//   文字列表
+#define OBJ_MAGIC "NLPO"
+#define OBJ_VERSION 4
+#define OBJ_HEADER_SIZE 28
+#define OBJ_INSN_SIZE 8
+#define OBJ_DATA 0x40000000
+#define OBJ_LOW 0x20000000
+#define OBJ_BP_SIZE 22
+#define OBJ_SYM_SIZE 17
+
+static uint8_t *ObjReserve(struct nlpasm_ctx *ctx, int n) {
+  RESERVE(ctx->obj_out, ctx->cap_obj, ctx->obj_len + n);
+  ctx->obj_len += n;
+  return ctx->obj_out + ctx->obj_len - n;
+}
+
+static void ObjPut8(struct nlpasm_ctx *ctx, uint8_t v) {
+  *ObjReserve(ctx, 1) = v;
+}
+
+static void ObjPut16(struct nlpasm_ctx *ctx, uint16_t v) {
+  uint8_t *p = ObjReserve(ctx, 2);
+  p[0] = v;
+  p[1] = v >> 8;
+}
+
+static void ObjPut32(struct nlpasm_ctx *ctx, uint32_t v) {
+  uint8_t *p = ObjReserve(ctx, 4);
+  for (int i = 0; i < 4; i++) {
+    p[i] = v >> (8 * i);
+  }
+}
+
+static uint16_t ObjGet16(const uint8_t *p) {
+  return p[0] | p[1] << 8;
+}
+
+static int32_t ObjGet32(const uint8_t *p) {
+  return (int32_t)((uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 |
+                   (uint32_t)p[3] << 24);
+}
+
+const void *nlpasm_get_object(struct nlpasm_ctx *ctx, size_t *len) {
+  if (ctx->failed) {
+    return NULL;
+  }
+
+  int strtab_len = 0;
+  for (int i = 0; i < ctx->num_symbols; i++) {
+    strtab_len += ctx->symbols[i].len;
+  }
+
+  ctx->obj_len = 0;
+  memcpy(ObjReserve(ctx, 4), OBJ_MAGIC, 4);
+  ObjPut32(ctx, OBJ_VERSION);
+  ObjPut32(ctx, ctx->num_words);
+  ObjPut32(ctx, ctx->num_insns);
+  ObjPut32(ctx, ctx->num_backpatches);
+  ObjPut32(ctx, ctx->num_symbols);
+  ObjPut32(ctx, strtab_len);
+  for (int i = 0; i < ctx->num_words; i++) {
+    ObjPut16(ctx, ctx->words[i]);
+  }
+  int r = 0;
+  for (int i = 0; i < ctx->num_insns; i++) {
+    while (r < ctx->num_low_ranges && ctx->low_ranges[r].end <= i) {
+      r++;
+    }
+    int low = (r < ctx->num_low_ranges && ctx->low_ranges[r].first <= i) ||
+              (ctx->low_start >= 0 && ctx->low_start <= i);
+    ObjPut32(ctx, ctx->insns[i].ip);
+    ObjPut32(ctx, ctx->insns[i].len + (ctx->insns[i].data ? OBJ_DATA : 0) +
+                  (low ? OBJ_LOW : 0));
+  }
+  for (int i = 0; i < ctx->num_backpatches; i++) {
+    struct Backpatch *bp = ctx->backpatches + i;
+    ObjPut32(ctx, bp->insn_idx);
+    ObjPut32(ctx, bp->sym);
+    ObjPut8(ctx, bp->type);
+    ObjPut8(ctx, bp->relax);
+    ObjPut8(ctx, bp->shift);
+    ObjPut8(ctx, bp->op_rel);
+    ObjPut8(ctx, bp->sign);
+    ObjPut8(ctx, bp->part);
+    ObjPut32(ctx, bp->sym2);
+    ObjPut32(ctx, bp->addend);
+  }
+  int name = 0;
+  for (int i = 0; i < ctx->num_symbols; i++) {
+    struct Symbol *sym = ctx->symbols + i;
+    ObjPut32(ctx, name);
+    ObjPut32(ctx, sym->len);
+    ObjPut32(ctx, sym->ip);
+    ObjPut32(ctx, sym->insn_idx);
+    ObjPut8(ctx, sym->global);
+    name += sym->len;
+  }
+  for (int i = 0; i < ctx->num_symbols; i++) {
+    memcpy(ObjReserve(ctx, ctx->symbols[i].len), ctx->symbols[i].name, ctx->symbols[i].len);
+  }
+
+  *len = ctx->obj_len;
+  return ctx->obj_out;
+}
+
+static void LinkObject(struct nlpasm_ctx *ctx, const uint8_t *p, size_t len) {
+  if (len < OBJ_HEADER_SIZE || memcmp(p, OBJ_MAGIC, 4) != 0) {
+    Error(ctx, "not an object file\n");
+  }
+  if (ObjGet32(p + 4) != OBJ_VERSION) {
+    Error(ctx, "unsupported object file version: %d\n", ObjGet32(p + 4));
+  }
+  int32_t num_words = ObjGet32(p + 8);
+  int32_t num_insns = ObjGet32(p + 12);
+  int32_t num_bps = ObjGet32(p + 16);
+  int32_t num_syms = ObjGet32(p + 20);
+  int32_t strtab_len = ObjGet32(p + 24);
+  if (num_words < 0 || num_insns < 0 || num_bps < 0 || num_syms < 0 || strtab_len < 0 ||
+      len != OBJ_HEADER_SIZE + 2 * (size_t)num_words + (size_t)OBJ_INSN_SIZE * num_insns +
+             (size_t)OBJ_BP_SIZE * num_bps + (size_t)OBJ_SYM_SIZE * num_syms + strtab_len) {
+    Error(ctx, "broken object file\n");
+  }
+  const uint8_t *words = p + OBJ_HEADER_SIZE;
+  const uint8_t *insns = words + 2 * (size_t)num_words;
+  const uint8_t *bps = insns + (size_t)OBJ_INSN_SIZE * num_insns;
+  const uint8_t *syms = bps + (size_t)OBJ_BP_SIZE * num_bps;
+  const char *strtab = (const char *)syms + (size_t)OBJ_SYM_SIZE * num_syms;
+
+  // 命令とワード列は末尾につなげる。アドレスは nlpasm_finish で決め直す。
+  int base_insn = ctx->num_insns;
+  int pos = 0;
+  for (int i = 0; i < num_insns; i++) {
+    const uint8_t *q = insns + OBJ_INSN_SIZE * i;
+    int32_t ip = ObjGet32(q), n = ObjGet32(q + 4) & ~(OBJ_DATA | OBJ_LOW);
+    int data = (ObjGet32(q + 4) & OBJ_DATA) != 0;
+    int low = (ObjGet32(q + 4) & OBJ_LOW) != 0;
+    if (n < 0 || (n > 3 && !data) || n > num_words - pos) {
+      Error(ctx, "broken object file\n");
+    }
+    if (low && ctx->low_start < 0) {
+      ctx->low_start = ctx->num_insns;
+    } else if (!low && ctx->low_start >= 0) {
+      CloseLowData(ctx);
+    }
+    if (n == 0) {
+      EmitOrigin(ctx, ip);
+      continue;
+    }
+    uint16_t *w = EmitSpace(ctx, n);
+    for (int j = 0; j < n; j++) {
+      w[j] = ObjGet16(words + 2 * (pos + j));
+    }
+    ctx->insns[ctx->num_insns - 1].data = data;
+    pos += n;
+  }
+  if (ctx->low_start >= 0) {
+    CloseLowData(ctx);
+  }
+
+  // オブジェクト内のシンボル番号からコンテキストのシンボル番号への対応
+  int *sym_map = XRealloc(NULL, (num_syms ? num_syms : 1) * sizeof(int));
+  for (int i = 0; i < num_syms; i++) {
+    const uint8_t *q = syms + OBJ_SYM_SIZE * i;
+    int32_t name = ObjGet32(q), name_len = ObjGet32(q + 4);
+    int32_t ip = ObjGet32(q + 8), insn_idx = ObjGet32(q + 12);
+    uint8_t global = q[16];
+    if (name < 0 || name_len < 0 || name + name_len > strtab_len || insn_idx > num_insns) {
+      free(sym_map);
+      Error(ctx, "broken object file\n");
+    }
+    const char *s = strtab + name;
+    if (insn_idx < 0 && ip >= 0) { // 固定アドレス
+      sym_map[i] = AddAddrSymbol(ctx, s, name_len, ip);
+    } else if (insn_idx < 0) { // 未定義なので他のオブジェクトの .global を参照する
+      sym_map[i] = InternSymbol(ctx, s, name_len);
+    } else if (!global) { // このオブジェクトだけのラベル
+      sym_map[i] = AddAnonSymbol(ctx, s, name_len, 0, base_insn + insn_idx);
+    } else {
+      int g = InternSymbol(ctx, s, name_len);
+      if (ctx->symbols[g].ip >= 0) {
+        free(sym_map);
+        Error(ctx, "label redefined: '%.*s'\n", name_len, s);
+      }
+      ctx->symbols[g].ip = 0;
+      ctx->symbols[g].insn_idx = base_insn + insn_idx;
+      ctx->symbols[g].global = 1;
+      sym_map[i] = g;
+    }
+  }
+
+  for (int i = 0; i < num_bps; i++) {
+    const uint8_t *q = bps + OBJ_BP_SIZE * i;
+    int32_t insn_idx = ObjGet32(q), sym = ObjGet32(q + 4), sym2 = ObjGet32(q + 14);
+    if (insn_idx < 0 || insn_idx >= num_insns || sym < 0 || sym >= num_syms ||
+        q[8] > BP_IP_REL16 || q[13] > kPartLo || sym2 < -1 || sym2 >= num_syms) {
+      free(sym_map);
+      Error(ctx, "broken object file\n");
+    }
+    RESERVE(ctx->backpatches, ctx->cap_backpatches, ctx->num_backpatches + 1);
+    struct Backpatch *bp = ctx->backpatches + ctx->num_backpatches++;
+    InitBackpatch(bp, base_insn + insn_idx, sym_map[sym], q[8]);
+    bp->relax = q[9];
+    bp->shift = q[10];
+    bp->op_rel = q[11];
+    bp->sign = q[12];
+    bp->part = q[13];
+    bp->sym2 = sym2 < 0 ? -1 : sym_map[sym2];
+    bp->addend = ObjGet32(q + 18);
+  }
+  free(sym_map);
+}
+
+int nlpasm_link_object(struct nlpasm_ctx *ctx, const void *data, size_t len) {
+  if (ctx->failed) {
+    return -1;
+  }
+
+  jmp_buf env;
+  ctx->err_jmp = &env;
+  if (setjmp(env)) {
+    return -1;
+  }
+  LinkObject(ctx, data, len);
+  return 0;
+}
+
+void nlpasm_enable_stats(struct nlpasm_ctx *ctx) {
+  ctx->stats_enabled = 1;
+}
+
+const struct nlpasm_stats *nlpasm_get_stats(struct nlpasm_ctx *ctx) {
+  return &ctx->stats;
+}
+
+// コードサイズの助言
+// 命令語 1 ワードのフェッチにかかるサイクル数（見積もり用）
+#define FETCH_CYCLES_PER_WORD 1
+
+static int CompareAdvice(const void *a, const void *b) {
+  const struct nlpasm_advice *x = a, *y = b;
+  if (x->words_saved != y->words_saved) {
+    return y->words_saved - x->words_saved;
+  }
+  return x->insn - y->insn;
+}
+
+// 3 ワード命令 insn の imm16 が伸びた理由を調べる。bp は imm16 を埋めるバックパッチ（無ければ NULL）。
+static void Advise(struct nlpasm_ctx *ctx, int insn, struct Backpatch *bp,
+                   struct nlpasm_advice *a) {
+  struct nlpasm_insn *info = ctx->insns + insn;
+  const uint16_t *w = ctx->words + info->pos;
+  uint8_t op = w[0] >> 8, in = w[1] >> 8;
+  a->insn = insn;
+  a->symbol = NULL;
+  a->words_saved = 1;
+
+  if (((in >> 4) == kImm8 && (in & 0xf) == kImm16) ||
+      ((in >> 4) == kImm16 && (in & 0xf) == kImm8)) { // 即値欄を両方使っている
+    a->reason = NLPASM_ADVICE_TWO_IMM;
+    a->value = (int16_t)w[2];
+    a->words_saved = 0;
+    return;
+  }
+
+  if (bp == NULL) { // 数値リテラル
+    a->value = (int16_t)w[2];
+    if (w[2] < 256) {
+      a->reason = NLPASM_ADVICE_WORD_PREFIX;
+      a->value = w[2];
+    } else if (-256 < a->value && a->value < 0 &&
+               (op == 0x12 || (op == 0x11 && (in & 0xf) == kImm16))) {
+      a->reason = NLPASM_ADVICE_NEGATIVE;
+    } else {
+      a->reason = NLPASM_ADVICE_LITERAL;
+      a->words_saved = 0;
+    }
+    return;
+  }
+
+  struct Symbol *sym = ctx->symbols + bp->sym;
+  a->symbol = sym->anon ? NULL : sym->name;
+  int target = BackpatchValue(ctx, bp);
+  int ip_diff = target - (info->ip + info->len);
+  int dist = ip_diff < 0 && !bp->sign ? -ip_diff : ip_diff;
+  int fits_rel = 0 <= dist && dist < 256;
+  if (bp->type == BP_ABS16) {
+    a->value = target;
+    if (!bp->relax && ((0 <= target && target < 256) || (bp->op_rel && fits_rel))) {
+      a->reason = NLPASM_ADVICE_WORD_PREFIX;
+    } else {
+      a->reason = NLPASM_ADVICE_LABEL;
+    }
+  } else {
+    a->value = dist;
+    a->reason = !bp->relax && fits_rel ? NLPASM_ADVICE_WORD_PREFIX : NLPASM_ADVICE_DISTANCE;
+  }
+}
+
+const struct nlpasm_advice *nlpasm_get_advice(struct nlpasm_ctx *ctx, size_t *num_advice) {
+  // imm16 を埋めるバックパッチを命令ごとに引けるようにする
+  int *bp_of = XRealloc(NULL, (ctx->num_insns ? ctx->num_insns : 1) * sizeof(int));
+  for (int i = 0; i < ctx->num_insns; i++) {
+    bp_of[i] = -1;
+  }
+  for (int i = 0; i < ctx->num_backpatches; i++) {
+    enum BPType t = ctx->backpatches[i].type;
+    if (t == BP_ABS16 || t == BP_IP_REL16) {
+      bp_of[ctx->backpatches[i].insn_idx] = i;
+    }
+  }
+
+  ctx->num_advice = 0;
+  for (int i = 0; i < ctx->num_insns; i++) {
+    if (ctx->insns[i].len != 3 || ctx->insns[i].data) {
+      continue;
+    }
+    RESERVE(ctx->advice, ctx->cap_advice, ctx->num_advice + 1);
+    struct nlpasm_advice *a = ctx->advice + ctx->num_advice++;
+    Advise(ctx, i, bp_of[i] >= 0 ? ctx->backpatches + bp_of[i] : NULL, a);
+    a->cycles_saved = a->words_saved * FETCH_CYCLES_PER_WORD;
+  }
+  free(bp_of);
+
+  qsort(ctx->advice, ctx->num_advice, sizeof(*ctx->advice), CompareAdvice);
+  *num_advice = ctx->num_advice;
+  return ctx->advice;
+}
+
+void nlpasm_enable_optimize(struct nlpasm_ctx *ctx) {
+  ctx->optimize = 1;
+}
+
+const struct nlpasm_rewrite *nlpasm_get_rewrites(struct nlpasm_ctx *ctx, size_t *num_rewrites,
+                                                 const char **note) {
+  *num_rewrites = ctx->num_rewrites;
+  *note = ctx->opt_note[0] ? ctx->opt_note : NULL;
+  return ctx->rewrites;
+}
+
+// 静的なサイクル数の見積もり
+// メモリアクセス 1 回にかかるサイクル数（見積もり用）
+#define MEM_CYCLES 1
+
+enum Flow {
+  kFlowNext,     // 次の命令へ進む
+  kFlowJump,     // 飛び先へ分岐する
+  kFlowCall,     // 飛び先を呼び出し、次の命令へ戻る
+  kFlowRet,      // ret, iret
+  kFlowIndirect, // 飛び先が静的に分からない分岐
+};
+
+// 基本ブロックの出口
+struct BlockExit {
+  uint8_t flow;
+  uint8_t cond;   // 最後の命令が条件付き（実行されずに次へ進むことがある）
+  uint8_t status; // 出口そのものが経路の上限を決められない理由（nlpasm_path_status）
+  int target;     // 飛び先のブロック。無ければ -1
+  int next;       // 続くブロック。コードが途切れていれば -1
+  int last_ip;    // 最後の命令のアドレス
+};
+
+struct IpIndex {
+  int ip;
+  int insn;
+};
+
+static int CompareIpIndex(const void *a, const void *b) {
+  const struct IpIndex *x = a, *y = b;
+  return x->ip != y->ip ? x->ip - y->ip : x->insn - y->insn;
+}
+
+static int IsCode(const struct nlpasm_insn *info) {
+  return info->len > 0 && !info->data;
+}
+
+// ip から始まるコードの命令。無ければ -1
+static int FindCodeAt(struct nlpasm_ctx *ctx, int ip) {
+  int lo = 0, hi = ctx->num_code;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (ctx->code_by_ip[mid].ip < ip) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo < ctx->num_code && ctx->code_by_ip[lo].ip == ip ? ctx->code_by_ip[lo].insn : -1;
+}
+
+// 入力のニブル in が即値ならその値、レジスタなら -1
+static int ImmOf(const uint16_t *w, int in) {
+  if (in == kImm8) {
+    return w[1] & 0xff;
+  } else if (in == kImm16) {
+    return w[2];
+  }
+  return -1;
+}
+
+static int InsnCycles(struct nlpasm_ctx *ctx, int i) {
+  return nlpasm_insn_cycles(ctx->words + ctx->insns[i].pos, ctx->insns[i].len);
+}
+
+// i 番目の命令が制御をどこへ移すかを調べる。飛び先のアドレスが分かれば *target に書く。
+static enum Flow DecodeFlow(struct nlpasm_ctx *ctx, int i, int *target) {
+  const struct nlpasm_insn *info = ctx->insns + i;
+  const uint16_t *w = ctx->words + info->pos;
+  uint8_t op = w[0] >> 8, out = w[0] & 0xf;
+  int is_call = (op & 0xf0) == OP_CALL;
+  *target = -1;
+  if (!is_call && out != kRegIP) {
+    return kFlowNext;
+  }
+  if (!is_call && ((op & 0xf0) == OP_RET || (op & 0xf0) == 0xe0)) {
+    return kFlowRet;
+  }
+
+  // 絶対アドレス（dir == 0）か、ip からの加算（2）・減算（1）
+  int dir = -1;
+  if (is_call) {
+    dir = op & 0x08 ? op & 0x03 : 0;
+  } else if (op == OP_MOV) {
+    dir = 0;
+  } else if (op == OP_SUB || op == OP_ADD) {
+    dir = op & 0x03;
+  }
+  int in1 = info->len >= 2 ? w[1] >> 12 : -1, in2 = info->len >= 2 ? (w[1] >> 8) & 0xf : -1;
+  if (dir == 0 && in1 >= 0) {
+    *target = ImmOf(w, in1);
+  } else if (dir > 0 && in1 == kRegIP && ImmOf(w, in2) >= 0) {
+    int d = ImmOf(w, in2);
+    *target = (info->ip + info->len + (dir == 2 ? d : -d)) & 0xffff;
+  }
+  if (*target < 0) {
+    return kFlowIndirect;
+  }
+  return is_call ? kFlowCall : kFlowJump;
+}
+
+// 命令列を基本ブロックに分ける。ラベル・分岐の飛び先を先頭とし、
+// 分岐（jmp, call, ret, iret）と条件付きの命令で終わる。
+static void BuildBlocks(struct nlpasm_ctx *ctx) {
+  if (ctx->blocks_ready) {
+    return;
+  }
+  ctx->blocks_ready = 1;
+  int n = ctx->num_insns;
+  ctx->code_by_ip = XRealloc(NULL, (n ? n : 1) * sizeof(struct IpIndex));
+  ctx->block_of = XRealloc(NULL, (n ? n : 1) * sizeof(int));
+  ctx->num_code = 0;
+  for (int i = 0; i < n; i++) {
+    ctx->block_of[i] = -1;
+    if (IsCode(ctx->insns + i)) {
+      ctx->code_by_ip[ctx->num_code].ip = ctx->insns[i].ip;
+      ctx->code_by_ip[ctx->num_code++].insn = i;
+    }
+  }
+  qsort(ctx->code_by_ip, ctx->num_code, sizeof(struct IpIndex), CompareIpIndex);
+
+  // ブロックの先頭になる命令
+  uint8_t *leader = XRealloc(NULL, n + 1);
+  memset(leader, 0, n + 1);
+  for (int i = 0; i < n; i++) {
+    struct nlpasm_insn *info = ctx->insns + i;
+    if (!IsCode(info)) {
+      leader[i + 1] = 1;
+      continue;
+    }
+    int target;
+    enum Flow flow = DecodeFlow(ctx, i, &target);
+    uint8_t cond = (ctx->words[info->pos] >> 4) & 0xf;
+    if (flow != kFlowNext || cond != FLAG_ALWAYS) {
+      leader[i + 1] = 1;
+    }
+    int t = target >= 0 ? FindCodeAt(ctx, target) : -1;
+    if (t >= 0) {
+      leader[t] = 1;
+    }
+  }
+  for (int s = 0; s < ctx->num_symbols; s++) {
+    if (ctx->symbols[s].insn_idx >= 0 && ctx->symbols[s].insn_idx < n) {
+      leader[ctx->symbols[s].insn_idx] = 1;
+    }
+  }
+
+  ctx->num_blocks = 0;
+  for (int i = 0; i < n; i++) {
+    struct nlpasm_insn *info = ctx->insns + i;
+    if (!IsCode(info)) {
+      continue;
+    }
+    if (leader[i] || i == 0) {
+      RESERVE(ctx->blocks, ctx->cap_blocks, ctx->num_blocks + 1);
+      struct nlpasm_block *b = ctx->blocks + ctx->num_blocks++;
+      b->ip = info->ip;
+      b->insn = i;
+      b->num_insns = 0;
+      b->cycles = 0;
+      b->label = NULL;
+    }
+    struct nlpasm_block *b = ctx->blocks + ctx->num_blocks - 1;
+    b->num_insns++;
+    b->cycles += InsnCycles(ctx, i);
+    ctx->block_of[i] = ctx->num_blocks - 1;
+  }
+  free(leader);
+
+  for (int s = 0; s < ctx->num_symbols; s++) {
+    struct Symbol *sym = ctx->symbols + s;
+    int idx = sym->insn_idx;
+    if (sym->anon || idx < 0 || idx >= n || ctx->block_of[idx] < 0) {
+      continue;
+    }
+    struct nlpasm_block *b = ctx->blocks + ctx->block_of[idx];
+    if (b->insn == idx && b->label == NULL) {
+      b->label = sym->name;
+    }
+  }
+
+  ctx->block_exits = XRealloc(NULL, (ctx->num_blocks ? ctx->num_blocks : 1) *
+                                    sizeof(struct BlockExit));
+  for (int k = 0; k < ctx->num_blocks; k++) {
+    struct nlpasm_block *b = ctx->blocks + k;
+    struct BlockExit *e = ctx->block_exits + k;
+    int last = b->insn + b->num_insns - 1;
+    struct nlpasm_insn *info = ctx->insns + last;
+    int target;
+    e->flow = DecodeFlow(ctx, last, &target);
+    e->cond = ((ctx->words[info->pos] >> 4) & 0xf) != FLAG_ALWAYS;
+    e->last_ip = info->ip;
+    e->status = NLPASM_PATH_OK;
+    int t = target >= 0 ? FindCodeAt(ctx, target) : -1;
+    e->target = t >= 0 ? ctx->block_of[t] : -1;
+    e->next = -1;
+    if (last + 1 < n && IsCode(info + 1) && info[1].ip == info->ip + info->len) {
+      e->next = ctx->block_of[last + 1];
+    }
+
+    if (e->flow == kFlowIndirect) {
+      e->status = NLPASM_PATH_INDIRECT;
+    } else if ((e->flow == kFlowJump || e->flow == kFlowCall) && e->target < 0) {
+      e->status = NLPASM_PATH_FALLS_OFF;
+    } else if ((e->flow == kFlowNext || e->flow == kFlowCall || e->cond) && e->next < 0) {
+      e->status = NLPASM_PATH_FALLS_OFF;
+    }
+  }
+}
+
+// root から ret/iret までの最悪のサイクル数を、root から届くブロックすべてについて求める。
+// ブロックの値はどの入口から来ても同じなので、worst などは全ルーチンで共有する。
+// 深い呼び出しやブロックの長い連なりでもスタックが溢れないよう、明示的なスタックでたどる。
+struct WorstPath {
+  int *worst;
+  uint8_t *state; // 0: 未訪問, 1: たどっている途中, 2: 確定
+  uint8_t *status;
+  int *status_ip;
+  int *stack;
+  uint8_t *dep_pos;
+};
+
+// ブロック k の値が依存するブロック（呼び出し先、飛び先、続くブロック）
+static int BlockDeps(const struct BlockExit *e, int *deps) {
+  int n = 0;
+  if ((e->flow == kFlowJump || e->flow == kFlowCall) && e->target >= 0) {
+    deps[n++] = e->target;
+  }
+  if ((e->flow == kFlowNext || e->flow == kFlowCall || e->cond) && e->next >= 0) {
+    deps[n++] = e->next;
+  }
+  return n;
+}
+
+static void ComputeWorst(struct nlpasm_ctx *ctx, struct WorstPath *wp, int root) {
+  if (wp->state[root]) {
+    return;
+  }
+  int sp = 0;
+  wp->stack[sp++] = root;
+  wp->state[root] = 1;
+  wp->dep_pos[root] = 0;
+  while (sp > 0) {
+    int k = wp->stack[sp - 1];
+    const struct BlockExit *e = ctx->block_exits + k;
+    int deps[2];
+    int nd = BlockDeps(e, deps);
+    if (wp->dep_pos[k] < nd) {
+      int d = deps[wp->dep_pos[k]++];
+      if (wp->state[d] == 0) {
+        wp->state[d] = 1;
+        wp->dep_pos[d] = 0;
+        wp->stack[sp++] = d;
+      } else if (wp->state[d] == 1 && wp->status[k] == NLPASM_PATH_OK) {
+        wp->status[k] = NLPASM_PATH_LOOP; // d からここへ戻ってくる
+        wp->status_ip[k] = e->last_ip;
+      }
+      continue;
+    }
+
+    // 依存するブロックがすべて確定した（またはループで打ち切った）
+    if (wp->status[k] == NLPASM_PATH_OK && e->status != NLPASM_PATH_OK) {
+      wp->status[k] = e->status;
+      wp->status_ip[k] = e->last_ip;
+    }
+    int callee = 0, best = 0;
+    if (e->flow == kFlowCall && e->target >= 0) { // 呼び出し先から戻ってから続きを実行する
+      callee = wp->worst[e->target];
+    } else if (e->flow == kFlowJump && e->target >= 0) {
+      best = wp->worst[e->target];
+    }
+    if ((e->flow == kFlowNext || e->flow == kFlowCall || e->cond) && e->next >= 0 &&
+        wp->worst[e->next] > best) {
+      best = wp->worst[e->next];
+    }
+    for (int i = 0; i < nd && wp->status[k] == NLPASM_PATH_OK; i++) {
+      wp->status[k] = wp->status[deps[i]];
+      wp->status_ip[k] = wp->status_ip[deps[i]];
+    }
+    wp->worst[k] = ctx->blocks[k].cycles + callee + best;
+    wp->state[k] = 2;
+    sp--;
+  }
+}
+
+int nlpasm_mark_isr(struct nlpasm_ctx *ctx, const char *name) {
+  int len = strlen(name);
+  uint32_t hash = HashName(name, len);
+  if (ctx->cap_sym_slots == 0) {
+    return -1;
+  }
+  for (int i = hash & (ctx->cap_sym_slots - 1); ctx->sym_slots[i] >= 0;
+       i = (i + 1) & (ctx->cap_sym_slots - 1)) {
+    struct Symbol *sym = ctx->symbols + ctx->sym_slots[i];
+    if (sym->hash == hash && sym->len == len && memcmp(sym->name, name, len) == 0) {
+      if (sym->ip < 0) {
+        return -1;
+      }
+      RESERVE(ctx->isr_ips, ctx->cap_isr, ctx->num_isr + 1);
+      ctx->isr_ips[ctx->num_isr++] = sym->ip;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+const struct nlpasm_block *nlpasm_get_blocks(struct nlpasm_ctx *ctx, size_t *num_blocks) {
+  BuildBlocks(ctx);
+  *num_blocks = ctx->num_blocks;
+  return ctx->blocks;
+}
+
+const struct nlpasm_routine *nlpasm_get_routines(struct nlpasm_ctx *ctx, size_t *num_routines) {
+  BuildBlocks(ctx);
+  int nb = ctx->num_blocks ? ctx->num_blocks : 1;
+
+  // 入口: call の飛び先（1）と割り込み処理ルーチン（2）
+  uint8_t *entry = XRealloc(NULL, nb);
+  memset(entry, 0, nb);
+  for (int k = 0; k < ctx->num_blocks; k++) {
+    if (ctx->block_exits[k].flow == kFlowCall && ctx->block_exits[k].target >= 0) {
+      entry[ctx->block_exits[k].target] |= 1;
+    }
+  }
+  // mov iv, 即値（ラベル）で割り込みの飛び先を設定している
+  for (int i = 0; i < ctx->num_insns; i++) {
+    struct nlpasm_insn *info = ctx->insns + i;
+    if (!IsCode(info) || info->len < 2) {
+      continue;
+    }
+    const uint16_t *w = ctx->words + info->pos;
+    if ((w[0] >> 8) == OP_MOV && (w[0] & 0xf) == kRegIV) {
+      int t = ImmOf(w, w[1] >> 12) >= 0 ? FindCodeAt(ctx, ImmOf(w, w[1] >> 12)) : -1;
+      if (t >= 0) {
+        entry[ctx->block_of[t]] |= 2;
+      }
+    }
+  }
+  for (int i = 0; i < ctx->num_isr; i++) {
+    int t = FindCodeAt(ctx, ctx->isr_ips[i]);
+    if (t >= 0) {
+      entry[ctx->block_of[t]] |= 2;
+    }
+  }
+
+  struct WorstPath wp = {
+    .worst = XRealloc(NULL, nb * sizeof(int)),
+    .state = XRealloc(NULL, nb),
+    .status = XRealloc(NULL, nb),
+    .status_ip = XRealloc(NULL, nb * sizeof(int)),
+    .stack = XRealloc(NULL, nb * sizeof(int)),
+    .dep_pos = XRealloc(NULL, nb),
+  };
+  memset(wp.worst, 0, nb * sizeof(int));
+  memset(wp.state, 0, nb);
+  memset(wp.status, 0, nb);
+
+  ctx->num_routines = 0;
+  for (int k = 0; k < ctx->num_blocks; k++) {
+    if (!entry[k]) {
+      continue;
+    }
+    ComputeWorst(ctx, &wp, k);
+    RESERVE(ctx->routines, ctx->cap_routines, ctx->num_routines + 1);
+    struct nlpasm_routine *r = ctx->routines + ctx->num_routines++;
+    r->ip = ctx->blocks[k].ip;
+    r->name = ctx->blocks[k].label;
+    r->isr = (entry[k] & 2) != 0;
+    r->cycles = wp.worst[k];
+    r->status = wp.status[k];
+    r->status_ip = r->status == NLPASM_PATH_OK ? -1 : wp.status_ip[k];
+  }
+  free(entry);
+  free(wp.worst);
+  free(wp.state);
+  free(wp.status);
+  free(wp.status_ip);
+  free(wp.stack);
+  free(wp.dep_pos);
+
+  *num_routines = ctx->num_routines;
+  return ctx->routines;
+}
+
+int nlpasm_insn_len(const uint16_t *w) {
+  switch (w[0] >> 12) {
+  case 0xc: case 0xd: case 0xe: // pop, ret, push, iret
+    return 1;
+  }
+  uint8_t in = w[1] >> 8;
+  return (in >> 4) == kImm16 || (in & 0xf) == kImm16 ? 3 : 2;
+}
+
+// フェッチするワード数とメモリアクセスの回数から見積もる。
+// スタック操作（push, pop, call, ret, iret）は 1 回のメモリアクセスと数える。
+int nlpasm_insn_cycles(const uint16_t *w, int len) {
+  uint8_t op = w[0] >> 8, out = w[0] & 0xf;
+  int mem = 0;
+  switch (op & 0xf0) {
+  case 0x80: case 0x90: // load, store
+  case 0xb0:            // call
+  case 0xc0: case 0xd0: // pop, ret, push
+  case 0xe0:            // iret
+    mem = 1;
+    break;
+  }
+  mem += out == kRegMEM;
+  if (len >= 2) {
+    mem += (w[1] >> 12) == kRegMEM;
+    mem += ((w[1] >> 8) & 0xf) == kRegMEM;
+  }
+  return len * FETCH_CYCLES_PER_WORD + mem * MEM_CYCLES;
+}
@@ -0,0 +1,290 @@
+#pragma once
+
+// NLP-16 アセンブラのライブラリインターフェース
+//
+// アセンブラの状態はすべて nlpasm_ctx に閉じているので、複数のコンテキストを
+// 同時に使える。エラーは exit せず戻り値で返し、メッセージは
+// nlpasm_get_diagnostics で取り出す。
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct nlpasm_ctx;
+
+// 命令（またはデータ）1 つ分のメタデータ
+// .origin は len が 0 の要素として並び、ip にそのアドレスを持つ。
+struct nlpasm_insn {
+  int ip;   // 先頭アドレス
+  int pos;  // イメージ（ワード列）内の先頭位置
+  int len;  // ワード数（データは 4 ワード以上にもなる）
+  int data; // .dw などで置いたデータなら 1。続けて置いたデータは 1 つにまとまる
+  int line; // ソースの行番号（1 始まり）。nlpasm_link_object でつなげたものは 0
+};
+
+struct nlpasm_ctx *nlpasm_ctx_new(void);
+void nlpasm_ctx_free(struct nlpasm_ctx *ctx);
+
+// ソースを 1 行ずつ与える。line は改行を含まなくてよく、呼び出しの間だけ有効であればよい。
+// 戻り値: 成功なら 0、エラーなら -1
+int nlpasm_assemble_line(struct nlpasm_ctx *ctx, const char *line, size_t len);
+
+// すべての行を与えた後に呼び、命令サイズの決定とラベルの解決を行う。
+// 戻り値: 成功なら 0、エラーなら -1
+int nlpasm_finish(struct nlpasm_ctx *ctx);
+
+// src 全体をアセンブルする（nlpasm_assemble_line と nlpasm_finish をまとめたもの）
+// 戻り値: 成功なら 0、エラーなら -1
+int nlpasm_assemble_buffer(struct nlpasm_ctx *ctx, const char *src, size_t len);
+
+// アセンブル結果のワード列。ワード数を *num_words に書く。
+const uint16_t *nlpasm_get_image(struct nlpasm_ctx *ctx, size_t *num_words);
+
+// 命令ごとのメタデータ。要素数を *num_insns に書く。
+const struct nlpasm_insn *nlpasm_get_insns(struct nlpasm_ctx *ctx, size_t *num_insns);
+
+// アドレスの連続したワードの並び。.origin でアドレスが飛ぶと新しいセグメントになる。
+struct nlpasm_segment {
+  uint32_t addr; // 先頭アドレス（ワード単位）
+  size_t pos;    // nlpasm_get_image のワード列内の先頭位置
+  size_t len;    // ワード数
+};
+
+// セグメントをアドレス順に並べたもの。要素数を *num_segments に書く。
+// .origin でアドレスを戻した場合は、隣り合うセグメントが重なることがある。
+// 返した配列は次にこの関数を呼ぶまで有効。
+const struct nlpasm_segment *nlpasm_get_segments(struct nlpasm_ctx *ctx, size_t *num_segments);
+
+// これまでに出たエラーメッセージ（改行区切り）。無ければ空文字列。
+const char *nlpasm_get_diagnostics(struct nlpasm_ctx *ctx);
+
+// エラーメッセージ 1 件とその場所
+struct nlpasm_diag {
+  const char *file;    // ソースか取り込んだファイルの名前。NULL なら標準入力
+  int line;            // 行番号（1 始まり）。行に結び付かないエラーは 0
+  int column;          // 桁（1 始まり、バイト単位）。分からなければ 0
+  const char *message; // 改行を含まない
+};
+
+// これまでに出たエラーを場所（ファイル名、行番号、桁）の順に並べたもの。要素数を *num_diags に書く。
+// 返した配列は次にこの関数を呼ぶまで有効（文字列はコンテキストを解放するまで有効）。
+const struct nlpasm_diag *nlpasm_get_diags(struct nlpasm_ctx *ctx, size_t *num_diags);
+
+// エラーから回復して続ける数の上限。既定は 1 で、最初のエラーで打ち切る。
+// 2 以上にすると、エラーになった行を取り消して次の行から続け、上限の数のエラーが出たら
+// 打ち切る。0 なら打ち切らない。どちらの場合も、エラーがあれば nlpasm_finish は -1 を返す。
+void nlpasm_set_max_errors(struct nlpasm_ctx *ctx, int max_errors);
+
+// エラーの上限に達して打ち切ったなら 1。以降の nlpasm_assemble_line はすぐ -1 を返す。
+int nlpasm_stopped(struct nlpasm_ctx *ctx);
+
+// 統計情報
+// 時間は nlpasm_enable_stats を呼んだときだけ測る（ナノ秒）。
+// 命令数などの集計は nlpasm_finish で行う。
+struct nlpasm_stats {
+  uint64_t ns_tokenize; // 行の分割と字句解析
+  uint64_t ns_encode;   // 符号化（行キャッシュからの再生を含む）
+  uint64_t ns_relax;    // 命令サイズの決定（-O の書き換えを含む）
+  uint64_t ns_resolve;  // バックパッチの解決
+
+  long lines;
+  long cache_hits;         // 行キャッシュから再生した行
+  long includes;           // .include で取り込んだファイル数
+  long include_hits;       // そのうち字句解析済みのキャッシュを使ったもの
+  long lowdata_saved;      // .lowdata の配置で減ったワード数
+  long insns_by_len[4];    // 命令長（1〜3 ワード）ごとの命令数
+  long data_words;         // .dw のワード数
+  long imm8, imm16;        // 即値欄を使った回数
+  long backpatches_by_type[6]; // BP_ABS, BP_ABS8, BP_ABS16, BP_IP_REL, BP_IP_REL8, BP_IP_REL16
+  long relax_passes;       // 命令サイズが決まるまでの反復回数
+  long label_lookups;      // ラベル名の検索回数
+  long label_probes;       // 検索でハッシュ表のスロットを見た回数の合計
+  long label_max_probe;    // 1 回の検索で見たスロット数の最大
+  long symbols;
+  long words;              // 出力したワード数
+};
+
+// 時間の計測を有効にする。最初の行を与える前に呼ぶこと。
+void nlpasm_enable_stats(struct nlpasm_ctx *ctx);
+
+const struct nlpasm_stats *nlpasm_get_stats(struct nlpasm_ctx *ctx);
+
+// コードサイズの助言
+// 3 ワードになった命令ごとに、伸びた理由と、直したときに減るワード数の見積もりを返す。
+enum nlpasm_advice_reason {
+  NLPASM_ADVICE_LITERAL,     // 数値リテラルが 0〜255 の範囲外
+  NLPASM_ADVICE_NEGATIVE,    // 負のリテラル。add と sub を入れ替えれば 8 ビットに収まる
+  NLPASM_ADVICE_WORD_PREFIX, // word プレフィクスを付けた値が 8 ビットに収まる
+  NLPASM_ADVICE_LABEL,       // ラベルのアドレスが 255 を超える
+  NLPASM_ADVICE_DISTANCE,    // IP 相対の距離が 255 を超える
+  NLPASM_ADVICE_TWO_IMM,     // 2 つの入力がどちらも即値
+};
+
+struct nlpasm_advice {
+  int insn;         // nlpasm_get_insns の添字
+  enum nlpasm_advice_reason reason;
+  int value;        // リテラルの値、ラベルのアドレス、または IP 相対の距離
+  const char *symbol; // ラベルが原因ならその名前、それ以外は NULL
+  int words_saved;  // 直したときに減るワード数
+  int cycles_saved; // 1 回実行するごとに減るサイクル数
+};
+
+// nlpasm_finish の後に呼ぶ。減るワード数の多い順に並べて返す。
+// 領域は ctx が所有する。
+const struct nlpasm_advice *nlpasm_get_advice(struct nlpasm_ctx *ctx, size_t *num_advice);
+
+// のぞき穴最適化
+// nlpasm_finish で命令サイズを決める前に、命令列を NLP-16 向けの短い・速い形に書き換える。
+// 書き換えた箇所は nlpasm_get_rewrites で 1 つずつ取り出せる。
+enum nlpasm_rewrite_kind {
+  NLPASM_REWRITE_SHORT_IMM, // word リテラルの値が 8 ビットに収まるので imm8 にした
+  NLPASM_REWRITE_NEGATE,    // 負のリテラルを add と sub の入れ替えで imm8 にした
+  NLPASM_REWRITE_INC,       // add ..., 1 を inc にした
+  NLPASM_REWRITE_DEC,       // sub ..., 1 を dec にした
+  NLPASM_REWRITE_TAIL_CALL, // call の直後の ret を消し、call を jmp にした
+  NLPASM_REWRITE_MOV_SELF,  // mov r, r を消した
+};
+
+struct nlpasm_rewrite {
+  int line;         // ソースの行番号
+  enum nlpasm_rewrite_kind kind;
+  int value;        // 書き換え後の即値（SHORT_IMM, NEGATE）。それ以外は 0
+  int words_saved;  // 減ったワード数
+};
+
+// 最適化を有効にする。nlpasm_finish より前に呼ぶこと。
+void nlpasm_enable_optimize(struct nlpasm_ctx *ctx);
+
+// nlpasm_finish の後に呼ぶ。書き換えを命令の順に返す。領域は ctx が所有する。
+// 命令長を変える書き換えができなかった理由があれば *note に書く（無ければ NULL）。
+const struct nlpasm_rewrite *nlpasm_get_rewrites(struct nlpasm_ctx *ctx, size_t *num_rewrites,
+                                                 const char **note);
+
+// 低位アドレスへのデータの配置
+// .lowdata（別名 .hot）から .text までのデータを、ラベルごとのかたまりに分ける。
+// nlpasm_finish は、imm8 で参照できる箇所の多いかたまりから順に、
+// アドレス 0〜255 のうちコードや .origin で置いたものが使っていない所へ詰める。
+// 置けなかったかたまりはプログラムの末尾に並べる。
+struct nlpasm_lowdata {
+  const char *symbol; // かたまりの先頭のラベル。無ければ NULL
+  int line;           // ソースの行番号
+  int addr;           // 配置したアドレス
+  int len;            // ワード数
+  int refs;           // ラベルを imm8 で参照できる箇所の数
+  int placed;         // 0〜255 に置けたら 1
+  int words_saved;    // ソースに書いた位置に置いた場合と比べて減ったワード数
+};
+
+// nlpasm_finish の後に呼ぶ。かたまりをソースの順に返す。領域は ctx が所有する。
+const struct nlpasm_lowdata *nlpasm_get_lowdata(struct nlpasm_ctx *ctx, size_t *num_lowdata);
+
+// 静的なサイクル数の見積もり
+// nlpasm_finish の後の命令列を基本ブロックに分け、命令長と命令の種類からサイクル数を見積もる。
+// サイクル数は 1 ワードのフェッチを 1 サイクル、メモリアクセス 1 回を 1 サイクルとして数える。
+struct nlpasm_block {
+  int ip;           // 先頭アドレス
+  int insn;         // 先頭の命令（nlpasm_get_insns の添字）
+  int num_insns;
+  int cycles;       // ブロック内の命令のサイクル数の合計
+  const char *label; // 先頭のラベル。無ければ NULL
+};
+
+enum nlpasm_path_status {
+  NLPASM_PATH_OK,
+  NLPASM_PATH_LOOP,      // ループか再帰があり、上限が決まらない
+  NLPASM_PATH_INDIRECT,  // 飛び先がレジスタなどで決まる分岐がある
+  NLPASM_PATH_FALLS_OFF, // ret/iret に達する前にコードの外へ出る
+};
+
+// ルーチン（call の飛び先と割り込み処理ルーチン）
+struct nlpasm_routine {
+  int ip;
+  const char *name; // 入口のラベル。無ければ NULL
+  int isr;          // 割り込み処理ルーチン（iv に設定されるか nlpasm_mark_isr で指定された）
+  int cycles;       // 入口から ret（割り込み処理ルーチンなら iret）までの最悪のサイクル数
+  enum nlpasm_path_status status; // OK 以外なら、cycles は上限の分かった部分だけの値
+  int status_ip;    // status の原因になった命令のアドレス
+};
+
+// 命令の先頭ワード w[0]（と w[1]）から命令長（1〜3 ワード）を求める。
+// push/pop/ret/iret は 1 ワード、入力に imm16 を使う命令は 3 ワード、それ以外は 2 ワード。
+int nlpasm_insn_len(const uint16_t *w);
+
+// 長さ len の命令 w のサイクル数の見積もり
+int nlpasm_insn_cycles(const uint16_t *w, int len);
+
+// ラベル name を割り込み処理ルーチンの入口として扱う。nlpasm_finish の後に呼ぶ。
+// 戻り値: 成功なら 0、name が定義されていなければ -1
+int nlpasm_mark_isr(struct nlpasm_ctx *ctx, const char *name);
+
+// 基本ブロックを命令の順に返す。nlpasm_finish の後に呼ぶ。領域は ctx が所有する。
+const struct nlpasm_block *nlpasm_get_blocks(struct nlpasm_ctx *ctx, size_t *num_blocks);
+
+// ルーチンごとの最悪経路のサイクル数を命令の順に返す。nlpasm_finish の後に呼ぶ。
+const struct nlpasm_routine *nlpasm_get_routines(struct nlpasm_ctx *ctx, size_t *num_routines);
+
+// 行キャッシュを有効にし、前回 nlpasm_cache_data で得た内容を読み込む。
+// 有効にすると、キャッシュにある行は字句解析と符号化を省いて結果を再利用する。
+// 出力はキャッシュを使わない場合と同一。最初の行を与える前に呼ぶこと。
+// data が NULL なら空のキャッシュで有効にする。
+// 戻り値: 成功なら 0、data が壊れているか形式が違うなら -1（空のキャッシュで有効になる）
+int nlpasm_cache_load(struct nlpasm_ctx *ctx, const void *data, size_t len);
+
+// 今回アセンブルした行のキャッシュを直列化したもの。長さを *len に書く。
+// 領域は ctx が所有し、次の呼び出しか nlpasm_ctx_free まで有効。
+const void *nlpasm_cache_data(struct nlpasm_ctx *ctx, size_t *len);
+
+// .include "ファイル名"
+// 相対パスは、.include を書いたファイルのディレクトリ、nlpasm_add_include_dir で加えた
+// ディレクトリの順に探す。同じファイル（デバイスと i ノードが同じもの）は 2 回目以降は
+// 取り込まない（インクルードガード）。取り込んだ行の命令の行番号は .include の行になる。
+
+// 最上位のソースのファイル名。.include の相対パスの基準になる。NULL なら標準入力
+// （カレントディレクトリが基準）。最初の行を与える前に呼ぶこと。
+void nlpasm_set_source_name(struct nlpasm_ctx *ctx, const char *path);
+
+// .include を探すディレクトリを加える（-I）
+void nlpasm_add_include_dir(struct nlpasm_ctx *ctx, const char *dir);
+
+// 取り込んだファイル（.incbin で読んだものを含む）の名前を取り込んだ順に並べたもの。
+// 要素数を *num_includes に書く。
+// 依存ファイル（-MD）の出力に使う。
+const char *const *nlpasm_get_includes(struct nlpasm_ctx *ctx, size_t *num_includes);
+
+// .incbin で読んだファイルと .string の文字を 2 バイトずつワードに詰める順。
+// 0（既定）なら先のバイトを上位に、1 なら下位に置く（-l で書き出すと元のバイト列に戻る）。
+void nlpasm_set_little_endian(struct nlpasm_ctx *ctx, int little_endian);
+
+// 字句解析済みのインクルードファイルのキャッシュ
+// ファイルの内容のハッシュで引くので、内容が同じなら別のコンテキストでも再利用する。
+// 前に取り込んだファイルの大きさと更新時刻が変わっていなければ、読み直しもしない。
+// スレッドセーフで、複数のコンテキストから同時に使える。設定しなければコンテキストごとに
+// 作る。キャッシュは、それを使うコンテキストをすべて解放してから解放すること。
+struct nlpasm_include_cache;
+struct nlpasm_include_cache *nlpasm_include_cache_new(void);
+void nlpasm_include_cache_free(struct nlpasm_include_cache *cache);
+// 取り込んだファイルの最新の内容以外の字句解析結果を解放する。
+// ファイルを書き換えながら同じキャッシュを使い続けるときに、どのコンテキストも
+// キャッシュを使っていない間に呼ぶ。
+void nlpasm_include_cache_trim(struct nlpasm_include_cache *cache);
+void nlpasm_set_include_cache(struct nlpasm_ctx *ctx, struct nlpasm_include_cache *cache);
+
+// 分割アセンブル
+// nlpasm_finish を呼ばずに nlpasm_get_object でオブジェクトファイルの内容を得る。
+// オブジェクトには命令サイズを決める前のワード列・バックパッチ・シンボルが入る。
+// .global で宣言したラベルだけが他のオブジェクトから参照できる。
+// 戻り値: オブジェクトの内容（ctx が所有し、次の呼び出しか nlpasm_ctx_free まで有効）。
+// エラーが起きていたら NULL
+const void *nlpasm_get_object(struct nlpasm_ctx *ctx, size_t *len);
+
+// オブジェクトを ctx の末尾につなげる。すべてつなげた後に nlpasm_finish を呼ぶと
+// シンボルの解決と命令サイズの決定を行い、nlpasm_get_image で最終イメージが得られる。
+// 戻り値: 成功なら 0、エラーなら -1
+int nlpasm_link_object(struct nlpasm_ctx *ctx, const void *data, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
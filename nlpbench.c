@@ -0,0 +1,306 @@
+// nlpbench: アセンブラの性能を測るベンチマーク
+//
+// 実際のプログラムに近い合成ソース（ALU 演算、load/store の各アドレッシング、
+// 前方・後方へのラベル参照、@ による IP 相対ジャンプ、.dw の表、.origin による
+// 隙間）を指定した行数だけ生成し、nlpasm で何通りかの出力形式にアセンブルして
+// 時間とピークメモリを測る。結果は 1 行 1 測定の JSON で標準出力に書く。
+//
+//   $ ./nlpbench                       既定の行数（1K〜10M）で測定
+//   $ ./nlpbench -s 1000,100000 -r 5   行数と繰り返し回数を指定
+//   $ ./nlpbench -g 100000 > big.asm   ソースを生成するだけ
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// 再現性のため、乱数は seed で決まる xorshift を使う
+static uint64_t rng_state;
+
+static uint32_t Rand(void) {
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return rng_state >> 32;
+}
+
+static int RandN(int n) {
+  return Rand() % n;
+}
+
+static const char *const alu3[] = {"add", "sub", "addc", "subc", "and", "or", "xor"};
+static const char *const alu2[] = {"inc", "dec", "not", "sll", "slr", "rol", "ror"};
+static const char *const regs[] = {"a", "b", "c", "d", "e"};
+static const char *const flags[] = {"", "", "", ".z", ".nz", ".c", ".nc", ".s"};
+
+#define NELEMS(a) ((int)(sizeof(a) / sizeof((a)[0])))
+#define REG() regs[RandN(NELEMS(regs))]
+
+// 8 行に 1 つ程度ラベルを置き、前後数個のラベルを参照する
+#define LABEL_INTERVAL 8
+
+// 命令 1 つの最大ワード数。即値やラベルの位置で長さが変わるので、.origin の位置は
+// すべての命令がこの長さだとして決める（前の命令と重ならないように）
+#define MAX_INSN_WORDS 3
+
+// ラベル番号 cur の近くのラベル名（前方・後方の両方）を buf に書く
+static const char *NearLabel(char *buf, int cur, int max) {
+  int l = cur + RandN(11) - 5;
+  if (l < 0) {
+    l = 0;
+  } else if (l > max) {
+    l = max;
+  }
+  sprintf(buf, "L%d", l);
+  return buf;
+}
+
+// 1 行分の値（レジスタか 8/16 ビット即値）
+static const char *Operand(char *buf) {
+  switch (RandN(4)) {
+  case 0:
+    sprintf(buf, "0x%x", RandN(256));
+    return buf;
+  case 1:
+    sprintf(buf, "0x%x", 256 + RandN(0xff00));
+    return buf;
+  default:
+    return REG();
+  }
+}
+
+// lines 行程度のソースを out に書く
+// 戻り値: 実際に書いた行数（最後に参照先のラベルを補うので少し多くなる）
+static long Generate(FILE *out, long lines, uint64_t seed) {
+  rng_state = seed * 2654435761u + 88172645463325252ull;
+  int max_label = lines / LABEL_INTERVAL;
+  int label = 0;
+  long addr = 0; // 現在アドレスの上限（.origin を前に進めるために使う）
+  char b1[32], b2[32], b3[32];
+
+  long i;
+  for (i = 0; i < lines; i++) {
+    if (i >= (long)label * LABEL_INTERVAL) {
+      fprintf(out, "L%d:\n", label++);
+      continue;
+    }
+
+    int r = RandN(100);
+    const char *flag = flags[RandN(NELEMS(flags))];
+    if (r < 30) {
+      fprintf(out, "    %s%s %s, %s, %s\n", alu3[RandN(NELEMS(alu3))], flag, REG(),
+              REG(), Operand(b1));
+      addr += MAX_INSN_WORDS;
+    } else if (r < 40) {
+      fprintf(out, "    %s%s %s, %s\n", alu2[RandN(NELEMS(alu2))], flag, REG(), REG());
+      addr += MAX_INSN_WORDS;
+    } else if (r < 48) {
+      fprintf(out, "    mov %s, %s\n", REG(), RandN(2) ? Operand(b1)
+                                                      : NearLabel(b1, label, max_label));
+      addr += MAX_INSN_WORDS;
+    } else if (r < 54) {
+      fprintf(out, "    load %s, %s\n", REG(), NearLabel(b1, label, max_label));
+      addr += MAX_INSN_WORDS;
+    } else if (r < 58) {
+      fprintf(out, "    load %s, sp+%d\n", REG(), RandN(16));
+      addr += MAX_INSN_WORDS;
+    } else if (r < 62) {
+      fprintf(out, "    store %s-0x%x, %s\n", REG(), RandN(0x300), REG());
+      addr += MAX_INSN_WORDS;
+    } else if (r < 65) {
+      fprintf(out, "    store %s, %s\n", NearLabel(b1, label, max_label), REG());
+      addr += MAX_INSN_WORDS;
+    } else if (r < 72) {
+      fprintf(out, "    jmp%s @%s\n", flag, NearLabel(b1, label, max_label));
+      addr += MAX_INSN_WORDS;
+    } else if (r < 75) {
+      fprintf(out, "    jmp%s %s\n", flag, NearLabel(b1, label, max_label));
+      addr += MAX_INSN_WORDS;
+    } else if (r < 78) {
+      fprintf(out, "    call @%s\n", NearLabel(b1, label, max_label));
+      addr += MAX_INSN_WORDS;
+    } else if (r < 80) {
+      fprintf(out, "    jmp%s @0x%x\n", flag, RandN(0x10000));
+      addr += MAX_INSN_WORDS;
+    } else if (r < 84) {
+      fprintf(out, "    push %s\n    pop %s\n", REG(), REG());
+      i++;
+      addr += 2 * MAX_INSN_WORDS;
+    } else if (r < 86) {
+      fprintf(out, "    ret%s\n", flag);
+      addr += MAX_INSN_WORDS;
+    } else if (r < 88) {
+      fprintf(out, "    cmp %s, %s\n", REG(), Operand(b1));
+      addr += MAX_INSN_WORDS;
+    } else if (r < 92) {
+      int n = 1 + RandN(3);
+      sprintf(b1, "0x%x", RandN(0x10000));
+      sprintf(b2, ", 0x%x", RandN(0x10000));
+      sprintf(b3, ", 0x%x", RandN(0x10000));
+      fprintf(out, "    .dw %s%s%s\n", b1, n > 1 ? b2 : "", n > 2 ? b3 : "");
+      addr += n;
+    } else if (r < 93) {
+      addr += 16 + RandN(256);
+      fprintf(out, "    .origin 0x%lx\n", addr);
+    } else if (r < 97) {
+      fprintf(out, "    # comment %ld\n", i);
+    } else {
+      fprintf(out, "\n");
+    }
+  }
+
+  // 末尾付近から参照した、まだ定義していないラベル
+  for (; label <= max_label + 5; label++, i++) {
+    fprintf(out, "L%d:\n", label);
+  }
+  fprintf(out, "    ret\n");
+  return i + 1;
+}
+
+static double Now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// 測定する出力形式
+struct Mode {
+  const char *name;
+  const char *args[4];
+};
+
+static const struct Mode modes[] = {
+  {"text", {NULL}},                 // 既定の 16 進テキスト
+  {"bin", {"-f", "bin", NULL}},     // バイナリ（出力処理の差を見る）
+  {"object", {"-c", NULL}},         // ラベルを解決しない（字句解析・符号化のみ）
+};
+
+// nlpasm を 1 回実行し、経過時間と子プロセスのピーク RSS（KiB）を返す
+static int RunOnce(const char *nlpasm, const char *src, const struct Mode *mode,
+                   double *sec, long *rss_kb) {
+  const char *argv[16] = {nlpasm};
+  int argc = 1;
+  for (int i = 0; mode->args[i]; i++) {
+    argv[argc++] = mode->args[i];
+  }
+  argv[argc++] = src;
+  argv[argc++] = "-o";
+  argv[argc++] = "/dev/null";
+  argv[argc] = NULL;
+
+  double start = Now();
+  pid_t pid = fork();
+  if (pid < 0) {
+    perror("fork");
+    return -1;
+  }
+  if (pid == 0) {
+    execv(nlpasm, (char *const *)argv);
+    perror(nlpasm);
+    _exit(127);
+  }
+  int status;
+  struct rusage ru;
+  if (wait4(pid, &status, 0, &ru) < 0) {
+    perror("wait4");
+    return -1;
+  }
+  *sec = Now() - start;
+  *rss_kb = ru.ru_maxrss;
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+int main(int argc, char **argv) {
+  const char *nlpasm = "./nlpasm";
+  const char *sizes = "1000,10000,100000,1000000,10000000";
+  const char *tmpdir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+  int repeat = 3;
+  long gen_lines = -1;
+  uint64_t seed = 1;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-a") == 0 && i + 1 < argc) {
+      nlpasm = argv[++i];
+    } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+      sizes = argv[++i];
+    } else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+      repeat = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-g") == 0 && i + 1 < argc) {
+      gen_lines = atol(argv[++i]);
+    } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+      seed = strtoull(argv[++i], NULL, 0);
+    } else {
+      fprintf(stderr, "usage: nlpbench [-a nlpasm] [-s lines,...] [-r repeat] [--seed n]\n"
+                      "       nlpbench -g lines [--seed n] > out.asm\n");
+      return 1;
+    }
+  }
+
+  if (gen_lines >= 0) {
+    Generate(stdout, gen_lines, seed);
+    return 0;
+  }
+  if (repeat < 1) {
+    repeat = 1;
+  }
+
+  char src[4096];
+  snprintf(src, sizeof(src), "%s/nlpbench-%d.asm", tmpdir, (int)getpid());
+  int failed = 0;
+  for (const char *p = sizes; *p; ) {
+    char *end;
+    long lines = strtol(p, &end, 0);
+    if (end == p) {
+      break;
+    }
+    p = *end == ',' ? end + 1 : end;
+
+    FILE *fp = fopen(src, "w");
+    if (fp == NULL) {
+      perror(src);
+      return 1;
+    }
+    lines = Generate(fp, lines, seed);
+    fclose(fp);
+    struct stat st;
+    stat(src, &st);
+
+    for (int m = 0; m < NELEMS(modes); m++) {
+      // 最短時間を採る（ページキャッシュなどの揺らぎを除く）
+      double best = -1;
+      long rss = 0;
+      int ok = 1;
+      for (int r = 0; r < repeat && ok; r++) {
+        double sec;
+        long rss_kb;
+        ok = RunOnce(nlpasm, src, modes + m, &sec, &rss_kb) == 0;
+        if (best < 0 || sec < best) {
+          best = sec;
+        }
+        if (rss_kb > rss) {
+          rss = rss_kb;
+        }
+      }
+      if (!ok) {
+        fprintf(stderr, "nlpbench: %s failed on %ld lines (mode %s)\n",
+                nlpasm, lines, modes[m].name);
+        failed = 1;
+        continue;
+      }
+      printf("{\"lines\": %ld, \"bytes\": %lld, \"mode\": \"%s\", \"seconds\": %.6f, "
+             "\"lines_per_sec\": %.0f, \"bytes_per_sec\": %.0f, \"peak_rss_kb\": %ld}\n",
+             lines, (long long)st.st_size, modes[m].name, best,
+             lines / best, st.st_size / best, rss);
+      fflush(stdout);
+    }
+  }
+  unlink(src);
+  return failed;
+}
@@ -0,0 +1,82 @@
+// nlplink: nlpasm -c が出力したオブジェクトファイルをつなげて最終イメージを作る
+//
+// オブジェクトはコマンドラインの順に並べる。.origin の無いオブジェクトは
+// 直前のオブジェクトの続きのアドレスに置かれる。
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cli.h"
+#include "nlpasm.h"
+
+int main(int argc, char **argv) {
+  struct Options opt = { .outfmt = kFmtText };
+  const char *outfile_name = NULL;
+  struct nlpasm_ctx *ctx = nlpasm_ctx_new();
+  int num_objs = 0;
+  for (int i = 1; i < argc; i++) {
+    int parsed = ParseOutputOption(&opt, argc, argv, &i);
+    if (parsed < 0) {
+      return 1;
+    } else if (parsed) {
+      continue;
+    } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+      outfile_name = argv[++i];
+    } else if (strcmp(argv[i], "-O") == 0) {
+      nlpasm_enable_optimize(ctx);
+      opt.optimize = 1;
+    } else if (argv[i][0] != '-') {
+      struct Reader r;
+      if (OpenReader(&r, argv[i]) < 0) {
+        perror(argv[i]);
+        nlpasm_ctx_free(ctx);
+        return 1;
+      }
+      // オブジェクトは通常ファイルなのでメモリマップされている
+      int err = nlpasm_link_object(ctx, r.buf, r.len);
+      CloseReader(&r);
+      if (err) {
+        fprintf(stderr, "%s: %s", argv[i], nlpasm_get_diagnostics(ctx));
+        nlpasm_ctx_free(ctx);
+        return 1;
+      }
+      num_objs++;
+    }
+  }
+
+  if (num_objs == 0) {
+    fprintf(stderr, "usage: nlplink [-d] [-b] [-l] [-f format] [--fill word] [--emit format=path]... "
+                    "[-O] [-o out] a.o b.o ...\n");
+    nlpasm_ctx_free(ctx);
+    return 1;
+  }
+  if (nlpasm_finish(ctx)) {
+    fputs(nlpasm_get_diagnostics(ctx), stderr);
+    nlpasm_ctx_free(ctx);
+    return 1;
+  }
+
+  int outfd = OpenOutput(outfile_name);
+  if (outfd < 0) {
+    perror("failed to open output file");
+    nlpasm_ctx_free(ctx);
+    return 1;
+  }
+  struct Writer outfile;
+  OpenWriter(&outfile, outfd);
+  int err = WriteImage(&outfile, ctx, &opt);
+  if (CloseWriter(&outfile) < 0) {
+    err = -1;
+  }
+  if (!err) {
+    err = WriteEmits(ctx, &opt);
+  }
+  if (opt.optimize) {
+    PrintRewrites(stderr, ctx, "nlplink");
+  }
+  PrintLowData(stderr, ctx, "nlplink");
+  nlpasm_ctx_free(ctx);
+  free(opt.emits);
+  return err != 0;
+}
@@ -0,0 +1,565 @@
+// nlpsim: NLP-16 の命令セットシミュレータ
+//
+// nlpasm が出力したイメージ（16 進テキストか -f bin）をアドレス 0 から読み込んで実行し、
+// 実行した命令数・サイクル数と、アドレスごとの実行回数・サイクル数のプロファイルを出す。
+// 命令は初めて実行するときにデコードして覚えておき（store で書き換えられたら捨てる）、
+// 以降はデコード済みの命令を computed goto で直接実行する。
+//
+//   $ ./nlpsim prog.txt                停止するまで実行してレジスタを表示
+//   $ ./nlpsim -f bin -l prog.bin      リトルエンディアンのバイナリイメージ
+//   $ ./nlpsim --profile=10 prog.txt   サイクル数の多い 10 命令を表示
+//   $ ./nlpsim --irq 1000 prog.txt     1000 サイクルごとに割り込みを入れる
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cli.h"
+#include "nlpasm.h"
+
+#define MEM_WORDS 65536
+
+enum {
+  kRegIR1, kRegIR2, kRegIR3, kRegFLAG,
+  kRegIV,  kRegA,   kRegB,   kRegC,
+  kRegD,   kRegE,   kRegMEM, kRegBANK,
+  kRegADDR, kRegIP, kRegSP,  kRegZR,
+  kSlotImm8,  // デコード済み命令の imm8 を置く場所（入力のニブル 1 が指す）
+  kSlotImm16, // 同じく imm16（入力のニブル 2 が指す）
+  kNumSlots,
+};
+
+// flag レジスタのビット
+// 条件 n（isa.def の FLAG）は、n が偶数ならビット (n / 2 - 1) が立っているとき、
+// 奇数なら立っていないときに成り立つ。0 (nop) は常に不成立、1 は常に成立。
+#define FLAG_C 0x01 // 桁上がり（減算では借り）
+#define FLAG_V 0x02 // 符号付きのオーバーフロー
+#define FLAG_Z 0x04 // 結果が 0
+#define FLAG_S 0x08 // 結果が負
+#define FLAG_B 0x10 // 符号付きで小さい（S xor V）
+#define NUM_FLAG_BITS 5
+
+enum Handler {
+  kHInvalid,
+  kHMov, kHAdd, kHSub, kHAddc, kHSubc, kHInc, kHDec, kHIncc, kHDecc,
+  kHAnd, kHOr, kHXor, kHNot, kHSll, kHSlr, kHRol, kHRor,
+  kHLoad, kHStore, kHCall, kHPush, kHPop, kHIret,
+};
+
+// 命令名から実行ルーチンへの対応。オペコードは isa.def から引く。
+static const struct {
+  const char *name;
+  enum Handler h;
+} handler_names[] = {
+  {"mov", kHMov}, {"add", kHAdd}, {"sub", kHSub}, {"addc", kHAddc}, {"subc", kHSubc},
+  {"inc", kHInc}, {"dec", kHDec}, {"incc", kHIncc}, {"decc", kHDecc},
+  {"and", kHAnd}, {"or", kHOr}, {"xor", kHXor}, {"not", kHNot},
+  {"sll", kHSll}, {"sal", kHSll}, {"slr", kHSlr}, {"sar", kHSlr},
+  {"rol", kHRol}, {"ror", kHRor},
+  {"load", kHLoad}, {"store", kHStore}, {"call", kHCall},
+  {"push", kHPush}, {"pop", kHPop}, {"iret", kHIret},
+};
+
+static const struct {
+  const char *name;
+  uint8_t op, op_rel;
+} isa[] = {
+#define MNEMONIC(name, op, op_rel, enc) {name, op, op_rel},
+#include "isa.def"
+};
+
+static uint8_t handler_of[256];
+static const char *op_names[256];
+static uint32_t cond_ok[16]; // 条件ごとに、成り立つ flag の値（下位 5 ビット）の集合
+
+// デコード済みの命令
+struct Decoded {
+  uint8_t valid;
+  uint8_t handler;
+  uint8_t len, cycles;
+  uint8_t cond, out, in1, in2; // in1, in2 はレジスタ番号か kSlotImm8/kSlotImm16
+  uint8_t dir;       // アドレス計算: 0 なら in1、1 なら in1 - in2、2 なら in1 + in2
+  uint8_t mem_read;  // 実行前に mem レジスタ（addr が指すワード）を読む
+  uint8_t set_flags; // 演算結果で flag を更新する
+  uint16_t imm8, imm16;
+};
+
+struct Sim {
+  uint16_t r[kNumSlots];
+  uint16_t ip;
+  uint16_t mem[MEM_WORDS];
+  struct Decoded dec[MEM_WORDS];
+  uint64_t count[MEM_WORDS]; // アドレスごとの実行回数
+  uint64_t insns, cycles;
+  uint64_t max_insns;
+  uint64_t irq_period, next_irq; // irq_period が 0 なら割り込みを入れない
+  int in_isr;
+  const char *stop_reason;
+  int invalid; // 不正な命令で止まった
+};
+
+static void InitTables(void) {
+  for (size_t i = 0; i < sizeof(isa) / sizeof(isa[0]); i++) {
+    enum Handler h = kHInvalid;
+    for (size_t j = 0; j < sizeof(handler_names) / sizeof(handler_names[0]); j++) {
+      if (strcmp(isa[i].name, handler_names[j].name) == 0) {
+        h = handler_names[j].h;
+      }
+    }
+    if (h == kHInvalid) { // jmp, ret, cmp などは別名（mov, pop, sub）
+      continue;
+    }
+    if (handler_of[isa[i].op] == kHInvalid) {
+      handler_of[isa[i].op] = h;
+      op_names[isa[i].op] = isa[i].name;
+    }
+    // IP 相対・レジスタ相対の形式（op_rel | 方向）
+    for (int dir = 1; isa[i].op_rel && dir <= 2; dir++) {
+      if (handler_of[isa[i].op_rel | dir] == kHInvalid) {
+        handler_of[isa[i].op_rel | dir] = h;
+        op_names[isa[i].op_rel | dir] = isa[i].name;
+      }
+    }
+  }
+
+  for (int c = 0; c < 16; c++) {
+    for (uint32_t f = 0; f < (1u << NUM_FLAG_BITS); f++) {
+      int ok;
+      if (c == 1) {
+        ok = 1;
+      } else if (c >= 2 && c < 2 + 2 * NUM_FLAG_BITS) {
+        int set = (f >> (c / 2 - 1)) & 1;
+        ok = c % 2 == 0 ? set : !set;
+      } else {
+        ok = 0;
+      }
+      cond_ok[c] |= (uint32_t)ok << f;
+    }
+  }
+}
+
+static void Decode(struct Sim *s, uint16_t ip) {
+  uint16_t w[3] = {s->mem[ip], s->mem[(uint16_t)(ip + 1)], s->mem[(uint16_t)(ip + 2)]};
+  struct Decoded *d = s->dec + ip;
+  uint8_t op = w[0] >> 8;
+  d->valid = 1;
+  d->handler = handler_of[op];
+  d->len = nlpasm_insn_len(w);
+  d->cycles = nlpasm_insn_cycles(w, d->len);
+  d->cond = (w[0] >> 4) & 0xf;
+  d->out = w[0] & 0xf;
+  d->in1 = d->len >= 2 ? w[1] >> 12 : kRegZR;
+  d->in2 = d->len >= 2 ? (w[1] >> 8) & 0xf : kRegZR;
+  d->imm8 = d->len >= 2 ? w[1] & 0xff : 0;
+  d->imm16 = d->len >= 3 ? w[2] : 0;
+  if (d->in1 == 1 || d->in1 == 2) {
+    d->in1 = d->in1 == 1 ? kSlotImm8 : kSlotImm16;
+  }
+  if (d->in2 == 1 || d->in2 == 2) {
+    d->in2 = d->in2 == 1 ? kSlotImm8 : kSlotImm16;
+  }
+  d->dir = (op & 0x08) ? op & 0x03 : 0;
+
+  // store と push は out を読む
+  int reads_out = d->handler == kHStore || d->handler == kHPush;
+  d->mem_read = d->in1 == kRegMEM || d->in2 == kRegMEM || (reads_out && d->out == kRegMEM);
+  d->set_flags = d->handler >= kHAdd && d->handler <= kHRor && d->out != kRegIP;
+}
+
+// ワードを書く。命令を書き換えたかもしれないので、そこを含みうるデコード結果を捨てる。
+static inline void StoreWord(struct Sim *s, uint16_t addr, uint16_t v) {
+  s->mem[addr] = v;
+  s->dec[addr].valid = 0;
+  s->dec[(uint16_t)(addr - 1)].valid = 0;
+  s->dec[(uint16_t)(addr - 2)].valid = 0;
+}
+
+static inline uint16_t AddFlags(uint32_t a, uint32_t b, uint32_t v) {
+  uint16_t f = (v >> 16) & FLAG_C;
+  f |= (~(a ^ b) & (a ^ v) & 0x8000) ? FLAG_V : 0;
+  return f;
+}
+
+static inline uint16_t SubFlags(uint32_t a, uint32_t b, uint32_t v) {
+  uint16_t f = (v >> 16) ? FLAG_C : 0; // 借りがあれば上位が 1 になる
+  f |= ((a ^ b) & (a ^ v) & 0x8000) ? FLAG_V : 0;
+  return f;
+}
+
+// 結果 v から Z, S, B を加える
+static inline uint16_t ResultFlags(uint16_t f, uint32_t v) {
+  f |= (v & 0xffff) == 0 ? FLAG_Z : 0;
+  f |= (v & 0x8000) ? FLAG_S : 0;
+  f |= (!(f & FLAG_S) != !(f & FLAG_V)) ? FLAG_B : 0;
+  return f;
+}
+
+static void Run(struct Sim *s) {
+  static void *const labels[] = {
+    [kHInvalid] = &&op_invalid,
+    [kHMov] = &&op_mov, [kHAdd] = &&op_add, [kHSub] = &&op_sub,
+    [kHAddc] = &&op_addc, [kHSubc] = &&op_subc, [kHInc] = &&op_inc, [kHDec] = &&op_dec,
+    [kHIncc] = &&op_incc, [kHDecc] = &&op_decc, [kHAnd] = &&op_and, [kHOr] = &&op_or,
+    [kHXor] = &&op_xor, [kHNot] = &&op_not, [kHSll] = &&op_sll, [kHSlr] = &&op_slr,
+    [kHRol] = &&op_rol, [kHRor] = &&op_ror, [kHLoad] = &&op_load, [kHStore] = &&op_store,
+    [kHCall] = &&op_call, [kHPush] = &&op_push, [kHPop] = &&op_pop, [kHIret] = &&op_iret,
+  };
+  uint16_t *r = s->r;
+  uint16_t *mem = s->mem;
+  uint16_t ip = s->ip;
+  uint64_t insns = s->insns, cycles = s->cycles;
+  uint64_t next_irq = s->irq_period ? s->next_irq : UINT64_MAX;
+  const struct Decoded *d;
+  uint32_t a, b, v;
+  uint16_t f;
+
+next:
+  if (insns >= s->max_insns) {
+    s->stop_reason = "instruction limit reached";
+    goto stop;
+  }
+  if (cycles >= next_irq) {
+    next_irq += s->irq_period;
+    if (r[kRegIV] && !s->in_isr) { // flag と戻り先を積んで iv へ飛ぶ
+      StoreWord(s, --r[kRegSP], r[kRegFLAG]);
+      StoreWord(s, --r[kRegSP], ip);
+      ip = r[kRegIV];
+      s->in_isr = 1;
+    }
+  }
+  d = s->dec + ip;
+  if (!d->valid) {
+    Decode(s, ip);
+  }
+  insns++;
+  cycles += d->cycles;
+  s->count[ip]++;
+  r[kRegIP] = ip + d->len; // 実行中の命令からは ip は次の命令を指す
+  if (!((cond_ok[d->cond] >> (r[kRegFLAG] & 0x1f)) & 1)) {
+    ip = r[kRegIP];
+    goto next;
+  }
+  r[kSlotImm8] = d->imm8;
+  r[kSlotImm16] = d->imm16;
+  if (d->mem_read) {
+    r[kRegMEM] = mem[r[kRegADDR]];
+  }
+  a = r[d->in1];
+  b = r[d->in2];
+  goto *labels[d->handler];
+
+op_mov:
+  v = a;
+  goto write;
+op_add:
+  v = a + b;
+  f = AddFlags(a, b, v);
+  goto write_alu;
+op_sub:
+  v = a - b;
+  f = SubFlags(a, b, v);
+  goto write_alu;
+op_addc:
+  v = a + b + (r[kRegFLAG] & FLAG_C);
+  f = AddFlags(a, b, v);
+  goto write_alu;
+op_subc:
+  v = a - b - (r[kRegFLAG] & FLAG_C);
+  f = SubFlags(a, b, v);
+  goto write_alu;
+op_inc:
+  v = a + 1;
+  f = AddFlags(a, 1, v);
+  goto write_alu;
+op_dec:
+  v = a - 1;
+  f = SubFlags(a, 1, v);
+  goto write_alu;
+op_incc:
+  v = a + (r[kRegFLAG] & FLAG_C);
+  f = AddFlags(a, 0, v);
+  goto write_alu;
+op_decc:
+  v = a - (r[kRegFLAG] & FLAG_C);
+  f = SubFlags(a, 0, v);
+  goto write_alu;
+op_and:
+  v = a & b;
+  f = 0;
+  goto write_alu;
+op_or:
+  v = a | b;
+  f = 0;
+  goto write_alu;
+op_xor:
+  v = a ^ b;
+  f = 0;
+  goto write_alu;
+op_not:
+  v = ~a & 0xffff;
+  f = 0;
+  goto write_alu;
+op_sll:
+  v = (a << 1) & 0xffff;
+  f = (a >> 15) & FLAG_C;
+  goto write_alu;
+op_slr:
+  v = a >> 1;
+  f = a & FLAG_C;
+  goto write_alu;
+op_rol:
+  v = ((a << 1) | (a >> 15)) & 0xffff;
+  f = (a >> 15) & FLAG_C;
+  goto write_alu;
+op_ror:
+  v = ((a >> 1) | (a << 15)) & 0xffff;
+  f = a & FLAG_C;
+  goto write_alu;
+
+op_load:
+  v = mem[(uint16_t)(d->dir == 0 ? a : d->dir == 2 ? a + b : a - b)];
+  goto write;
+op_store:
+  StoreWord(s, d->dir == 0 ? a : d->dir == 2 ? a + b : a - b, r[d->out]);
+  ip = r[kRegIP];
+  goto next;
+op_call:
+  v = (uint16_t)(d->dir == 0 ? a : d->dir == 2 ? a + b : a - b);
+  StoreWord(s, --r[kRegSP], r[kRegIP]);
+  ip = v;
+  goto next;
+op_push:
+  StoreWord(s, --r[kRegSP], r[d->out]);
+  ip = r[kRegIP];
+  goto next;
+op_pop:
+  v = mem[r[kRegSP]++];
+  goto write;
+op_iret:
+  ip = mem[r[kRegSP]++];
+  r[kRegFLAG] = mem[r[kRegSP]++];
+  s->in_isr = 0;
+  goto next;
+op_invalid:
+  s->stop_reason = "invalid instruction";
+  s->invalid = 1;
+  goto stop;
+
+write_alu:
+  if (d->set_flags) {
+    r[kRegFLAG] = ResultFlags(f, v);
+  }
+write:
+  v &= 0xffff;
+  if (d->out == kRegIP) {
+    // 自分自身への無条件ジャンプで停止する（割り込みを待つ場合を除く）
+    if (v == ip && d->cond == 1 && !(s->irq_period && r[kRegIV])) {
+      s->stop_reason = "jump to self";
+      goto stop;
+    }
+    ip = v;
+    goto next;
+  }
+  if (d->out == kRegMEM) {
+    StoreWord(s, r[kRegADDR], v);
+  } else {
+    r[d->out] = v;
+    r[kRegZR] = 0;
+  }
+  ip = r[kRegIP];
+  goto next;
+
+stop:
+  s->ip = ip;
+  s->insns = insns;
+  s->cycles = cycles;
+  s->next_irq = next_irq;
+}
+
+// イメージを読み込む。バイナリは 2 バイトを 1 ワードとして読む。
+// テキストは 4 桁の 16 進数を 1 ワード、2 桁を 1 バイト（-b の出力）として読み、
+// ';' 以降は読み飛ばす。':' で終わるもの（-d のアドレス）があれば、続くワードをその
+// アドレスから置く。アドレスの無いテキストは 0 から隙間なく置くので、.origin を使う
+// プログラムは -d か -f bin で出力したものを読ませること。
+// 戻り値: 最後に読み込んだワードの次のアドレス、失敗なら -1
+static long LoadImage(struct Sim *s, const char *path, const struct Options *opt) {
+  const char *name = path ? path : "stdin";
+  long n = 0;
+  uint8_t bytes[2];
+  int have_byte = 0;
+  if (opt->outfmt == kFmtBin) {
+    FILE *fp = path ? fopen(path, "rb") : stdin;
+    if (fp == NULL) {
+      perror(name);
+      return -1;
+    }
+    while (n < MEM_WORDS && fread(bytes, 1, 2, fp) == 2) {
+      s->mem[n++] = opt->little ? bytes[0] | bytes[1] << 8 : bytes[0] << 8 | bytes[1];
+    }
+    if (fp != stdin) {
+      fclose(fp);
+    }
+    return n;
+  }
+
+  struct Reader r;
+  if (OpenReader(&r, path) < 0) {
+    perror(name);
+    return -1;
+  }
+  const char *line;
+  int len;
+  while (n < MEM_WORDS && ReadLine(&r, &line, &len)) {
+    const char *p = line, *end = line + len;
+    while (n < MEM_WORDS && p < end && *p != ';') {
+      if (isspace((unsigned char)*p)) {
+        p++;
+        continue;
+      }
+      const char *q = p;
+      while (q < end && isxdigit((unsigned char)*q)) {
+        q++;
+      }
+      if (q < end && *q == ':') { // -d のアドレスの欄。.origin で飛んだ先もその位置に読む
+        unsigned long addr = strtoul(p, NULL, 16);
+        if (q == p || addr >= MEM_WORDS) {
+          fprintf(stderr, "%s: address out of range: '%.*s'\n", name, len, line);
+          CloseReader(&r);
+          return -1;
+        }
+        n = addr;
+        have_byte = 0;
+        p = q + 1;
+        continue;
+      }
+      if (q - p != 2 && q - p != 4) {
+        fprintf(stderr, "%s: not an image: '%.*s'\n", name, len, line);
+        CloseReader(&r);
+        return -1;
+      }
+      unsigned v = strtoul(p, NULL, 16);
+      if (q - p == 4) {
+        s->mem[n++] = v;
+      } else {
+        bytes[have_byte++] = v;
+        if (have_byte == 2) {
+          s->mem[n++] = opt->little ? bytes[0] | bytes[1] << 8 : bytes[0] << 8 | bytes[1];
+          have_byte = 0;
+        }
+      }
+      p = q;
+    }
+  }
+  CloseReader(&r);
+  return n;
+}
+
+// プロファイルの 1 行
+struct ProfileEntry {
+  uint16_t ip;
+  uint64_t cycles;
+};
+
+static int CompareProfile(const void *a, const void *b) {
+  const struct ProfileEntry *x = a, *y = b;
+  if (x->cycles != y->cycles) {
+    return x->cycles < y->cycles ? 1 : -1;
+  }
+  return x->ip - y->ip;
+}
+
+// サイクル数の多いアドレスから top 個を表示する
+static void PrintProfile(struct Sim *s, int top) {
+  struct ProfileEntry *e = XRealloc(NULL, MEM_WORDS * sizeof(struct ProfileEntry));
+  int n = 0;
+  for (int i = 0; i < MEM_WORDS; i++) {
+    if (s->count[i]) {
+      if (!s->dec[i].valid) { // 書き換えられた命令は今の内容で数える
+        Decode(s, i);
+      }
+      e[n].ip = i;
+      e[n++].cycles = s->count[i] * s->dec[i].cycles;
+    }
+  }
+  qsort(e, n, sizeof(struct ProfileEntry), CompareProfile);
+  printf("# profile: address, count, cycles, %% of cycles, instruction\n");
+  for (int i = 0; i < n && i < top; i++) {
+    const struct Decoded *d = s->dec + e[i].ip;
+    const char *name = op_names[s->mem[e[i].ip] >> 8];
+    if (d->out == kRegIP && (d->handler == kHMov || d->handler == kHAdd || d->handler == kHSub)) {
+      name = "jmp";
+    } else if (d->out == kRegIP && d->handler == kHPop) {
+      name = "ret";
+    }
+    printf("%04X %12llu %12llu %6.2f%%  %s%s %s\n", e[i].ip,
+           (unsigned long long)s->count[e[i].ip], (unsigned long long)e[i].cycles,
+           s->cycles ? e[i].cycles * 100.0 / s->cycles : 0.0,
+           name ? name : "?", flag_names[d->cond], reg_names[d->out]);
+  }
+  free(e);
+}
+
+int main(int argc, char **argv) {
+  struct Options opt = { .outfmt = kFmtText };
+  const char *infile_name = NULL;
+  int profile = 0;
+  struct Sim *s = XRealloc(NULL, sizeof(struct Sim));
+  memset(s, 0, sizeof(*s));
+  s->max_insns = 1000000000;
+  for (int i = 1; i < argc; i++) {
+    int parsed = ParseOutputOption(&opt, argc, argv, &i);
+    if (parsed < 0) {
+      return 1;
+    } else if (parsed) {
+      continue;
+    } else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+      s->max_insns = strtoull(argv[++i], NULL, 0);
+    } else if (strcmp(argv[i], "--irq") == 0 && i + 1 < argc) {
+      s->irq_period = s->next_irq = strtoull(argv[++i], NULL, 0);
+    } else if (strcmp(argv[i], "--profile") == 0) {
+      profile = 20;
+    } else if (strncmp(argv[i], "--profile=", 10) == 0) {
+      profile = atoi(argv[i] + 10);
+    } else if (argv[i][0] != '-') {
+      infile_name = argv[i];
+    } else {
+      fprintf(stderr, "usage: nlpsim [-f text|bin] [-l] [-n max_insns] [--irq cycles] "
+                      "[--profile[=N]] image\n");
+      free(s);
+      return 1;
+    }
+  }
+
+  if (opt.outfmt != kFmtText && opt.outfmt != kFmtBin) {
+    fprintf(stderr, "nlpsim reads text or bin images, not %s\n", FormatName(opt.outfmt));
+    free(s);
+    return 1;
+  }
+
+  InitTables();
+  if (LoadImage(s, infile_name, &opt) < 0) {
+    free(s);
+    return 1;
+  }
+
+  uint64_t t0 = NowNs();
+  Run(s);
+  double sec = (NowNs() - t0) * 1e-9;
+
+  printf("stopped at %04X: %s\n", s->ip, s->stop_reason);
+  printf("instructions %llu, cycles %llu, %.3f s (%.1f M instructions/s)\n",
+         (unsigned long long)s->insns, (unsigned long long)s->cycles, sec,
+         sec > 0 ? s->insns / sec * 1e-6 : 0.0);
+  for (int i = 0; i < 16; i++) {
+    printf("%s%s=%04X", i ? " " : "", reg_names[i], s->r[i]);
+  }
+  printf("\n");
+  if (profile) {
+    PrintProfile(s, profile);
+  }
+  int failed = s->invalid;
+  free(s);
+  return failed;
+}
@@ -0,0 +1,444 @@
+#include "serve.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdio_ext.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cli.h"
+
+// 依頼の先頭。続けて len バイトの「カレントディレクトリ\0引数 0\0引数 1\0...」を送る。
+// 標準入力・標準出力・標準エラー出力のファイルディスクリプタはこの部分に付けて送る。
+// サーバーは処理を終えると終了コードを int32_t で返す。
+struct Request {
+  char magic[4];
+  uint32_t argc;
+  uint32_t len;
+};
+
+static const char kMagic[4] = {'N', 'L', 'P', '1'};
+
+// 依頼の本体の上限（引数の長さの合計）
+#define MAX_REQUEST_LEN (16 << 20)
+
+// 依頼を受け取る間、またはその終了コードを返す間にこれ以上止まった接続は切る（秒）
+#define REQUEST_TIMEOUT 10
+
+// ワーカーが accept できなくなって止まったときの終了コード（再起動しない）
+#define WORKER_STOPPED 3
+
+// 前の依頼で入力ファイルをアセンブルしたときの行キャッシュ
+struct WarmCache {
+  char *path; // 絶対パス
+  void *data;
+  size_t len;
+};
+
+// 依頼をまたいで保つ状態。サーバーでなければ NULL
+// バッチモードではワーカースレッドから使うので lock で守る。
+static struct ServeState {
+  struct nlpasm_include_cache *include_cache;
+  pthread_mutex_t lock;
+  struct WarmCache *caches;
+  int num_caches;
+} *serving;
+
+struct nlpasm_include_cache *ServeIncludeCache(void) {
+  return serving ? serving->include_cache : NULL;
+}
+
+static struct WarmCache *FindWarmCache(const char *path) {
+  for (int i = 0; i < serving->num_caches; i++) {
+    if (strcmp(serving->caches[i].path, path) == 0) {
+      return serving->caches + i;
+    }
+  }
+  return NULL;
+}
+
+void ServeLoadCache(struct nlpasm_ctx *ctx, const char *path) {
+  char *abs = serving ? realpath(path, NULL) : NULL;
+  if (abs == NULL) {
+    return;
+  }
+  pthread_mutex_lock(&serving->lock);
+  struct WarmCache *c = FindWarmCache(abs);
+  nlpasm_cache_load(ctx, c ? c->data : NULL, c ? c->len : 0);
+  pthread_mutex_unlock(&serving->lock);
+  free(abs);
+}
+
+void ServeSaveCache(struct nlpasm_ctx *ctx, const char *path) {
+  char *abs = serving ? realpath(path, NULL) : NULL;
+  if (abs == NULL) {
+    return;
+  }
+  size_t len;
+  const void *data = nlpasm_cache_data(ctx, &len);
+  void *copy = XRealloc(NULL, len ? len : 1);
+  memcpy(copy, data, len);
+
+  pthread_mutex_lock(&serving->lock);
+  struct WarmCache *c = FindWarmCache(abs);
+  if (c) {
+    free(abs);
+    free(c->data);
+  } else {
+    serving->caches = XRealloc(serving->caches,
+                               sizeof(struct WarmCache) * (serving->num_caches + 1));
+    c = serving->caches + serving->num_caches++;
+    c->path = abs;
+  }
+  c->data = copy;
+  c->len = len;
+  pthread_mutex_unlock(&serving->lock);
+}
+
+static int ReadFull(int fd, void *buf, size_t len) {
+  for (size_t done = 0; done < len; ) {
+    ssize_t n = read(fd, (char *)buf + done, len - done);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n <= 0) {
+      return -1;
+    }
+    done += n;
+  }
+  return 0;
+}
+
+static int WriteFull(int fd, const void *buf, size_t len) {
+  for (size_t done = 0; done < len; ) {
+    ssize_t n = write(fd, (const char *)buf + done, len - done);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n < 0) {
+      return -1;
+    }
+    done += n;
+  }
+  return 0;
+}
+
+static int Connect(const char *path) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+int RunClient(const char *path, int argc, char **argv) {
+  char cwd[PATH_MAX];
+  if (getcwd(cwd, sizeof(cwd)) == NULL) {
+    return -1;
+  }
+  int fd = Connect(path);
+  if (fd < 0) {
+    return -1;
+  }
+
+  size_t len = strlen(cwd) + 1;
+  for (int i = 0; i < argc; i++) {
+    len += strlen(argv[i]) + 1;
+  }
+  char *body = XRealloc(NULL, len);
+  char *p = stpcpy(body, cwd) + 1;
+  for (int i = 0; i < argc; i++) {
+    p = stpcpy(p, argv[i]) + 1;
+  }
+
+  // 先頭に標準入出力のファイルディスクリプタを付ける
+  struct Request req = {.argc = argc, .len = len};
+  memcpy(req.magic, kMagic, sizeof(kMagic));
+  struct iovec iov = {&req, sizeof(req)};
+  int fds[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(fds))];
+  } control;
+  struct msghdr msg = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = control.buf,
+    .msg_controllen = sizeof(control.buf),
+  };
+  struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+  cm->cmsg_level = SOL_SOCKET;
+  cm->cmsg_type = SCM_RIGHTS;
+  cm->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+  // 送れなければ、まだ何も読んでいないので自分で処理できる
+  if (sendmsg(fd, &msg, MSG_NOSIGNAL) != sizeof(req)) {
+    free(body);
+    close(fd);
+    return -1;
+  }
+
+  int32_t status;
+  int err = WriteFull(fd, body, len) < 0 || ReadFull(fd, &status, sizeof(status)) < 0;
+  free(body);
+  close(fd);
+  if (err) {
+    fprintf(stderr, "nlpasm: lost connection to the server at '%s'\n", path);
+    return 1;
+  }
+  return status;
+}
+
+// 依頼の先頭とファイルディスクリプタを受け取る。戻り値: 正しい依頼なら 0
+static int ReceiveRequest(int conn, struct Request *req, int fds[3]) {
+  struct iovec iov = {req, sizeof(*req)};
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(int) * 3)];
+  } control;
+  struct msghdr msg = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = control.buf,
+    .msg_controllen = sizeof(control.buf),
+  };
+  ssize_t n = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC);
+  if (n <= 0) {
+    return -1;
+  }
+
+  int num_fds = 0;
+  for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+    if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS) {
+      num_fds = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      memcpy(fds, CMSG_DATA(cm), sizeof(int) * (num_fds < 3 ? num_fds : 3));
+      for (int i = 3; i < num_fds; i++) { // 余分なものは閉じる
+        int extra;
+        memcpy(&extra, CMSG_DATA(cm) + sizeof(int) * i, sizeof(int));
+        close(extra);
+      }
+    }
+  }
+  if (num_fds < 3 || (msg.msg_flags & MSG_CTRUNC) ||
+      ReadFull(conn, (char *)req + n, sizeof(*req) - n) < 0 ||
+      memcmp(req->magic, kMagic, sizeof(kMagic)) != 0 || req->len > MAX_REQUEST_LEN ||
+      req->argc == 0 || req->argc > req->len) { // 引数は 1 つ以上、それぞれ 1 バイト以上
+    for (int i = 0; i < num_fds && i < 3; i++) {
+      close(fds[i]);
+    }
+    return -1;
+  }
+  return 0;
+}
+
+// 標準入出力を依頼元のものに替え、依頼元のカレントディレクトリで NlpasmMain を実行する
+static int RunRequest(const char *cwd, int argc, char **argv, int fds[3]) {
+  fflush(stdout);
+  fflush(stderr);
+  int saved[3];
+  for (int i = 0; i < 3; i++) {
+    saved[i] = dup(i);
+    dup2(fds[i], i);
+    close(fds[i]);
+  }
+  clearerr(stdin);
+  __fpurge(stdin); // 前の依頼の入力を読み残していても捨てる
+
+  int status = 1;
+  int home = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (chdir(cwd) < 0) {
+    fprintf(stderr, "nlpasm: cannot change directory to '%s': %s\n", cwd, strerror(errno));
+  } else {
+    status = NlpasmMain(argc, argv);
+  }
+  if (home >= 0) {
+    if (fchdir(home) < 0) {
+      perror("nlpasm: fchdir");
+    }
+    close(home);
+  }
+
+  fflush(stdout);
+  fflush(stderr);
+  for (int i = 0; i < 3; i++) {
+    dup2(saved[i], i);
+    close(saved[i]);
+  }
+  return status;
+}
+
+static void HandleConnection(int conn) {
+  struct Request req;
+  int fds[3];
+  if (ReceiveRequest(conn, &req, fds) < 0) {
+    return;
+  }
+  char *body = XRealloc(NULL, req.len + 1);
+  char **argv = XRealloc(NULL, sizeof(char *) * (req.argc + 1));
+  int ok = ReadFull(conn, body, req.len) == 0;
+  body[req.len] = '\0';
+
+  // カレントディレクトリに続けて argc 個の引数が並んでいること
+  char *p = body, *end = body + req.len;
+  const char *cwd = p;
+  p += strlen(p) + 1;
+  uint32_t argc = 0;
+  for (; ok && argc < req.argc && p < end; argc++) {
+    argv[argc] = p;
+    p += strlen(p) + 1;
+  }
+  argv[argc] = NULL;
+  ok = ok && argc == req.argc && argc > 0 && p == end;
+
+  int32_t status = 1;
+  if (ok) {
+    status = RunRequest(cwd, argc, argv, fds);
+  } else {
+    for (int i = 0; i < 3; i++) {
+      close(fds[i]);
+    }
+  }
+  WriteFull(conn, &status, sizeof(status));
+  free(argv);
+  free(body);
+}
+
+// 依頼を 1 つずつ処理する。accept できなくなったら戻る。
+static void ServeLoop(int fd) {
+  struct ServeState state = {.include_cache = nlpasm_include_cache_new()};
+  pthread_mutex_init(&state.lock, NULL);
+  serving = &state;
+  for (;;) {
+    int conn = accept(fd, NULL, NULL);
+    if (conn < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      perror("accept");
+      break;
+    }
+    // 依頼を送り切らないまま止まったクライアントで、ほかの依頼を待たせ続けない
+    struct timeval timeout = {.tv_sec = REQUEST_TIMEOUT};
+    setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    HandleConnection(conn);
+    close(conn);
+    // 書き換えられたインクルードファイルの古い字句解析結果を捨てる
+    nlpasm_include_cache_trim(state.include_cache);
+  }
+
+  serving = NULL;
+  for (int i = 0; i < state.num_caches; i++) {
+    free(state.caches[i].path);
+    free(state.caches[i].data);
+  }
+  free(state.caches);
+  pthread_mutex_destroy(&state.lock);
+  nlpasm_include_cache_free(state.include_cache);
+}
+
+int Serve(const char *path) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "socket path too long: '%s'\n", path);
+    return 1;
+  }
+  strcpy(addr.sun_path, path);
+
+  // 前のサーバーが残したソケットファイルは消す。動いているサーバーがあれば譲らない。
+  // ソケット以外のファイルは消さない（ソースファイルを指定してしまったときなど）。
+  int probe = Connect(path);
+  if (probe >= 0) {
+    close(probe);
+    fprintf(stderr, "another server is already listening on '%s'\n", path);
+    return 1;
+  }
+  struct stat st;
+  if (lstat(path, &st) == 0) {
+    if (!S_ISSOCK(st.st_mode)) {
+      fprintf(stderr, "'%s' exists and is not a socket\n", path);
+      return 1;
+    }
+    unlink(path);
+  }
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    perror("socket");
+    return 1;
+  }
+  // ソケットに接続できるのは自分だけにする（依頼はこのユーザーの権限で実行される）
+  mode_t mask = umask(0077);
+  int err = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+  umask(mask);
+  if (err < 0 || listen(fd, 64) < 0) {
+    perror(path);
+    close(fd);
+    return 1;
+  }
+  signal(SIGPIPE, SIG_IGN); // 依頼元がいなくなっても止まらない
+
+  // 依頼はワーカープロセスで処理する。メモリ不足などで依頼の途中にワーカーが
+  // 終了しても（exit するのは NlpasmMain の中の XRealloc など）、ここで起動し直して
+  // サーバーとしては動き続ける。キャッシュはそのときに空に戻る。
+  pid_t self = getpid();
+  for (;;) {
+    fflush(stdout);
+    fflush(stderr);
+    time_t started = time(NULL);
+    pid_t pid = fork();
+    if (pid < 0) {
+      perror("fork");
+      break;
+    } else if (pid == 0) {
+      prctl(PR_SET_PDEATHSIG, SIGTERM); // サーバーを kill したらワーカーも止める
+      if (getppid() != self) {
+        _exit(WORKER_STOPPED);
+      }
+      ServeLoop(fd);
+      fflush(stderr);
+      _exit(WORKER_STOPPED);
+    }
+    int wstatus;
+    while (waitpid(pid, &wstatus, 0) < 0 && errno == EINTR) {
+    }
+    if (WIFEXITED(wstatus) && WEXITSTATUS(wstatus) == WORKER_STOPPED) {
+      break;
+    }
+    if (WIFSIGNALED(wstatus)) {
+      fprintf(stderr, "nlpasm: server worker killed by signal %d; restarting\n",
+              WTERMSIG(wstatus));
+    } else {
+      fprintf(stderr, "nlpasm: server worker exited with status %d; restarting\n",
+              WEXITSTATUS(wstatus));
+    }
+    if (time(NULL) - started < 1) { // 起動してすぐに終了を繰り返すなら間を置く
+      sleep(1);
+    }
+  }
+
+  close(fd);
+  unlink(path);
+  return 1;
+}
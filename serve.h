@@ -0,0 +1,31 @@
+#pragma once
+
+// nlpasm --serve: 常駐してアセンブルの依頼を受け付けるサーバーと、その薄いクライアント
+//
+// クライアント（環境変数 NLPASM_SERVER にソケットのパスを設定した nlpasm）は、
+// コマンドライン引数とカレントディレクトリ、標準入出力のファイルディスクリプタを
+// Unix ドメインソケットで送り、サーバーが同じ処理をしてその終了コードを返す。
+// 出力とエラーメッセージはサーバーからクライアントの標準出力・標準エラー出力へ直接書く。
+// サーバーは依頼をまたいで、取り込んだファイルの字句解析結果と、入力ファイルごとの
+// 行キャッシュを保つ。依頼はワーカープロセスで処理し、ワーカーが終了すれば起動し直す。
+
+#include "nlpasm.h"
+
+// path にソケットを作って依頼を順に処理する。戻り値: 始められなければ 1
+int Serve(const char *path);
+
+// path のサーバーに argv の処理を依頼する。
+// 戻り値: サーバーが返した終了コード。サーバーに接続できなければ -1（自分で処理する）
+int RunClient(const char *path, int argc, char **argv);
+
+// nlpasm のコマンドライン処理（main.c）。サーバーは依頼ごとにこれを呼ぶ。
+int NlpasmMain(int argc, char **argv);
+
+// サーバーの中で処理しているときに依頼をまたいで共有するインクルードファイルのキャッシュ。
+// サーバーでなければ NULL
+struct nlpasm_include_cache *ServeIncludeCache(void);
+
+// サーバーの中なら、前の依頼で path をアセンブルしたときの行キャッシュを ctx に読み込む
+void ServeLoadCache(struct nlpasm_ctx *ctx, const char *path);
+// サーバーの中なら、ctx の行キャッシュを path の次の依頼のために保存する
+void ServeSaveCache(struct nlpasm_ctx *ctx, const char *path);
@@ -1,6 +1,6 @@
 #!/bin/bash -u
 
-make
+make all nlpbench
 
 ok=0
 fail=0
@@ -20,6 +20,22 @@ function test_stdout() {
   fi
 }
 
+# ファイルやパイプを使うテスト：name の結果 got が want と同じであること
+function check() {
+  name="$1"
+  got="$2"
+  want="$3"
+
+  if [ "$want" = "$got" ]
+  then
+    echo "[  OK  ]: $name -> $got"
+    ok=$((ok + 1))
+  else
+    echo "[FAILED]: $name -> $got, want $want"
+    fail=$((fail + 1))
+  fi
+}
+
 test_stdout "1225 E132"      "add.c a, sp, 0x32"
 test_stdout "1225 E200 0032" "add.c a, sp, word 0x32"
 test_stdout "1225 E200 FFFE" "add.c a, sp, @1"
@@ -65,10 +81,214 @@ test_stdout "2415 6000" "sal a, b"
 test_stdout "2A16 7000" "ror b, c"
 test_stdout "2216 7000" "rol b, c"
 test_stdout "BEEF" ".dw 0xbeef"
+test_stdout "1215 6700" "ADD A, B, C"
+test_stdout "00B5 6000" "mov.nb a, b"
+test_stdout "0015 2000 0103" "
+    .origin 0x100
+    mov a, far
+far:"
+test_stdout "121D D101 0001" "
+    .origin 0x100
+    jmp far
+    .dw 1
+far:"
+test_stdout "121D D200 0200 0000" "
+    jmp @far
+    .origin 0x103
+    .dw 0
+    .origin 0x203
+far:"
+test_stdout "" "
+dup:
+dup:
+    ret"
 test_stdout "1215 E132" "
     add a, sp, 0x32 # sp+0x32 を add に代入
     # コメントは無視
     "
+test_stdout "1215 5101 117D D104 1216 6101 117D D104 1217 7101 1217 7101" "
+.macro count r
+loop:
+    add r, r, 1
+    jmp.nz @loop
+.endm
+    count a
+    count b
+    .rept 2
+    add c, c, 1
+    .endr"
+test_stdout "0015 100A 0016 1008 0017 1012 8918 E105" "
+.equ N, 4
+.set I, 1
+.set I, I + 1
+top:
+    mov a, N*2 + I
+    mov b, end - top
+    mov c, hi(0x1234)
+    load d, sp - (N + 1)
+end:"
+# 長い式：トークンの数に上限が無いこと（マクロの実引数で置き換えた後も）
+long_expr=$(printf '1 + %.0s' $(seq 99))1
+test_stdout "0015 1064 0016 10C8" "
+.macro twice r, x
+    mov r, x + x
+.endm
+    mov a, $long_expr
+    twice b, $long_expr"
+
+# バッチモード：ファイルごとに出力ファイルができること
+batch_dir=$(mktemp -d)
+echo "push a" > $batch_dir/a.asm
+echo "pop addr" > $batch_dir/b.asm
+./nlpasm --batch $batch_dir/a.asm $batch_dir/b.asm -o $batch_dir/out
+got=$(echo $(cat $batch_dir/out/a.txt $batch_dir/out/b.txt))
+check "--batch" "$got" "D015 C01C"
+# 別のディレクトリの同じ名前の入力は同じ出力ファイルになるので、エラーにすること
+mkdir $batch_dir/x
+echo "push b" > $batch_dir/x/a.asm
+./nlpasm --batch $batch_dir/a.asm $batch_dir/x/a.asm -o $batch_dir/out2 2>/dev/null
+got="$? $(ls $batch_dir/out2)"
+check "--batch same output" "$got" "1 "
+rm -rf $batch_dir
+
+# インクリメンタル：キャッシュを使った再アセンブルでも結果が変わらないこと
+inc_dir=$(mktemp -d)
+printf 'loop:\n    add a, a, 1\n    jmp.nz @loop\n' > $inc_dir/a.asm
+./nlpasm --incremental $inc_dir/a.asm -o $inc_dir/a.txt
+printf 'loop:\n    add a, a, 1\n    push a\n    jmp.nz @loop\n' > $inc_dir/a.asm
+./nlpasm --incremental $inc_dir/a.asm -o $inc_dir/a.txt
+got=$(echo $(cat $inc_dir/a.txt))
+check "--incremental" "$got" "1215 5101 D015 117D D105"
+rm -rf $inc_dir
+
+# .include：2 回目以降は取り込まず、-MD で取り込んだファイルが依存ファイルに並ぶこと
+inc_dir=$(mktemp -d)
+mkdir $inc_dir/lib
+printf '.equ PORT, 0x20\n.macro out r\n    store PORT, r\n.endm\n' > $inc_dir/lib/io.inc
+printf '.include "io.inc"\n.include "io.inc"\n    out a\n' > $inc_dir/a.asm
+./nlpasm -I $inc_dir/lib $inc_dir/a.asm -o $inc_dir/a.txt -MD
+got=$(echo $(cat $inc_dir/a.txt) / $(cat $inc_dir/a.d))
+want="9015 1020 / $inc_dir/a.txt: $inc_dir/a.asm \\ $inc_dir/lib/io.inc $inc_dir/lib/io.inc:"
+check ".include" "$got" "$want"
+rm -rf $inc_dir
+
+# データ：9 個以上の .dw、.fill、.string、-l での .incbin が 1 つのワード列になること
+data_dir=$(mktemp -d)
+printf 'AB\001' > $data_dir/a.bin
+printf '.dw 1, 2, 3, 4, 5, 6, 7, 8, 9, 10\n.fill 2, 7\n.string "hi"\n.incbin "a.bin"\n' > $data_dir/d.asm
+got=$(echo $(./nlpasm -l $data_dir/d.asm))
+want="0001 0002 0003 0004 0005 0006 0007 0008 0009 000A 0007 0007 6968 0000 4241 0001"
+check "data directives" "$got" "$want"
+rm -rf $data_dir
+
+# .lowdata：参照されるデータが 0〜255 に置かれ、2 ワードの命令で参照できること
+got=$(printf '.origin 0x100\n    load a, count\n    store count, a\n.lowdata\ncount:\n    .dw 7\n.text\n' \
+  | ./nlpasm 2>&1 | tr '\n' ' ')
+want="8015 1000 9015 1000 0007 <stdin>:6: 'count' (1 word, 2 refs) placed at 0x0000 (saves 2 words) <stdin>: 1 of 1 .lowdata block placed below 0x100, 2 words saved "
+check ".lowdata" "$got" "$want"
+
+# 分割アセンブル：.global のラベルだけがオブジェクト間で解決されること
+obj_dir=$(mktemp -d)
+printf '.global main\nmain:\n    call sub1\nloop:\n    jmp loop\n' > $obj_dir/a.asm
+printf '.global sub1\nsub1:\n    add a, a, 1\nloop:\n    jmp.nz @loop\n    ret\n' > $obj_dir/b.asm
+./nlpasm -c $obj_dir/a.asm -o $obj_dir/a.o
+./nlpasm -c $obj_dir/b.asm -o $obj_dir/b.o
+got=$(echo $(./nlplink $obj_dir/a.o $obj_dir/b.o))
+want="B01D 1004 001D 1002 1215 5101 117D D102 C01D"
+check "nlplink" "$got" "$want"
+rm -rf $obj_dir
+
+# --emit：.origin の隙間を反映したイメージを複数の形式で書き出すこと
+emit_dir=$(mktemp -d)
+printf '    mov a, 1\n    .origin 4\n    .dw 0x1234\n    .origin 0x8000\n    .dw 0xabcd\n' \
+  | ./nlpasm -f bin --fill 0xff00 -o $emit_dir/a.bin --emit ihex=$emit_dir/a.hex \
+      --emit readmemh=$emit_dir/a.mem --emit hi=$emit_dir/a.hi
+got=$(echo $(od -An -tx1 -N12 $emit_dir/a.bin) $(stat -c %s $emit_dir/a.bin) \
+      $(sed -n 3,5p $emit_dir/a.hex) $(cat $emit_dir/a.mem) $(od -An -tx1 -N5 $emit_dir/a.hi))
+want="00 15 10 01 ff 00 ff 00 12 34 ff 00 65538 :020000040001F9 :02000000ABCD86 :00000001FF @0 0015 1001 @4 1234 @8000 ABCD 00 10 ff ff 12"
+check "--emit" "$got" "$want"
+rm -rf $emit_dir
+
+# -f bin の標準出力を >> で既存のファイルに足しても、元の中身を残すこと
+app_dir=$(mktemp -d)
+printf 'ABC' > $app_dir/app.bin
+printf '    .dw 0x4445\n' | ./nlpasm -f bin >> $app_dir/app.bin
+check "-f bin >>" "$(cat $app_dir/app.bin)" "ABCDE"
+rm -rf $app_dir
+
+# -D：逆アセンブルした結果をアセンブルし直すと元のイメージに戻ること
+dis_dir=$(mktemp -d)
+printf '    add.c a, sp, word 0x32\n    jmp a - b\n    jmp.nz @0\n    cmp.z a, 0x123\n    load a, ip-0x123\n    store c + word 5, b\n    pop ip\n    mov ip, word 5\n    .dw 0xffff, 0x1234, 0\n' \
+  | ./nlpasm -f bin -l -o $dis_dir/a.bin
+./nlpasm -D -l $dis_dir/a.bin | ./nlpasm -f bin -l -o $dis_dir/b.bin
+got=$(cmp $dis_dir/a.bin $dis_dir/b.bin && echo same)
+check "-D round trip" "$got" "same"
+rm -rf $dis_dir
+
+# -O：書き換えた後もラベルのアドレスが合っていること
+got=$(echo $(printf 'start:\n    mov b, b\n    add a, a, 1\n    call f\n    ret\nf:\n    jmp @start\n' | ./nlpasm -O 2>/dev/null))
+check "-O" "$got" "1B15 5000 001D 1004 111D D106"
+
+# --cycles：ルーチンの最悪経路のサイクル数
+got=$(printf '    call f\n    ret\nf:\n    push a\n    pop a\n    ret\n' | ./nlpasm --cycles | grep '^0003 f' | awk '{print $3}')
+check "--cycles" "$got" "6"
+
+# nlpsim：アセンブルしたループを実行した結果
+got=$(printf '    mov b, 10\nloop:\n    add a, a, 3\n    dec b, b\n    jmp.nz @loop\nend:\n    jmp @end\n' | ./nlpasm | ./nlpsim | grep -o "a=[0-9A-F]*")
+check "nlpsim" "$got" "a=001E"
+
+# nlpsim：-d のアドレスの欄の位置に読み込むので .origin で飛ばした先を呼べる
+got=$(printf '    call f\ndone:\n    jmp @done\n.origin 0x300\nf:\n    mov a, 7\n    ret\n' | ./nlpasm -d | ./nlpsim | grep -o "a=[0-9A-F]*")
+check "nlpsim -d .origin" "$got" "a=0007"
+
+# --advise：伸びた理由が分かること
+got=$(echo "add a, b, word 5" | ./nlpasm --advise | grep -o "'word' prefix")
+check "--advise" "$got" "'word' prefix"
+
+# --stats=json：集計が標準エラー出力に出ること
+got=$(echo "push a" | ./nlpasm --stats=json 2>&1 >/dev/null | grep -o '"insns_1word": [0-9]*')
+check "--stats=json" "$got" '"insns_1word": 1'
+
+# エラーから回復して、すべてのエラーを行と桁とともにソースの順に報告すること
+# （ラベルの解決のエラーは最後に見つかるが、その行の位置に並ぶ）
+got=$(printf 'start:\n    jmp nowhere\n    bogus a\n    mov a, [\n    ret\n' | ./nlpasm 2>&1 | tr '\n' ' ')
+want="<stdin>:2:9: error: unknown label: nowhere <stdin>:3:5: error: unknown mnemonic: 'bogus' <stdin>:4:12: error: unexpected character:: '[' "
+check "collect-all diagnostics" "$got" "$want"
+got=$(printf '    bogus\n    bogus\n    bogus\n' | ./nlpasm --max-errors 2 --diagnostics=json 2>&1)
+want='{"file": "<stdin>", "errors": 2, "stopped": true, "diagnostics": [{"file": "<stdin>", "line": 1, "column": 5, "message": "unknown mnemonic: '"'bogus'"'"}, {"file": "<stdin>", "line": 2, "column": 5, "message": "unknown mnemonic: '"'bogus'"'"}]}'
+check "--diagnostics=json" "$got" "$want"
+
+# --serve：クライアントの依頼をサーバーが処理し、書き換えた取り込みファイルも読み直すこと
+serve_dir=$(mktemp -d)
+./nlpasm --serve $serve_dir/sock 2>$serve_dir/err &
+serve_pid=$!
+for i in $(seq 50); do [ -S $serve_dir/sock ] && break; sleep 0.1; done
+printf '.include "c.inc"\n    mov a, X\n' > $serve_dir/a.asm
+printf '.equ X, 5\n' > $serve_dir/c.inc
+got1=$(cd $serve_dir && NLPASM_SERVER=$serve_dir/sock $OLDPWD/nlpasm a.asm | tr '\n' ' ')
+printf '.equ X, 0x17\n' > $serve_dir/c.inc
+got2=$(cd $serve_dir && NLPASM_SERVER=$serve_dir/sock $OLDPWD/nlpasm a.asm | tr '\n' ' ')
+got3=$(echo "push a" | NLPASM_SERVER=$serve_dir/sock ./nlpasm)
+# 出力先が途中で閉じても、サーバー（のワーカー）は止まらずに次の依頼を処理すること
+yes '    mov a, 1' | head -n 200000 | NLPASM_SERVER=$serve_dir/sock ./nlpasm 2>/dev/null | head -c 1 >/dev/null
+got4=$(echo "push b" | NLPASM_SERVER=$serve_dir/sock ./nlpasm)
+kill -0 $serve_pid && [ ! -s $serve_dir/err ] && got4="$got4 running"
+kill $serve_pid
+wait $serve_pid 2>/dev/null
+got="$got1/ $got2/ $got3 $got4"
+want="0015 1005 / 0015 1017 / D015 D016 running"
+check "--serve" "$got" "$want"
+
+# --serve：ソケット以外の既存のファイルは消さずにエラーにすること
+printf '    mov a, 1\n' > $serve_dir/keep.asm
+./nlpasm --serve $serve_dir/keep.asm 2>/dev/null
+got="$? $(cat $serve_dir/keep.asm)"
+check "--serve on a file" "$got" "1     mov a, 1"
+rm -rf $serve_dir
+
+# nlpbench：生成したソースを make bench と同じ出力形式すべてでアセンブルできること
+got=$(./nlpbench -s 1000,100000 -r 1 >/dev/null && echo ok)
+check "nlpbench" "$got" "ok"
 
 echo "----"
 echo "PASSED: $ok, FAILED $fail"